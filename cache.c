@@ -0,0 +1,401 @@
+/*INCLUDE*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "cache.h"
+
+/*FUNCTION DECLARATION*/
+static bool cache_copy(unsigned, void*);
+static int cache_wait_read(unsigned);
+static int cache_take_slot(unsigned);
+static void cache_finish_prefetch();
+static void cache_readahead(unsigned);
+static bool cache_in_writeback(unsigned);
+
+/*GLOBAL VARIABLES*/
+static data_cluster cache_data[CACHE_CLUSTERS] __attribute__((aligned(SECTOR_SIZE))); // Alinhado para o modo O_DIRECT (device.h).
+static unsigned cache_block[CACHE_CLUSTERS];
+static unsigned char cache_state[CACHE_CLUSTERS];
+static bool cache_referenced[CACHE_CLUSTERS];
+static bool cache_dirty[CACHE_CLUSTERS];
+static unsigned cache_generation[CACHE_CLUSTERS]; // Coleta que levou o cluster para gravação (0 = nenhuma).
+static short cache_slot[NUM_CLUSTER]; // Posição de cada cluster no cache, -1 se ausente.
+static unsigned cache_hand;
+static unsigned num_dirty;
+static unsigned num_reading; // Posições em CACHE_READING.
+static pthread_mutex_t cache_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP; // Recursivo: a leitura antecipada de cache_read passa por cache_prefetch.
+static pthread_cond_t cache_read_done = PTHREAD_COND_INITIALIZER; // Sinalizada quando uma posição sai de CACHE_READING.
+
+// Cada coleta de clusters alterados recebe um número; written_generation é a última já gravada (atualizada pelo flusher).
+static void (*request_writeback)(bool); // Pede uma gravação ao flusher (false) ou faz uma imediata (true).
+static unsigned collected_generation;
+static unsigned written_generation;
+
+// Leitura antecipada em andamento (no máximo uma) e o estado da detecção de acesso sequencial.
+static device_batch_t prefetch_batch;
+static bool prefetch_in_flight;
+static unsigned (*next_cluster)(unsigned); // Próximo cluster da cadeia, ou 0xffff no fim.
+static unsigned expected_block = 0xffff;
+static unsigned readahead_window;
+
+// Esvazia o cache (a imagem foi criada ou carregada de novo, sem gravações pendentes) e registra quem informa o próximo cluster
+// de cada cadeia e quem grava os clusters alterados.
+void cache_reset(unsigned (*successor)(unsigned), void (*writeback)(bool))
+{
+	pthread_mutex_lock(&cache_lock);
+	cache_finish_prefetch();
+	while (num_reading > 0)
+		pthread_cond_wait(&cache_read_done, &cache_lock);
+
+	memset(cache_state, CACHE_EMPTY, sizeof(cache_state));
+	memset(cache_referenced, 0x00, sizeof(cache_referenced));
+	memset(cache_dirty, 0x00, sizeof(cache_dirty));
+	memset(cache_generation, 0x00, sizeof(cache_generation));
+	num_dirty = 0;
+	for (int i = 0; i < NUM_CLUSTER; i++)
+		cache_slot[i] = -1;
+	cache_hand = 0;
+
+	next_cluster = successor;
+	request_writeback = writeback;
+	expected_block = 0xffff;
+	readahead_window = 0;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+// Lê um cluster (do cache ou do disco) e, caso o acesso continue uma cadeia, amplia a janela de leitura antecipada.
+void cache_read(unsigned block, void* buffer)
+{
+	// Posições fora da área de dados não passam pelo cache.
+	if (block >= NUM_CLUSTER)
+	{
+		cluster_io_t io = { block, buffer };
+		device_read_clusters(&io, 1);
+		return;
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	if (!cache_copy(block, buffer))
+	{
+		// O disco é lido sem cache_lock, para não parar as outras threads; quem procurar o cluster enquanto isso espera em
+		// cache_wait_read. Sem posição livre (só clusters alterados), o cluster é lido direto para buffer, sem entrar no cache:
+		// quem lê não pode forçar a gravação, que copia a FAT que um pedido de escrita pode estar alterando.
+		int slot = cache_take_slot(block);
+		if (slot >= 0)
+		{
+			cache_state[slot] = CACHE_READING;
+			num_reading++;
+		}
+		pthread_mutex_unlock(&cache_lock);
+
+		cluster_io_t io = { block, slot >= 0 ? (void*) &cache_data[slot] : buffer };
+		bool success = device_read_clusters(&io, 1);
+
+		pthread_mutex_lock(&cache_lock);
+		if (slot >= 0)
+		{
+			num_reading--;
+			cache_state[slot] = success ? CACHE_VALID : CACHE_EMPTY;
+			if (success)
+				memcpy(buffer, &cache_data[slot], CLUSTER_SIZE);
+			else
+				cache_slot[block] = -1;
+			pthread_cond_broadcast(&cache_read_done);
+		}
+
+		if (!success)
+		{
+			// Erro de leitura (ou imagem truncada): o cluster não fica no cache e é lido de novo no próximo acesso.
+			fprintf(stderr, "Erro de leitura do cluster %u na imagem.\n", block);
+			memset(buffer, 0x00, CLUSTER_SIZE);
+		}
+	}
+
+	cache_readahead(block);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+// O cluster fica alterado no cache; o disco só é atualizado quando o flusher o coletar.
+void cache_write(unsigned block, void* buffer)
+{
+	if (block >= NUM_CLUSTER)
+	{
+		cluster_io_t io = { block, buffer };
+		device_write_clusters(&io, 1);
+		return;
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	int slot = -1;
+	while (true)
+	{
+		slot = cache_wait_read(block);
+		if (slot >= 0 && cache_state[slot] == CACHE_LOADING)
+		{
+			cache_finish_prefetch();
+			slot = cache_slot[block];
+		}
+
+		if (slot < 0)
+			slot = cache_take_slot(block);
+		if (slot >= 0 || request_writeback == NULL)
+			break;
+
+		// Só restam clusters alterados: eles são gravados na hora, sem cache_lock (a gravação coleta o cache, e o flusher pode
+		// estar esperando por ele). Quem escreve já tem o volume como sync_volume exige.
+		pthread_mutex_unlock(&cache_lock);
+		request_writeback(true);
+		pthread_mutex_lock(&cache_lock);
+	}
+
+	memcpy(&cache_data[slot], buffer, CLUSTER_SIZE);
+	cache_state[slot] = CACHE_VALID;
+	cache_referenced[slot] = true;
+
+	if (!cache_dirty[slot])
+	{
+		cache_dirty[slot] = true;
+		num_dirty++;
+		if (num_dirty >= CACHE_DIRTY_LIMIT && request_writeback != NULL)
+			request_writeback(false);
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+// Copia o cluster para buffer caso ele esteja no cache (esperando a leitura antecipada, se for o caso), sem ir ao disco.
+bool cache_lookup(unsigned block, void* buffer)
+{
+	if (block >= NUM_CLUSTER)
+		return false;
+
+	pthread_mutex_lock(&cache_lock);
+	bool found = cache_copy(block, buffer);
+	pthread_mutex_unlock(&cache_lock);
+	return found;
+}
+
+// Descarta a cópia de um cluster escrito por fora do cache (gravações em lote, clusters devolvidos ao host), inclusive alterações
+// ainda não gravadas. Quem escreve por fora precisa antes esperar as gravações em andamento.
+void cache_invalidate(unsigned block)
+{
+	pthread_mutex_lock(&cache_lock);
+	int slot = block < NUM_CLUSTER ? cache_wait_read(block) : -1;
+	if (slot >= 0 && cache_state[slot] == CACHE_LOADING)
+	{
+		cache_finish_prefetch();
+		slot = cache_slot[block];
+	}
+
+	if (slot >= 0)
+	{
+
+		if (cache_dirty[slot])
+			num_dirty--;
+		cache_dirty[slot] = false;
+		cache_generation[slot] = 0;
+		cache_state[slot] = CACHE_EMPTY;
+		cache_slot[block] = -1;
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+}
+
+// Lê antecipadamente, de forma assíncrona, os clusters que ainda não estão no cache (por exemplo, os subdiretórios de um diretório listado).
+void cache_prefetch(unsigned* blocks, unsigned num_blocks)
+{
+	pthread_mutex_lock(&cache_lock);
+	cache_finish_prefetch();
+
+	if (num_blocks > CACHE_CLUSTERS / 2)
+		num_blocks = CACHE_CLUSTERS / 2;
+
+	cluster_io_t* ios = (cluster_io_t*) malloc((num_blocks + 1) * sizeof(cluster_io_t));
+	unsigned num_ios = 0;
+	for (unsigned i = 0; i < num_blocks; i++)
+	{
+		if (blocks[i] < 10 || blocks[i] >= NUM_CLUSTER || cache_slot[blocks[i]] >= 0)
+			continue;
+
+		int slot = cache_take_slot(blocks[i]);
+		if (slot < 0)
+			break;
+
+		cache_state[slot] = CACHE_LOADING;
+		ios[num_ios].block = blocks[i];
+		ios[num_ios].buffer = &cache_data[slot];
+		num_ios++;
+	}
+
+	if (num_ios > 0)
+	{
+		device_submit(&prefetch_batch, ios, num_ios, false);
+		prefetch_in_flight = true;
+	}
+
+	free(ios);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+unsigned cache_dirty_count()
+{
+	return __atomic_load_n(&num_dirty, __ATOMIC_RELAXED);
+}
+
+// Copia os clusters alterados (e suas posições) para ios e clusters, que precisam ter espaço para CACHE_CLUSTERS clusters, e
+// os marca como limpos. Eles ficam presos no cache até cache_writeback_done receber o número da coleta, devolvido em generation.
+unsigned cache_collect_dirty(cluster_io_t* ios, data_cluster* clusters, unsigned* generation)
+{
+	pthread_mutex_lock(&cache_lock);
+	unsigned num_collected = 0;
+	collected_generation++;
+	for (unsigned slot = 0; slot < CACHE_CLUSTERS; slot++)
+	{
+		if (!cache_dirty[slot])
+			continue;
+
+		memcpy(&clusters[num_collected], &cache_data[slot], CLUSTER_SIZE);
+		ios[num_collected].block = cache_block[slot];
+		ios[num_collected].buffer = &clusters[num_collected];
+		num_collected++;
+
+		cache_dirty[slot] = false;
+		cache_generation[slot] = collected_generation;
+	}
+
+	num_dirty = 0;
+	*generation = collected_generation;
+	pthread_mutex_unlock(&cache_lock);
+	return num_collected;
+}
+
+// Chamado pelo flusher (sem acesso ao restante do cache) quando a gravação de uma coleta termina.
+void cache_writeback_done(unsigned generation)
+{
+	__atomic_store_n(&written_generation, generation, __ATOMIC_RELEASE);
+}
+
+// cache_lookup com cache_lock já travado (uma única vez: a espera por uma leitura solta a trava).
+static bool cache_copy(unsigned block, void* buffer)
+{
+	int slot = cache_wait_read(block);
+	if (slot >= 0 && cache_state[slot] == CACHE_LOADING)
+	{
+		// Uma leitura antecipada que falhou tira o cluster do cache.
+		cache_finish_prefetch();
+		slot = cache_slot[block];
+	}
+
+	if (slot >= 0)
+	{
+		cache_referenced[slot] = true;
+		memcpy(buffer, &cache_data[slot], CLUSTER_SIZE);
+	}
+
+	return slot >= 0;
+}
+
+// Espera terminar a leitura de block por cache_read em outra thread, caso haja uma, e retorna a posição do cluster (ou -1). Precisa
+// de cache_lock travado uma única vez, pois a espera o solta.
+static int cache_wait_read(unsigned block)
+{
+	while (cache_slot[block] >= 0 && cache_state[cache_slot[block]] == CACHE_READING)
+		pthread_cond_wait(&cache_read_done, &cache_lock);
+
+	return cache_slot[block];
+}
+
+// Escolhe uma posição livre (ou a menos usada recentemente, pelo relógio) para block. Posições em leitura (antecipada ou não),
+// alteradas ou em gravação não são reaproveitadas; se nenhuma outra sobrar após duas voltas, o flusher é acordado e o retorno é
+// -1. Cabe a quem chama decidir se espera a gravação.
+static int cache_take_slot(unsigned block)
+{
+	for (unsigned scanned = 0; true; scanned++)
+	{
+		if (scanned == 2 * CACHE_CLUSTERS)
+		{
+			if (request_writeback != NULL)
+				request_writeback(false);
+			return -1;
+		}
+
+		unsigned slot = cache_hand;
+		cache_hand = (cache_hand + 1) % CACHE_CLUSTERS;
+
+		if (cache_state[slot] == CACHE_LOADING || cache_state[slot] == CACHE_READING || cache_dirty[slot] || cache_in_writeback(slot))
+			continue;
+
+		if (cache_state[slot] == CACHE_VALID && cache_referenced[slot])
+		{
+			cache_referenced[slot] = false;
+			continue;
+		}
+
+		if (cache_state[slot] == CACHE_VALID)
+			cache_slot[cache_block[slot]] = -1;
+
+		cache_state[slot] = CACHE_EMPTY;
+		cache_generation[slot] = 0;
+		cache_block[slot] = block;
+		cache_slot[block] = slot;
+		cache_referenced[slot] = true;
+		return slot;
+	}
+}
+
+// Espera a leitura antecipada em andamento e torna válidos os clusters lidos por ela.
+static void cache_finish_prefetch()
+{
+	if (!prefetch_in_flight)
+		return;
+
+	// Se a leitura falhar, os clusters dela saem do cache e o erro aparece quando algum deles for lido.
+	bool success = device_wait(&prefetch_batch);
+	prefetch_in_flight = false;
+	for (unsigned slot = 0; slot < CACHE_CLUSTERS; slot++)
+	{
+		if (cache_state[slot] != CACHE_LOADING)
+			continue;
+
+		cache_state[slot] = success ? CACHE_VALID : CACHE_EMPTY;
+		if (!success)
+			cache_slot[cache_block[slot]] = -1;
+	}
+}
+
+// Acesso ao cluster seguinte da cadeia do último lido: a janela abre (ou dobra) e os próximos clusters da cadeia que não estão
+// no cache são pedidos ao disco. Qualquer outro acesso fecha a janela.
+static void cache_readahead(unsigned block)
+{
+	if (next_cluster == NULL)
+		return;
+
+	if (block == expected_block)
+		readahead_window = readahead_window == 0 ? CACHE_MIN_READAHEAD : (readahead_window * 2 > CACHE_MAX_READAHEAD ? CACHE_MAX_READAHEAD : readahead_window * 2);
+	else
+		readahead_window = 0;
+
+	expected_block = next_cluster(block);
+	if (readahead_window == 0 || prefetch_in_flight)
+		return;
+
+	unsigned ahead[CACHE_MAX_READAHEAD];
+	unsigned num_ahead = 0;
+	unsigned next_block = expected_block;
+	for (unsigned k = 0; k < readahead_window && next_block != 0xffff; k++)
+	{
+		if (cache_slot[next_block] < 0)
+			ahead[num_ahead++] = next_block;
+		next_block = next_cluster(next_block);
+	}
+
+	if (num_ahead > 0)
+		cache_prefetch(ahead, num_ahead);
+}
+
+// O cluster da posição foi coletado e sua gravação ainda não terminou: fora do cache, uma leitura do disco veria o conteúdo antigo.
+static bool cache_in_writeback(unsigned slot)
+{
+	return cache_generation[slot] > __atomic_load_n(&written_generation, __ATOMIC_ACQUIRE);
+}
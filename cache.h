@@ -0,0 +1,36 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+/*INCLUDE*/
+#include <stdbool.h>
+#include "fat.h"
+#include "device.h"
+
+/*DEFINE*/
+// Cache de clusters de dados sobre a camada de dispositivo, com substituição pelo algoritmo do relógio. As escritas ficam no
+// cache (write-back) até serem coletadas por cache_collect_dirty; os clusters coletados continuam no cache, sem poder sair dele,
+// até cache_writeback_done confirmar a gravação. Ao passar de CACHE_DIRTY_LIMIT clusters alterados o cache pede uma gravação em
+// segundo plano. Quando só restam clusters alterados para substituir, cache_write pede uma gravação imediata (sem segurar o cache),
+// e cache_read lê o cluster sem guardá-lo. Todas as funções podem ser chamadas de várias threads (modo servidor). A leitura antecipada segue a cadeia da FAT: acessos em sequência na cadeia abrem uma janela que
+// dobra a cada acerto (de CACHE_MIN_READAHEAD até CACHE_MAX_READAHEAD clusters), lida de forma assíncrona.
+#define CACHE_CLUSTERS		256
+#define CACHE_MIN_READAHEAD	4
+#define CACHE_MAX_READAHEAD	64
+#define CACHE_DIRTY_LIMIT	(CACHE_CLUSTERS / 4)
+
+#define CACHE_EMPTY		0
+#define CACHE_VALID		1
+#define CACHE_LOADING		2 // Faz parte da leitura antecipada em andamento.
+#define CACHE_READING		3 // Sendo lido do disco por cache_read, que não segura o cache durante a leitura.
+
+void cache_reset(unsigned (*)(unsigned), void (*)(bool));
+void cache_read(unsigned, void*);
+void cache_write(unsigned, void*);
+bool cache_lookup(unsigned, void*);
+void cache_invalidate(unsigned);
+void cache_prefetch(unsigned*, unsigned);
+unsigned cache_dirty_count();
+unsigned cache_collect_dirty(cluster_io_t*, data_cluster*, unsigned*);
+void cache_writeback_done(unsigned);
+
+#endif
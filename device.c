@@ -0,0 +1,514 @@
+/*INCLUDE*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include "device.h"
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+/*DEFINE*/
+#define MAX_RUN_CLUSTERS	IOV_MAX // Maior trecho contíguo enviado em uma única operação.
+#define IMAGE_SIZE		((off_t) NUM_CLUSTER * CLUSTER_SIZE) // Tamanho da imagem criada pelo init e pelo mkfat16.
+
+/*FUNCTION DECLARATION*/
+static int compare_cluster_ios(const void*, const void*);
+static void run_sync(device_batch_t*, unsigned);
+static void finish_run(device_batch_t*, unsigned, long);
+static void free_batch(device_batch_t*);
+static void* pool_take();
+static void pool_give(void*);
+#ifdef USE_IO_URING
+static bool uring_setup();
+static void uring_teardown();
+static void uring_push(device_batch_t*);
+static void uring_wait();
+static void uring_reap();
+#endif
+
+/*GLOBAL VARIABLES*/
+static int device_fd = -1;
+static bool direct_io; // Imagem aberta com O_DIRECT.
+
+// Arena de buffers de um cluster alinhados a SECTOR_SIZE, que cresce DEVICE_POOL_CHUNK buffers por vez e nunca devolve memória.
+static void** pool_free;
+static unsigned pool_num_free;
+static unsigned pool_size;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef USE_IO_URING
+// Filas de submissão e de conclusão compartilhadas com o kernel (mmap), usadas sem a liburing.
+struct _uring_t
+{
+	int fd;
+	unsigned entries;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_sqe* sqes;
+	struct io_uring_cqe* cqes;
+	void* sq_ring;
+	size_t sq_ring_size;
+	void* cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+	unsigned in_flight;
+	bool waiting; // Uma thread espera conclusões no kernel, sem ring_lock, e as entrega a todos os lotes.
+	device_batch_t* slot_batch[DEVICE_QUEUE_DEPTH]; // Lote e trecho de cada operação em andamento (user_data é o índice).
+	unsigned slot_run[DEVICE_QUEUE_DEPTH];
+};
+
+static struct _uring_t ring = { .fd = -1 };
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER; // A fila é usada também pelo flusher; quem recolhe as conclusões as entrega ao lote de cada uma.
+static pthread_cond_t ring_reaped = PTHREAD_COND_INITIALIZER; // Sinalizada a cada recolhimento, para quem esperava pela thread no kernel.
+#endif
+
+// Abre a imagem para as operações de clusters (fechando a anterior, caso haja) e, se disponível, prepara o io_uring.
+bool device_open(const char* path)
+{
+	device_close();
+
+#ifdef USE_DIRECT_IO
+	// Alguns sistemas de arquivos aceitam O_DIRECT na abertura e recusam as operações: uma leitura de teste decide o modo.
+	device_fd = open(path, O_RDWR | O_DIRECT);
+	if (device_fd >= 0)
+	{
+		void* probe = pool_take();
+		direct_io = pread(device_fd, probe, CLUSTER_SIZE, 10 * CLUSTER_SIZE) >= 0;
+		pool_give(probe);
+		if (!direct_io)
+			close(device_fd);
+	}
+#endif
+
+	if (!direct_io)
+		device_fd = open(path, O_RDWR);
+	if (device_fd < 0)
+		return false;
+
+#ifdef USE_IO_URING
+	uring_setup();
+#endif
+	return true;
+}
+
+void device_close()
+{
+#ifdef USE_IO_URING
+	uring_teardown();
+#endif
+	if (device_fd >= 0)
+		close(device_fd);
+	device_fd = -1;
+	direct_io = false;
+}
+
+const char* device_backend()
+{
+#ifdef USE_IO_URING
+	if (ring.fd >= 0)
+		return "io_uring";
+#endif
+	return "preadv/pwritev";
+}
+
+// Memória zerada e alinhada a SECTOR_SIZE (liberada com free), usada pelo modo O_DIRECT sem cópia para a arena.
+void* device_alloc(size_t size)
+{
+	void* buffer = NULL;
+	if (posix_memalign(&buffer, SECTOR_SIZE, size) != 0)
+		return NULL;
+
+	memset(buffer, 0x00, size);
+	return buffer;
+}
+
+// Versões síncronas: enviam o lote e esperam por ele. Retornam false caso alguma operação falhe.
+bool device_read_clusters(cluster_io_t* ios, unsigned num_ios)
+{
+	device_batch_t batch;
+	device_submit(&batch, ios, num_ios, false);
+	return device_wait(&batch);
+}
+
+bool device_write_clusters(cluster_io_t* ios, unsigned num_ios)
+{
+	device_batch_t batch;
+	device_submit(&batch, ios, num_ios, true);
+	return device_wait(&batch);
+}
+
+// Envia um lote sem esperar por ele: ordena as operações por posição no disco, junta os clusters vizinhos em trechos e coloca
+// na fila quantos trechos couberem. Os buffers precisam continuar válidos até device_wait. Sem io_uring, o lote é executado aqui.
+void device_submit(device_batch_t* batch, cluster_io_t* ios, unsigned num_ios, bool write)
+{
+	memset(batch, 0x00, sizeof(device_batch_t));
+	batch->write = write;
+	if (num_ios == 0)
+		return;
+
+	cluster_io_t* sorted = (cluster_io_t*) malloc(num_ios * sizeof(cluster_io_t));
+	memcpy(sorted, ios, num_ios * sizeof(cluster_io_t));
+	qsort(sorted, num_ios, sizeof(cluster_io_t), compare_cluster_ios);
+
+	batch->iovecs = (struct iovec*) malloc(num_ios * sizeof(struct iovec));
+	batch->run_start = (unsigned*) malloc(num_ios * sizeof(unsigned));
+	batch->run_block = (unsigned*) malloc(num_ios * sizeof(unsigned));
+	batch->run_length = (unsigned*) malloc(num_ios * sizeof(unsigned));
+	batch->num_ios = num_ios;
+	if (direct_io)
+		batch->bounce_target = (void**) calloc(num_ios, sizeof(void*));
+	for (unsigned i = 0; i < num_ios; i++)
+	{
+		batch->iovecs[i].iov_base = sorted[i].buffer;
+		batch->iovecs[i].iov_len = CLUSTER_SIZE;
+
+		// Com O_DIRECT, o buffer precisa estar alinhado ao setor; os demais passam por um buffer da arena.
+		if (direct_io && (uintptr_t) sorted[i].buffer % SECTOR_SIZE != 0)
+		{
+			batch->bounce_target[i] = sorted[i].buffer;
+			batch->iovecs[i].iov_base = pool_take();
+			if (write)
+				memcpy(batch->iovecs[i].iov_base, sorted[i].buffer, CLUSTER_SIZE);
+		}
+
+		unsigned r = batch->num_runs;
+		if (r > 0 && sorted[i].block == batch->run_block[r - 1] + batch->run_length[r - 1] && batch->run_length[r - 1] < MAX_RUN_CLUSTERS)
+		{
+			batch->run_length[r - 1]++;
+			continue;
+		}
+
+		batch->run_start[r] = i;
+		batch->run_block[r] = sorted[i].block;
+		batch->run_length[r] = 1;
+		batch->num_runs++;
+	}
+
+	free(sorted);
+
+#ifdef USE_IO_URING
+	if (ring.fd >= 0)
+	{
+		pthread_mutex_lock(&ring_lock);
+		uring_push(batch);
+		pthread_mutex_unlock(&ring_lock);
+		return;
+	}
+#endif
+
+	for (unsigned r = 0; r < batch->num_runs; r++)
+		run_sync(batch, r);
+	batch->submitted = batch->num_runs;
+}
+
+// Espera todas as operações do lote terminarem, enviando os trechos que ainda não couberam na fila.
+bool device_wait(device_batch_t* batch)
+{
+#ifdef USE_IO_URING
+	// Uma só thread espera no kernel, sem ring_lock: as demais continuam enviando e esperam que ela recolha as conclusões. Assim
+	// uma leitura do cache não espera a gravação inteira do flusher, só a chegada da sua conclusão.
+	pthread_mutex_lock(&ring_lock);
+	while (ring.fd >= 0 && batch->completed < batch->num_runs)
+	{
+		uring_push(batch);
+		if (ring.waiting)
+			pthread_cond_wait(&ring_reaped, &ring_lock);
+		else
+		{
+			ring.waiting = true;
+			pthread_mutex_unlock(&ring_lock);
+			uring_wait();
+			pthread_mutex_lock(&ring_lock);
+			ring.waiting = false;
+			uring_reap();
+			pthread_cond_broadcast(&ring_reaped);
+		}
+	}
+	pthread_mutex_unlock(&ring_lock);
+#endif
+
+	// Devolve à arena os buffers trocados, copiando antes o que foi lido para o buffer do chamador.
+	for (unsigned i = 0; batch->bounce_target != NULL && i < batch->num_ios; i++)
+	{
+		if (batch->bounce_target[i] == NULL)
+			continue;
+
+		if (!batch->write)
+			memcpy(batch->bounce_target[i], batch->iovecs[i].iov_base, CLUSTER_SIZE);
+		pool_give(batch->iovecs[i].iov_base);
+	}
+
+	bool success = !batch->failed;
+	free_batch(batch);
+	return success;
+}
+
+// Garante que as escritas já concluídas estejam no disco.
+bool device_sync()
+{
+	return device_fd >= 0 && fsync(device_fd) == 0;
+}
+
+static int compare_cluster_ios(const void* a, const void* b)
+{
+	const cluster_io_t* io_a = (const cluster_io_t*) a;
+	const cluster_io_t* io_b = (const cluster_io_t*) b;
+
+	if (io_a->block != io_b->block)
+		return io_a->block < io_b->block ? -1 : 1;
+	return 0;
+}
+
+static void run_sync(device_batch_t* batch, unsigned r)
+{
+	off_t offset = (off_t) (10 + batch->run_block[r]) * CLUSTER_SIZE;
+	struct iovec* iovecs = &batch->iovecs[batch->run_start[r]];
+
+	ssize_t result;
+	do
+		result = batch->write ? pwritev(device_fd, iovecs, batch->run_length[r], offset) : preadv(device_fd, iovecs, batch->run_length[r], offset);
+	while (result < 0 && errno == EINTR);
+
+	finish_run(batch, r, result < 0 ? -errno : result);
+}
+
+// Conclusão de um trecho. Uma operação pode transferir menos que o pedido sem ter chegado ao fim da imagem: o restante é pedido
+// de novo aqui, até completar ou chegar ao fim do arquivo. Assim como no fread, o que uma leitura não alcançar fica zerado, mas só
+// além de IMAGE_SIZE (os últimos clusters, que a imagem só alcança depois de escritos); antes disso, o fim do arquivo é um erro.
+static void finish_run(device_batch_t* batch, unsigned r, long result)
+{
+	long expected = (long) batch->run_length[r] * CLUSTER_SIZE;
+	off_t offset = (off_t) (10 + batch->run_block[r]) * CLUSTER_SIZE;
+	struct iovec* remaining = NULL;
+	while (result >= 0 && result < expected)
+	{
+		if (remaining == NULL)
+			remaining = (struct iovec*) malloc(batch->run_length[r] * sizeof(struct iovec));
+
+		// Os iovecs que faltam, o primeiro deles a partir do ponto em que a transferência parou.
+		unsigned first = result / CLUSTER_SIZE, count = batch->run_length[r] - first;
+		memcpy(remaining, &batch->iovecs[batch->run_start[r] + first], count * sizeof(struct iovec));
+		remaining[0].iov_base = (uint8_t*) remaining[0].iov_base + (result % CLUSTER_SIZE);
+		remaining[0].iov_len -= result % CLUSTER_SIZE;
+
+		ssize_t transferred = batch->write ? pwritev(device_fd, remaining, count, offset + result) : preadv(device_fd, remaining, count, offset + result);
+		if (transferred < 0 && errno == EINTR)
+			continue;
+		if (transferred <= 0)
+		{
+			if (transferred < 0)
+				result = -errno;
+			break;
+		}
+
+		result += transferred;
+	}
+	free(remaining);
+
+	if (result < 0 || (result < expected && (batch->write || offset + result < IMAGE_SIZE)))
+		batch->failed = true;
+	else if (result < expected)
+	{
+		for (unsigned k = result / CLUSTER_SIZE; k < batch->run_length[r]; k++)
+		{
+			unsigned from = k == result / CLUSTER_SIZE ? result % CLUSTER_SIZE : 0;
+			memset((uint8_t*) batch->iovecs[batch->run_start[r] + k].iov_base + from, 0x00, CLUSTER_SIZE - from);
+		}
+	}
+
+	batch->completed++;
+}
+
+static void free_batch(device_batch_t* batch)
+{
+	free(batch->iovecs);
+	free(batch->run_start);
+	free(batch->run_block);
+	free(batch->run_length);
+	free(batch->bounce_target);
+	batch->iovecs = NULL;
+	batch->run_start = batch->run_block = batch->run_length = NULL;
+	batch->bounce_target = NULL;
+}
+
+static void* pool_take()
+{
+	pthread_mutex_lock(&pool_lock);
+	if (pool_num_free == 0)
+	{
+		uint8_t* chunk = NULL;
+		if (posix_memalign((void**) &chunk, SECTOR_SIZE, DEVICE_POOL_CHUNK * CLUSTER_SIZE) != 0)
+		{
+			fprintf(stderr, "Memória insuficiente.\n");
+			exit(EXIT_FAILURE);
+		}
+
+		pool_size += DEVICE_POOL_CHUNK;
+		pool_free = (void**) realloc(pool_free, pool_size * sizeof(void*));
+		for (unsigned k = 0; k < DEVICE_POOL_CHUNK; k++)
+			pool_free[pool_num_free++] = chunk + (k * CLUSTER_SIZE);
+	}
+
+	void* buffer = pool_free[--pool_num_free];
+	pthread_mutex_unlock(&pool_lock);
+	return buffer;
+}
+
+static void pool_give(void* buffer)
+{
+	pthread_mutex_lock(&pool_lock);
+	pool_free[pool_num_free++] = buffer;
+	pthread_mutex_unlock(&pool_lock);
+}
+
+#ifdef USE_IO_URING
+// Cria a fila com DEVICE_QUEUE_DEPTH entradas e mapeia os anéis. Caso o kernel não ofereça io_uring, ring.fd fica -1.
+static bool uring_setup()
+{
+	struct io_uring_params params;
+	memset(&params, 0x00, sizeof(params));
+	int fd = syscall(__NR_io_uring_setup, DEVICE_QUEUE_DEPTH, &params);
+	if (fd < 0)
+		return false;
+
+	ring.sq_ring_size = params.sq_off.array + (params.sq_entries * sizeof(unsigned));
+	ring.cq_ring_size = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+	bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single_mmap)
+	{
+		if (ring.cq_ring_size > ring.sq_ring_size)
+			ring.sq_ring_size = ring.cq_ring_size;
+		ring.cq_ring_size = ring.sq_ring_size;
+	}
+
+	ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	ring.cq_ring = single_mmap ? ring.sq_ring : mmap(NULL, ring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring.sqes = (struct io_uring_sqe*) mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring.sq_ring == MAP_FAILED || ring.cq_ring == MAP_FAILED || ring.sqes == MAP_FAILED)
+	{
+		if (ring.sq_ring != MAP_FAILED)
+			munmap(ring.sq_ring, ring.sq_ring_size);
+		if (!single_mmap && ring.cq_ring != MAP_FAILED)
+			munmap(ring.cq_ring, ring.cq_ring_size);
+		if (ring.sqes != MAP_FAILED)
+			munmap(ring.sqes, ring.sqes_size);
+		close(fd);
+		return false;
+	}
+
+	ring.sq_head = (unsigned*) ((uint8_t*) ring.sq_ring + params.sq_off.head);
+	ring.sq_tail = (unsigned*) ((uint8_t*) ring.sq_ring + params.sq_off.tail);
+	ring.sq_mask = (unsigned*) ((uint8_t*) ring.sq_ring + params.sq_off.ring_mask);
+	ring.sq_array = (unsigned*) ((uint8_t*) ring.sq_ring + params.sq_off.array);
+	ring.cq_head = (unsigned*) ((uint8_t*) ring.cq_ring + params.cq_off.head);
+	ring.cq_tail = (unsigned*) ((uint8_t*) ring.cq_ring + params.cq_off.tail);
+	ring.cq_mask = (unsigned*) ((uint8_t*) ring.cq_ring + params.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe*) ((uint8_t*) ring.cq_ring + params.cq_off.cqes);
+	ring.entries = params.sq_entries;
+	ring.in_flight = 0;
+	memset(ring.slot_batch, 0x00, sizeof(ring.slot_batch));
+	ring.fd = fd;
+	return true;
+}
+
+static void uring_teardown()
+{
+	if (ring.fd < 0)
+		return;
+
+	// Operações ainda em andamento terminam antes de os buffers deixarem de existir.
+	while (ring.in_flight > 0)
+	{
+		uring_wait();
+		uring_reap();
+	}
+
+	munmap(ring.sqes, ring.sqes_size);
+	if (ring.cq_ring != ring.sq_ring)
+		munmap(ring.cq_ring, ring.cq_ring_size);
+	munmap(ring.sq_ring, ring.sq_ring_size);
+	close(ring.fd);
+	ring.fd = -1;
+}
+
+// Coloca na fila os próximos trechos do lote, enquanto houver espaço, e os entrega ao kernel em uma única chamada.
+static void uring_push(device_batch_t* batch)
+{
+	unsigned pushed = 0;
+	unsigned tail = *ring.sq_tail;
+	while (batch->submitted < batch->num_runs && ring.in_flight < DEVICE_QUEUE_DEPTH && tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) < ring.entries)
+	{
+		unsigned slot = 0;
+		while (ring.slot_batch[slot] != NULL)
+			slot++;
+
+		unsigned r = batch->submitted++;
+		ring.slot_batch[slot] = batch;
+		ring.slot_run[slot] = r;
+		ring.in_flight++;
+
+		unsigned index = tail & *ring.sq_mask;
+		struct io_uring_sqe* sqe = &ring.sqes[index];
+		memset(sqe, 0x00, sizeof(struct io_uring_sqe));
+		sqe->opcode = batch->write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->fd = device_fd;
+		sqe->addr = (uint64_t) (uintptr_t) &batch->iovecs[batch->run_start[r]];
+		sqe->len = batch->run_length[r];
+		sqe->off = (uint64_t) (10 + batch->run_block[r]) * CLUSTER_SIZE;
+		sqe->user_data = slot;
+		ring.sq_array[index] = index;
+
+		tail++;
+		pushed++;
+	}
+
+	if (pushed == 0)
+		return;
+
+	__atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+	while (syscall(__NR_io_uring_enter, ring.fd, pushed, 0, 0, NULL, 0) < 0 && errno == EINTR)
+		;
+}
+
+// Espera ao menos uma conclusão. Chamada sem ring_lock, por uma thread de cada vez; sempre há operações em andamento, pois o lote
+// de quem espera ainda não terminou (ou está na fila, ou esperando que ela abra espaço).
+static void uring_wait()
+{
+	while (syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno == EINTR)
+		;
+}
+
+// Recolhe as conclusões disponíveis e as repassa aos respectivos lotes.
+static void uring_reap()
+{
+	unsigned head = *ring.cq_head;
+	unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail)
+	{
+		struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+		unsigned slot = (unsigned) cqe->user_data;
+
+		finish_run(ring.slot_batch[slot], ring.slot_run[slot], cqe->res);
+		ring.slot_batch[slot] = NULL;
+		ring.in_flight--;
+		head++;
+	}
+
+	__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+#endif
@@ -0,0 +1,55 @@
+#ifndef DEVICE_H
+#define DEVICE_H
+
+/*INCLUDE*/
+#include <stdbool.h>
+#include <sys/uio.h>
+#include "fat.h"
+
+/*DEFINE*/
+// Camada de dispositivo: leituras e escritas de clusters de dados em lote. Clusters vizinhos no disco viram uma única operação
+// (preadv/pwritev) e, compilado com USE_IO_URING (make IO_URING=1), os lotes vão para uma fila do io_uring do Linux, com várias
+// operações em andamento ao mesmo tempo. Sem suporte do kernel, o io_uring dá lugar às chamadas síncronas em tempo de execução.
+// Compilado com USE_DIRECT_IO (make DIRECT_IO=1), a imagem é aberta com O_DIRECT, sem passar pelo cache de páginas do kernel:
+// buffers que não estão alinhados a SECTOR_SIZE são trocados por buffers de uma arena alinhada durante a operação.
+#define DEVICE_QUEUE_DEPTH	64
+#define DEVICE_POOL_CHUNK	64 // Buffers acrescentados à arena de cada vez.
+
+// Um cluster de dados e o buffer (CLUSTER_SIZE bytes) de onde ele é lido ou para onde é escrito.
+struct _cluster_io_t
+{
+	unsigned block;
+	void* buffer;
+};
+
+typedef struct _cluster_io_t cluster_io_t;
+
+// Lote em andamento: as operações ordenadas por posição no disco e agrupadas em trechos contíguos (uma operação por trecho).
+struct _device_batch_t
+{
+	struct iovec* iovecs;
+	unsigned* run_start; // Primeiro iovec de cada trecho.
+	unsigned* run_block;
+	unsigned* run_length;
+	unsigned num_runs;
+	unsigned num_ios;
+	void** bounce_target; // Buffer do chamador de cada iovec trocado por um da arena (O_DIRECT), ou NULL.
+	unsigned submitted;
+	unsigned completed;
+	bool write;
+	bool failed;
+};
+
+typedef struct _device_batch_t device_batch_t;
+
+bool device_open(const char*);
+void device_close();
+const char* device_backend();
+void* device_alloc(size_t);
+bool device_read_clusters(cluster_io_t*, unsigned);
+bool device_write_clusters(cluster_io_t*, unsigned);
+void device_submit(device_batch_t*, cluster_io_t*, unsigned, bool);
+bool device_wait(device_batch_t*);
+bool device_sync();
+
+#endif
@@ -1,18 +1,45 @@
 /*INCLUDE*/
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <malloc.h>
+#include "fat.h"
+#include "lz.h"
+#include "device.h"
+#include "cache.h"
+#include "protocol.h"
+#include "name_scan.h"
 
 /*DEFINE*/
-#define SECTOR_SIZE		512
-#define CLUSTER_SIZE		2 * SECTOR_SIZE
-#define ENTRY_BY_CLUSTER 	CLUSTER_SIZE / sizeof(dir_entry_t)
-#define NUM_CLUSTER		4096
-#define fat_name		"fat.part"
 #define MAX_CMD_SIZE		4096
+#define MAX_CMD_PIECES		(MAX_CMD_SIZE / 2 + 1)
+#define MAX_PATH_DEPTH		256 // Partes de um caminho, depois de resolvidos os "..". Caminhos mais fundos são recusados como diretório inválido.
+#define MAX_WORKERS		8
+#define MAX_PENDING_REQUESTS	64 // Pedidos de uma conexão aguardando resposta; além disso, a conexão só é lida quando um deles terminar.
+#define MAX_SNAPSHOTS		8
+#define DEDUP_BUCKETS		1024
+#define WRITEBACK_INTERVAL_MS	500 // Intervalo máximo entre as gravações do flusher.
+#define DIRECTORY_LOCKS		64 // Travas dos diretórios no modo servidor (cada diretório usa a do seu cluster módulo DIRECTORY_LOCKS).
+#define FAT_ENTRIES_BY_SECTOR	(SECTOR_SIZE / sizeof(unsigned short))
+#define FAT_SECTORS		(NUM_CLUSTER / FAT_ENTRIES_BY_SECTOR) // A FAT é lida do disco por setor, na primeira vez que é usada.
+#define SORTED_MAX_DEPTH	8 // Níveis do índice de um diretório ordenado (com 4096 clusters, passa de 3 só em uma imagem corrompida).
+#define SORTED_LEAF_ROOM	(1 + INLINE_MAX_SLOTS) // Entradas livres que uma folha precisa ter para receber uma entrada nova, com o conteúdo embutido.
+#define LIST_BATCH		64 // Folhas de um diretório ordenado lidas de uma vez pelo ls.
 
 /*DIR NAVIGATOR*/
 #define INVALID_DIR 	1
@@ -26,73 +53,456 @@
 #define BLOATED_SYSTEM	9
 #define ROOT_DIR 	10
 #define DATA_DIR	11
+#define HOST_ERROR	12
+#define NAME_TOO_LONG	13
+#define MOVE_INTO_SELF	14
+#define NOT_FOUND_SNAP	15
+#define FULL_SNAPSHOTS	16
+#define CORRUPTED_FILE	17
+#define INVALID_REQUEST	18
+#define UNSAFE_NAME	19 // Nome que não pode virar caminho no host (vazio, ".", ".." ou com '/').
+#define INVALID_CONTENT	20 // Conteúdo com um byte 0x00: o conteúdo de um arquivo termina no primeiro deles.
+#define WRITE_FAILED	21 // Não foi possível gravar no disco (a imagem ou o arquivo de snapshots).
 
 #define SUB_DIR 	1
 #define FILE_DIR 	2
+#define SORTED_DIR	3 // O próprio diretório ordenado (index é a raiz do índice); para procurar um nome nele, a folha vem de sorted_leaf.
 
 #define NAV_READ 	1
 #define NAV_CREATE 	2
 #define NAV_DELETE 	3
+#define NAV_CREATE_SORTED	4 // Como NAV_CREATE, mas o último diretório do caminho, caso não exista, é criado ordenado.
+
+/*DEFRAG*/
+#define OWNER_NONE	0
+#define OWNER_FAT	1
+#define OWNER_ROOT	2
+#define OWNER_DIR	3
+#define OWNER_INDEX	4
+
+// Propriedades dos comandos do shell, conferidas pelo interpretador antes de executá-los (tabela commands).
+#define CMD_NO_VOLUME		0x01 // Pode ser executado sem um sistema de arquivos carregado.
+#define CMD_NO_PATH		0x02 // Os argumentos são nomes, não caminhos (snapshot).
+#define CMD_PATH_FIRST		0x04 // O caminho é o primeiro argumento, e não o último.
+#define CMD_ACCEPTS_ROOT	0x08 // Aceita o próprio root_dir como caminho.
+#define CMD_CHANGES_DIRS	0x10 // Altera diretórios: trabalha sobre cópias dos diretórios do caminho que ainda pertencem a algum snapshot.
+
+// Parte de um caminho: aponta para dentro do buffer do comando, com tamanho e hash já calculados.
+struct _path_component_t
+{
+	char* name;
+	unsigned short length;
+	unsigned hash;
+};
+
+typedef struct _path_component_t path_component_t;
+
+// Caminho normalizado (sem '.', '..' e barras repetidas). O diretório pai são as size - 1 primeiras partes e a folha é a última.
+struct _path_t
+{
+	path_component_t components[MAX_PATH_DEPTH];
+	unsigned size;
+};
+
+typedef struct _path_t path_t;
+
+// Conjunto de threads que executa tarefas numeradas (0 .. num_jobs - 1) em paralelo.
+struct _worker_pool_t
+{
+	pthread_t threads[MAX_WORKERS];
+	unsigned num_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t job_finished;
+	unsigned next_job;
+	unsigned num_jobs;
+	bool* job_done;
+	void (*job)(unsigned, void*);
+	void* context;
+};
+
+typedef struct _worker_pool_t worker_pool_t;
+
+// Entrada de uma árvore copiada entre o host e o sistema de arquivos (import-tree/export-tree).
+struct _tree_node_t
+{
+	char* host_path;
+	char name[18];
+	bool is_dir;
+	bool sorted;
+	int parent; // Índice do nó pai no plano, -1 para o diretório de origem/destino.
+	unsigned first_block;
+	unsigned num_clusters;
+	unsigned size;
+	bool compressed;
+	bool inlined; // Conteúdo embutido no diretório, já copiado para buffer na fotografia da árvore.
+	uint8_t* buffer;
+	bool failed;
+};
+
+typedef struct _tree_node_t tree_node_t;
+
+struct _tree_plan_t
+{
+	tree_node_t* nodes;
+	unsigned size;
+};
+
+typedef struct _tree_plan_t tree_plan_t;
+
+// Quem aponta para um cluster: a entrada anterior da cadeia na FAT ou uma entrada de diretório.
+struct _cluster_owner_t
+{
+	unsigned char type;
+	unsigned short block; // Cluster anterior (OWNER_FAT), cluster do diretório (OWNER_DIR) ou nó do índice (OWNER_INDEX).
+	unsigned char slot; // Índice da entrada de diretório (OWNER_ROOT e OWNER_DIR) ou do filho no nó (OWNER_INDEX).
+};
+
+typedef struct _cluster_owner_t cluster_owner_t;
+
+// Estado da desfragmentação: ordem desejada dos clusters (pré-ordem da árvore) e os donos de cada cluster.
+struct _defrag_context_t
+{
+	cluster_owner_t owner[NUM_CLUSTER];
+	bool is_dir[NUM_CLUSTER];
+	bool is_index[NUM_CLUSTER]; // Nós do índice de diretórios ordenados.
+	int rank[NUM_CLUSTER]; // Posição do cluster em order, -1 caso não pertença à árvore.
+	unsigned short order[NUM_CLUSTER];
+	unsigned short position[NUM_CLUSTER]; // Posição final no disco de cada cluster de order (os compartilhados ficam fixos e são pulados).
+	unsigned order_size;
+	unsigned links;
+	unsigned broken_links;
+	unsigned files;
+	unsigned fragmented_files;
+};
+
+typedef struct _defrag_context_t defrag_context_t;
+
+// Entrada visitada pelo du/tree. Os filhos de um diretório ficam em posições consecutivas (first_child .. first_child + num_children - 1).
+struct _usage_node_t
+{
+	char name[18];
+	bool is_dir;
+	bool sorted;
+	int parent;
+	unsigned first_block;
+	unsigned first_child;
+	unsigned num_children;
+	unsigned long long bytes; // Tamanho da subárvore (após a agregação).
+	unsigned clusters; // Clusters ocupados pela subárvore (após a agregação).
+};
+
+typedef struct _usage_node_t usage_node_t;
+
+// Snapshot do volume: cópia dos metadados do momento em que foi criado. Os clusters de dados e de diretório não são copiados,
+// apenas ficam fixos (copy-on-write) enquanto o snapshot existir.
+struct _snapshot_t
+{
+	char name[18];
+	bool used;
+	long long created;
+	unsigned short fat[NUM_CLUSTER];
+	dir_entry_t root_dir[32];
+	unsigned short cluster_refs[NUM_CLUSTER];
+};
+
+typedef struct _snapshot_t snapshot_t;
+
+// Alterações coletadas para uma gravação: cópias dos clusters alterados no cache, da FAT seguida do root_dir (no formato da
+// imagem) e das tabelas auxiliares, feitas com o volume parado e gravadas depois, sem impedir o próximo comando.
+struct _writeback_t
+{
+	cluster_io_t ios[CACHE_CLUSTERS];
+	data_cluster clusters[CACHE_CLUSTERS] __attribute__((aligned(SECTOR_SIZE)));
+	unsigned num_clusters;
+	unsigned generation;
+	uint8_t metadata[NUM_CLUSTER * sizeof(unsigned short) + 32 * sizeof(dir_entry_t)];
+	bool fat_sectors[FAT_SECTORS]; // Setores da FAT já lidos do disco na coleta; os demais não foram alterados.
+	bool metadata_changed;
+	unsigned short cluster_refs[NUM_CLUSTER];
+	bool refs_changed;
+	uint32_t cluster_digests[NUM_CLUSTER];
+	bool digests_changed;
+};
+
+typedef struct _writeback_t writeback_t;
+
+// Cliente do modo servidor. A conexão é fechada quando o cliente desconecta e o último pedido dele é respondido. Os pedidos de
+// uma conexão são executados um de cada vez, na ordem em que chegaram; os protegidos por request_queue_lock estão indicados.
+struct _connection_t
+{
+	int fd;
+	unsigned references; // A thread que lê os pedidos e cada pedido ainda não respondido.
+	struct _request_t* head; // Pedidos ainda não executados, em ordem de chegada (request_queue_lock).
+	struct _request_t* tail;
+	unsigned pending; // Pedidos lidos e ainda não respondidos, incluindo o em execução (request_queue_lock).
+	bool scheduled; // Na fila de conexões prontas ou com um pedido em execução (request_queue_lock).
+	pthread_cond_t room; // Sinalizada quando pending fica abaixo de MAX_PENDING_REQUESTS.
+	struct _connection_t* next_ready;
+};
 
-struct _dir_entry_t
+typedef struct _connection_t connection_t;
+
+// Pedido lido de uma conexão, aguardando a sua vez na fila dela.
+struct _request_t
 {
-	unsigned char filename[18];
-	unsigned char attributes;
-	unsigned char reserved[7];
-	unsigned short first_block;
-	unsigned int size;
+	connection_t* connection;
+	request_header_t header;
+	char* path; // Terminados com '\0'.
+	char* data;
+	struct _request_t* next;
 };
 
-typedef struct _dir_entry_t  dir_entry_t;
+typedef struct _request_t request_t;
 
-union _data_cluster
+// Comando do shell e suas propriedades (CMD_*).
+struct _command_info_t
 {
-	dir_entry_t dir[CLUSTER_SIZE / sizeof(dir_entry_t)];
-	uint8_t data[CLUSTER_SIZE];
+	const char* name;
+	unsigned flags;
 };
 
-typedef union _data_cluster data_cluster;
+typedef struct _command_info_t command_info_t;
 
 /*DATA DECLARATION*/
 unsigned short fat[NUM_CLUSTER];
 unsigned char boot_block[CLUSTER_SIZE];
 dir_entry_t root_dir[32];
-data_cluster clusters[4086];
 
 bool is_fs_loaded;
+unsigned free_clusters; // Clusters de dados livres, mantido a cada alocação/liberação.
+unsigned long long used_bytes; // Soma dos tamanhos dos arquivos, mantida a cada escrita/remoção.
+unsigned short cluster_refs[NUM_CLUSTER]; // Referências extras a cada cluster (clones), guardadas no arquivo fat.part.ref.
+bool cluster_refs_changed; // A tabela de referências precisa ser gravada no próximo save.
+unsigned char cluster_pins[NUM_CLUSTER]; // Quantidade de snapshots que usam cada cluster, calculada ao carregar.
+bool dedup_enabled; // Deduplicação na escrita ligada (o arquivo fat.part.dedup existe).
+bool cluster_digests_changed;
+uint32_t cluster_digests[NUM_CLUSTER]; // Resumo do conteúdo dos clusters de arquivo (0 = desconhecido), guardado em fat.part.dedup.
+short digest_buckets[DEDUP_BUCKETS]; // Listas de clusters por resumo, montadas ao carregar (-1 = vazia).
+short digest_next[NUM_CLUSTER];
+char empty_input[] = "";
+const command_info_t commands[] =
+{
+	{ "init", CMD_NO_VOLUME },
+	{ "load", CMD_NO_VOLUME },
+	{ "exit", CMD_NO_VOLUME },
+	{ "ls", CMD_ACCEPTS_ROOT },
+	{ "mkdir", CMD_CHANGES_DIRS },
+	{ "create", CMD_CHANGES_DIRS },
+	{ "unlink", CMD_CHANGES_DIRS },
+	{ "rm", CMD_CHANGES_DIRS },
+	{ "mv", CMD_ACCEPTS_ROOT | CMD_CHANGES_DIRS },
+	{ "cp", CMD_ACCEPTS_ROOT | CMD_CHANGES_DIRS },
+	{ "rename", CMD_PATH_FIRST | CMD_CHANGES_DIRS },
+	{ "write", CMD_CHANGES_DIRS },
+	{ "append", CMD_CHANGES_DIRS },
+	{ "read", 0 },
+	{ "import-tree", CMD_ACCEPTS_ROOT | CMD_CHANGES_DIRS },
+	{ "export-tree", CMD_PATH_FIRST | CMD_ACCEPTS_ROOT },
+	{ "defrag", 0 },
+	{ "df", 0 },
+	{ "du", CMD_ACCEPTS_ROOT },
+	{ "tree", CMD_ACCEPTS_ROOT },
+	{ "snapshot", CMD_NO_PATH },
+	{ "dedup", 0 },
+	{ "compress", CMD_CHANGES_DIRS },
+	{ "decompress", CMD_CHANGES_DIRS },
+	{ "sync", 0 }
+};
+volatile sig_atomic_t defrag_interrupted;
+// Exclusivo para o interpretador durante cada comando e para o flusher enquanto coleta as alterações; compartilhado pelos
+// pedidos do modo servidor. Com preferência para quem pede exclusividade, o flusher não espera indefinidamente.
+pthread_rwlock_t volume_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+pthread_mutex_t writeback_lock = PTHREAD_MUTEX_INITIALIZER; // Uma gravação de cada vez (flusher, sync e pontos de ordenação).
+pthread_mutex_t writeback_wakeup_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t writeback_wakeup = PTHREAD_COND_INITIALIZER;
+bool writeback_started;
+bool metadata_dirty; // save() foi chamado desde a última coleta.
+writeback_t writeback;
+uint8_t metadata_on_disk[sizeof(writeback.metadata)]; // FAT e root_dir como estão na imagem, para gravar apenas os setores alterados.
+int metadata_fd = -1; // Boot block, FAT e root_dir da imagem carregada.
+bool fat_sector_loaded[FAT_SECTORS];
+pthread_mutex_t fat_sector_lock = PTHREAD_MUTEX_INITIALIZER; // Os pedidos do modo servidor leem a FAT com o volume compartilhado.
+uint64_t free_map[NUM_CLUSTER / 64]; // Um bit por cluster, ligado se livre, para a alocação não percorrer a FAT.
+bool free_map_ready; // O mapa é refeito em segundo plano depois de um load; até lá a alocação percorre a FAT.
+unsigned next_free_hint; // Nenhum cluster livre antes deste.
+unsigned volume_generation; // Muda a cada init/load, para a reconstrução do mapa de um volume anterior parar.
+connection_t* ready_head; // Conexões do modo servidor com pedidos a executar e nenhum em execução, em ordem de chegada.
+connection_t* ready_tail;
+pthread_mutex_t request_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t request_available = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t allocation_lock = PTHREAD_MUTEX_INITIALIZER; // Os pedidos que alteram o volume disputam a FAT e os contadores: um de cada vez.
+pthread_rwlock_t directory_locks[DIRECTORY_LOCKS];
+volatile sig_atomic_t server_stopping;
 
 /*FUNCTION DECLARATION*/
 void command_interpreter(char*);
-void explode_command(char*, char***, unsigned*);
-void explode_directory(char*, char***, unsigned*);
-void get_input_string(char*, char**);
-bool validate_directory(char**, unsigned);
-bool directory_navigator(char**, unsigned, unsigned*, unsigned*, unsigned*, unsigned);
-bool create_file(char**, unsigned, unsigned*, unsigned);
-bool write_file(char**, unsigned, unsigned, char*, unsigned*);
-bool append_file(char**, unsigned, unsigned, char*, unsigned*);
-bool read_file(char**, unsigned, unsigned, char**, unsigned*);
+unsigned command_flags(char*);
+void explode_command(char*, char**, unsigned*, char**);
+bool parse_path(char*, path_t*);
+bool entry_matches(dir_entry_t*, path_component_t*);
+uint32_t name_candidates(dir_entry_t*, path_component_t*);
+void set_name_hash(dir_entry_t*);
+bool directory_navigator(path_t*, unsigned, unsigned*, unsigned*, unsigned*, unsigned);
+bool create_file(path_t*, unsigned*, unsigned);
+bool write_file(path_t*, unsigned, char*, unsigned*);
+bool append_file(path_t*, unsigned, char*, unsigned*);
+bool read_file(path_t*, unsigned, char**, unsigned*);
+bool set_file_compression(path_t*, unsigned, bool, unsigned*);
+void set_entry_flags(path_t*, unsigned, unsigned char);
+bool is_inline_slot(dir_entry_t*);
+unsigned inline_slots_needed(unsigned);
+void read_inline(dir_entry_t*, unsigned, char*);
+bool store_inline(dir_entry_t*, unsigned, char*, unsigned);
+void release_inline_slots(dir_entry_t*, unsigned);
+unsigned create_sorted_directory();
+unsigned sorted_child(sorted_node_t*, char*);
+unsigned sorted_descend(unsigned, char*, bool, unsigned*, unsigned*, unsigned*);
+unsigned sorted_leaf(unsigned, char*);
+bool sorted_make_room(unsigned, char*, unsigned*, unsigned*);
+void sorted_split_leaf(unsigned*, unsigned*, unsigned, char*);
+void sorted_insert_child(unsigned*, unsigned*, unsigned, unsigned char*, unsigned);
+void sorted_drop_leaf(unsigned, char*);
+void sorted_collect(unsigned, char*, unsigned*, unsigned*, unsigned*, unsigned*);
+unsigned entries_by_name(dir_entry_t*, unsigned char*);
+unsigned list_entries(unsigned, bool, char*, dir_entry_t**);
+bool enter_directory(dir_entry_t*, path_t*, unsigned, bool, unsigned*, unsigned*, unsigned*);
+bool is_empty_directory(dir_entry_t*);
+void release_directory(dir_entry_t*);
+void release_empty_leaf(path_t*, unsigned);
+bool make_room(path_t*, unsigned, path_component_t*, unsigned*, unsigned*);
+bool import_tree(char*, path_t*, unsigned*);
+bool plan_import(char*, int, tree_plan_t*, unsigned*);
+void release_import_chains(tree_plan_t*, unsigned**, unsigned);
+void import_read_job(unsigned, void*);
+void free_tree_plan(tree_plan_t*);
+bool export_tree(unsigned, bool, char*, unsigned*);
+void export_write_job(unsigned, void*);
+void worker_pool_start(worker_pool_t*, unsigned, void (*)(unsigned, void*), void*);
+void worker_pool_wait_job(worker_pool_t*, unsigned);
+void worker_pool_join(worker_pool_t*);
+void* worker_pool_thread(void*);
 unsigned get_available_cluster();
+unsigned allocate_cluster();
+unsigned allocate_empty_cluster();
+bool release_cluster(unsigned);
+bool is_shared_cluster(unsigned);
+bool is_free_cluster(unsigned);
+bool unshare_directories(path_t*, unsigned);
+bool snapshot_create(char*, unsigned*);
+void snapshot_list();
+bool snapshot_restore(char*, unsigned*);
+bool snapshot_delete(char*, unsigned*);
+int find_snapshot(char*, snapshot_t*);
+bool read_snapshot(unsigned, snapshot_t*);
+bool write_snapshot(unsigned, snapshot_t*);
+void load_snapshot_pins();
+uint32_t cluster_digest(data_cluster*);
+void dedup_remember(unsigned, uint32_t);
+void dedup_forget(unsigned);
+unsigned dedup_lookup(data_cluster*, uint32_t, unsigned, unsigned);
+bool write_deduplicated(char*, unsigned, unsigned*);
+void dedup_volume(unsigned, bool, unsigned*, unsigned*);
+unsigned dedup_chain(unsigned*, bool);
+void load_dedup_index();
+unsigned unshare_chain(unsigned);
+bool clone_file(path_t*, unsigned, unsigned, path_component_t*, bool, unsigned*);
+bool resolve_destination(path_t*, path_t*, unsigned*, unsigned*, path_component_t**, unsigned*);
+bool remove_tree(path_t*, unsigned, bool, bool, unsigned*);
+bool move_entry(path_t*, unsigned, path_t*, unsigned, unsigned, path_component_t*, unsigned*);
+void erase_data_clusters(unsigned*, unsigned);
+void count_usage();
+unsigned collect_usage(unsigned, bool, usage_node_t**);
+void read_cluster_batch(unsigned*, unsigned, data_cluster*);
+void print_usage_path(usage_node_t*, int, path_t*);
+void print_usage_tree(usage_node_t*, unsigned, unsigned);
+unsigned long long directory_bytes(unsigned, bool);
 void init(void);
 void load();
 void save();
-data_cluster get_data_cluster(unsigned);
-void save_data_cluster(unsigned, data_cluster);
+void get_data_cluster(unsigned, data_cluster*);
+void save_data_cluster(unsigned, data_cluster*);
+void copy_data_cluster(unsigned, unsigned);
+void open_device();
+unsigned short fat_get(unsigned);
+void fat_set(unsigned, unsigned short);
+void load_fat_sector(unsigned);
+void load_full_fat();
+void set_free_map(unsigned, bool);
+unsigned find_free_cluster(unsigned, unsigned);
+void rebuild_free_map_sector(unsigned);
+void* free_map_thread(void*);
+bool write_volume_summary(bool);
+bool close_volume();
+unsigned chain_successor(unsigned);
+void prefetch_subdirectories(dir_entry_t*, unsigned);
+bool sync_volume(bool);
+void request_writeback(bool);
+void* writeback_thread(void*);
+void writeback_collect();
+bool writeback_write();
+bool write_metadata_sectors();
+bool metadata_sector_changed(unsigned);
+void discard_data_cluster(unsigned);
+bool defrag(unsigned*, bool*, unsigned*);
+void defrag_collect(defrag_context_t*, unsigned);
+void defrag_collect_index(defrag_context_t*, unsigned);
+void defrag_move(defrag_context_t*, unsigned, unsigned);
+void defrag_signal_handler(int);
+void fragmentation_score(unsigned*, unsigned*, unsigned*, unsigned*);
 bool check_file_existence();
-void free_structure(char***, unsigned);
+bool serve(char*);
+void server_signal_handler(int);
+void* server_connection_thread(void*);
+void* server_worker_thread(void*);
+void schedule_connection(connection_t*);
+void release_connection(connection_t*);
+void execute_request(request_t*);
+bool read_full(int, void*, size_t);
+bool write_full(int, const void*, size_t);
+pthread_rwlock_t* directory_lock(unsigned);
+bool locate_directory(path_t*, unsigned, unsigned*, unsigned*, unsigned*);
+bool find_entry(unsigned, path_component_t*, dir_entry_t*);
+bool needs_whole_volume(path_t*, unsigned);
+bool server_lookup(path_t*, dir_entry_t*, unsigned*);
+bool server_read(path_t*, char**, unsigned*);
+bool server_ls(path_t*, dir_entry_t**, unsigned*, unsigned*);
+bool server_change(path_t*, unsigned, char*, unsigned*);
+bool apply_change(path_t*, unsigned, unsigned, char*, unsigned*);
 
 int main(int argc, char** argv)
 {
 	is_fs_loaded = false;
+	name_scan_select();
+
+	// Cada arena do malloc fica com a memória que suas threads liberaram, residente. O modo servidor limita as arenas ao número
+	// de workers, para que eles não disputem uma só; no shell, os workers do import/export-tree e o flusher dividem uma única arena.
+	if (argc == 3 && strcmp(argv[1], "serve") == 0)
+	{
+		// Modo servidor: ./fat serve SOCKET.
+		mallopt(M_ARENA_MAX, MAX_WORKERS);
+		return serve(argv[2]) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	mallopt(M_ARENA_MAX, 1);
+
 	char command[MAX_CMD_SIZE];
 	while (true)
 	{
 		fprintf(stdout, ">> ");
-		fgets(command, MAX_CMD_SIZE, stdin);
+		if (fgets(command, MAX_CMD_SIZE, stdin) == NULL) // Fim da entrada (execução em lote).
+			break;
+
+		// O flusher só coleta alterações entre um comando e outro.
+		pthread_rwlock_wrlock(&volume_lock);
 		if (strcmp(command, "\n") != 0) // Ignora comandos vazios.
 			command_interpreter(command);
+		pthread_rwlock_unlock(&volume_lock);
 	}
 
+	pthread_rwlock_wrlock(&volume_lock);
+	if (is_fs_loaded)
+		close_volume();
+
 	return EXIT_SUCCESS;
 }
 
@@ -100,43 +510,45 @@ void command_interpreter(char* command)
 {
 	bool end_shell = false;
 
-	char** command_pieces = NULL;
+	// As partes do comando e do caminho apontam para dentro do próprio buffer do comando, nada é alocado.
+	char* command_pieces[MAX_CMD_PIECES];
 	unsigned command_pieces_size = 0;
 
-	char** directory_pieces = NULL;
-	unsigned directory_pieces_size = 0;
+	path_t path;
+	path.size = 0;
 
-	char* input_string = NULL;
-	// Preenche input_string com a string de entrada de dados, caso haja (write, append).
-	get_input_string(command, &input_string);
+	// Quebra o comando em partes delimitadas por ' ', preenchendo input_string com a string entre aspas, caso haja (write, append).
+	char* input_string = empty_input;
+	explode_command(command, command_pieces, &command_pieces_size, &input_string);
 
-	// Quebra o comando em partes delimitadas por ' '.
-	explode_command(command, &command_pieces, &command_pieces_size);
+	// Comando composto apenas por espaços.
+	if (command_pieces_size == 0)
+		return;
 
-	if (!is_fs_loaded)
+	unsigned flags = command_flags(command_pieces[0]);
+	if (!is_fs_loaded && !(flags & CMD_NO_VOLUME))
 	{
-		if (strcmp(command_pieces[0], "init") != 0 && strcmp(command_pieces[0], "load") != 0 && strcmp(command_pieces[0], "exit") != 0)
-		{
-			fprintf(stderr, "O sistema de arquivos não está carregado.\n");
-			free_structure(&command_pieces, command_pieces_size);
-			free(input_string);
-			return;
-		}
+		fprintf(stderr, "O sistema de arquivos não está carregado.\n");
+		return;
 	}
 
 	// Caso o comando lide com diretórios.
-	if (command_pieces_size > 1)
+	if (command_pieces_size > 1 && !(flags & CMD_NO_PATH))
 	{
-		// Separa o diretório encontrado por '/'.
-		explode_directory(command_pieces[command_pieces_size - 1], &directory_pieces, &directory_pieces_size);
+		// O caminho no sistema de arquivos é a última parte do comando, exceto no export-tree, cujo último argumento é um diretório do host, e no rename, cujo último argumento é o novo nome.
+		unsigned path_piece = (flags & CMD_PATH_FIRST) ? 1 : command_pieces_size - 1;
 
-		// Averigua se o diretório não é inválido. Caso seja, libera memória das estruturas utilizadas e volta para o main.
-		if (!validate_directory(directory_pieces, directory_pieces_size))
+		// Separa o caminho encontrado por '/' e o normaliza. Averigua se o diretório não é inválido. Caso seja, volta para o main.
+		if (!parse_path(command_pieces[path_piece], &path) || (path.size == 0 && !(flags & CMD_ACCEPTS_ROOT)))
 		{
 			fprintf(stderr, "Diretório inválido.\n");
-			free_structure(&command_pieces, command_pieces_size);
-			free_structure(&directory_pieces, directory_pieces_size);
-			free(input_string);
+			return;
+		}
+
+		if (is_fs_loaded && (flags & CMD_CHANGES_DIRS) && !unshare_directories(&path, path.size))
+		{
+			fprintf(stderr, "Não há espaço disponível.\n");
+			save();
 			return;
 		}
 	}
@@ -161,66 +573,38 @@ void command_interpreter(char* command)
 	{
 		if (command_pieces_size > 0)
 		{
-			// Se apenas 'ls' for passado, cria um diretório '/' para que o root_dir seja listado.
-			if (command_pieces_size == 1)
+			// Um último nome terminado em '*' lista só as entradas do diretório acima dele que começam com o restante do nome.
+			char* prefix = empty_input;
+			if (path.size > 0 && path.components[path.size - 1].name[path.components[path.size - 1].length - 1] == '*')
 			{
-				directory_pieces = (char**) malloc(1 * sizeof(char*));
-				directory_pieces[0] = (char*) malloc(2 * sizeof(char));
-				directory_pieces_size = 1;
-				strcpy(directory_pieces[0], "/");
+				path.size--;
+				prefix = path.components[path.size].name;
+				prefix[path.components[path.size].length - 1] = '\0';
 			}
 
+			// Se apenas 'ls' for passado, o caminho vazio faz com que o root_dir seja listado.
 			unsigned index = 0, return_info = 0, type = 0;
 
-			if (directory_navigator(directory_pieces, directory_pieces_size, &index, &return_info, &type, NAV_READ))
+			if (directory_navigator(&path, path.size, &index, &return_info, &type, NAV_READ))
 			{
-				// Caso o que foi encontrado esteja no root_dir.
-				if (return_info == ROOT_DIR)
-				{
-					// Se o atributo da entrada de diretório encontrada não for 0x1.
-					if (type != SUB_DIR)
-						fprintf(stderr, "Não é um diretório.\n");
-					else
-					{
-						// Percorre o diretório procurando entradas de diretório referenciadas.
-						bool found_anything = false;
-						for (int i = 0; i < 32; i++)
-						{
-							if (root_dir[i].first_block != 0x00)
-							{
-								found_anything = true;
-								fprintf(stdout, "%s\n", root_dir[i].filename);
-							}
-						}
-
-						// Caso nenhuma entrada de diretório ocupada seja encontrada no diretório.
-						if (!found_anything)
-								fprintf(stderr, "Diretório vazio.\n");
-					}
-				}
-				// Caso o que foi encontrado esteja nos clusteres de dados.
-				else if (return_info == DATA_DIR)
+				// Se o atributo da entrada de diretório encontrada não for 0x1.
+				if (type != SUB_DIR && type != SORTED_DIR)
+					fprintf(stderr, "Não é um diretório.\n");
+				else
 				{
-					// Se o atributo da entrada de diretório encontrada não for 0x1.
-					if (type != SUB_DIR)
-						fprintf(stderr, "Não é um diretório.\n");
-					else
-					{
-						// Percorre o diretório procurando entradas de diretório referenciadas.
-						bool found_anything = false;
-						for (int i = 0; i < 32; i++)
-						{
-							if (get_data_cluster(index).dir[i].first_block != 0x00)
-							{
-								found_anything = true;
-								fprintf(stdout, "%s\n", get_data_cluster(index).dir[i].filename);
-							}
-						}
-
-						// Caso nenhuma entrada de diretório ocupada seja encontrada no diretório.
-						if (!found_anything)
-							fprintf(stderr, "Diretório vazio.\n");
-					}
+					// Um diretório ordenado é listado em ordem de nome, lendo só as folhas que podem ter o prefixo.
+					dir_entry_t* entries = NULL;
+					unsigned num_entries = list_entries(index, type == SORTED_DIR, prefix, &entries);
+					for (unsigned i = 0; i < num_entries; i++)
+						fprintf(stdout, "%s\n", entries[i].filename);
+
+					// Caso nenhuma entrada de diretório ocupada seja encontrada no diretório.
+					if (num_entries == 0)
+						fprintf(stderr, *prefix == '\0' ? "Diretório vazio.\n" : "Nenhuma entrada com esse prefixo.\n");
+
+					// O próximo passo costuma ser entrar em um dos subdiretórios listados.
+					prefetch_subdirectories(entries, num_entries);
+					free(entries);
 				}
 			}
 			else
@@ -250,11 +634,13 @@ void command_interpreter(char* command)
 	}
 	else if (strcmp(command_pieces[0], "mkdir") == 0)
 	{
-		if (command_pieces_size == 2)
+		// Com -s, o diretório é criado ordenado (os diretórios intermediários que faltarem são comuns).
+		bool sorted = command_pieces_size == 3 && strcmp(command_pieces[1], "-s") == 0;
+		if (command_pieces_size == 2 || sorted)
 		{
 			unsigned index = 0, return_info = 0, type = 0;
 			// Chama directory_navigator com NAV_CREATE, ou seja, caso não encontre um diretório no decorrer do diretório passado, cria-o
-			if (!directory_navigator(directory_pieces, directory_pieces_size, &index, &return_info, &type, NAV_CREATE))
+			if (!directory_navigator(&path, path.size, &index, &return_info, &type, sorted ? NAV_CREATE_SORTED : NAV_CREATE))
 			{
 				// Caso a operação falhe, mostra o erro correspondente.
 				switch (return_info)
@@ -265,6 +651,9 @@ void command_interpreter(char* command)
 					case FULL_DIR:
 						fprintf(stderr, "Diretório lotado.\n");
 						break;
+					case BLOATED_SYSTEM:
+						fprintf(stderr, "Não há espaço disponível.\n");
+						break;
 					default:
 						fprintf(stderr, "Não foi possível criar o diretório. (%d)\n", return_info);
 				}
@@ -282,12 +671,12 @@ void command_interpreter(char* command)
 		if (command_pieces_size == 2)
 		{
 			unsigned index = 0, return_info = 0, type = 0;
-			// Excluindo a ultima parte passada no diretório (directory_pieces_size - 2), cria os diretórios não existente no decorrer do diretório passado (NAV_CREATE).
-			if (directory_navigator(directory_pieces, directory_pieces_size - 2, &index, &return_info, &type, NAV_CREATE))
+			// Excluindo a ultima parte passada no diretório (path.size - 1), cria os diretórios não existente no decorrer do diretório passado (NAV_CREATE).
+			if (directory_navigator(&path, path.size - 1, &index, &return_info, &type, NAV_CREATE))
 			{
 				return_info = 0;
 				// Cria o arquivo a partir do diretório passado (garantia de existência pela função passada).
-				if (!create_file(directory_pieces, directory_pieces_size, &return_info, index))
+				if (!create_file(&path, &return_info, index))
 				{
 					// Caso a operação (criar arquivo) falhe, mostra o erro correspondente.
 					switch (return_info)
@@ -327,7 +716,9 @@ void command_interpreter(char* command)
 		{
 			unsigned index = 0, return_info = 0, type = 0;
 			// Navega nos diretórios apagando a ultima parcela do mesmo, seja ela um arquivo ou diretório (NAV_DELETE).
-			if (!directory_navigator(directory_pieces, directory_pieces_size, &index, &return_info, &type, NAV_DELETE))
+			if (directory_navigator(&path, path.size, &index, &return_info, &type, NAV_DELETE))
+				release_empty_leaf(&path, path.size);
+			else
 			{
 				// Caso a operação falhe, mostra o erro correspondente.
 				switch (return_info)
@@ -348,17 +739,217 @@ void command_interpreter(char* command)
 
 		save();
 	}
+	else if (strcmp(command_pieces[0], "rm") == 0)
+	{
+		bool recursive = false, secure = false, valid_flags = true;
+		for (unsigned i = 1; i + 1 < command_pieces_size; i++)
+		{
+			if (strcmp(command_pieces[i], "-r") == 0)
+				recursive = true;
+			else if (strcmp(command_pieces[i], "-s") == 0)
+				secure = true;
+			else
+				valid_flags = false;
+		}
+
+		if (command_pieces_size >= 2 && valid_flags)
+		{
+			unsigned index = 0, return_info = 0, type = 0;
+			bool success = false;
+			// Navega até o diretório que contém a entrada a ser removida.
+			if (directory_navigator(&path, path.size - 1, &index, &return_info, &type, NAV_READ))
+			{
+				if (type != SUB_DIR)
+					return_info = NOT_A_DIR;
+				else
+					success = remove_tree(&path, index, recursive, secure, &return_info);
+			}
+
+			if (success)
+				release_empty_leaf(&path, path.size);
+			else
+			{
+				// Caso a operação falhe, mostra o erro correspondente.
+				switch (return_info)
+				{
+					case INVALID_DIR:
+						fprintf(stderr, "Diretório inválido.\n");
+						break;
+					case NOT_FOUND_DIR:
+						fprintf(stderr, "Diretório/arquivo inexistente.\n");
+						break;
+					case NOT_A_DIR:
+						fprintf(stderr, "Não é um diretório.\n");
+						break;
+					case NOT_EMPTY_DIR:
+						fprintf(stderr, "Somente diretórios vazios podem ser deletados sem -r.\n");
+						break;
+					default:
+						fprintf(stderr, "Não foi possível deletar o diretório/arquivo. (%d)\n", return_info);
+				}
+			}
+		}
+		else
+			fprintf(stderr, "Número de argumentos inválidos para o comando rm.\n");
+
+		save();
+	}
+	else if (strcmp(command_pieces[0], "mv") == 0 || strcmp(command_pieces[0], "rename") == 0)
+	{
+		if (command_pieces_size == 3)
+		{
+			bool is_rename = strcmp(command_pieces[0], "rename") == 0;
+			unsigned index = 0, return_info = 0, type = 0;
+			unsigned dest_index = 0, dest_depth = 0;
+			path_component_t* dest_name = NULL;
+			bool success = false;
+
+			// Segundo caminho do comando: a origem no mv e o novo nome no rename.
+			char* second_piece = command_pieces[is_rename ? 2 : 1];
+			bool single_name = strchr(second_piece, '/') == NULL;
+			path_t second_path;
+			if (!parse_path(second_piece, &second_path) || second_path.size == 0 || (is_rename && (!single_name || second_path.size != 1)))
+				return_info = INVALID_DIR;
+			else
+			{
+				path_t* source = is_rename ? &path : &second_path;
+
+				// O diretório de origem também é alterado e não pode continuar compartilhado com snapshots.
+				if (!unshare_directories(source, source->size))
+					return_info = BLOATED_SYSTEM;
+				// Navega até o diretório que contém a origem.
+				else if (directory_navigator(source, source->size - 1, &index, &return_info, &type, NAV_READ))
+				{
+					if (type != SUB_DIR)
+						return_info = NOT_A_DIR;
+					else if (is_rename)
+					{
+						// O rename mantém a entrada no mesmo diretório, trocando apenas o nome. Em um diretório ordenado, o novo nome
+						// pode ficar em outra folha, e abrir espaço nela pode mudar a folha da origem, que é procurada de novo.
+						dest_index = index;
+						dest_depth = path.size - 1;
+						dest_name = &second_path.components[0];
+						if (make_room(&path, dest_depth, dest_name, &dest_index, &return_info) && directory_navigator(&path, path.size - 1, &index, &return_info, &type, NAV_READ))
+							success = move_entry(&path, index, &path, dest_depth, dest_index, dest_name, &return_info);
+					}
+					// O destino pode ser um diretório existente ou o novo caminho da entrada (a origem é procurada de novo, como no rename).
+					else if (resolve_destination(&path, source, &dest_index, &dest_depth, &dest_name, &return_info) && directory_navigator(source, source->size - 1, &index, &return_info, &type, NAV_READ))
+						success = move_entry(source, index, &path, dest_depth, dest_index, dest_name, &return_info);
+
+					if (success)
+						release_empty_leaf(source, source->size);
+				}
+			}
+
+			if (!success)
+			{
+				// Caso a operação falhe, mostra o erro correspondente.
+				switch (return_info)
+				{
+					case INVALID_DIR:
+						fprintf(stderr, "Diretório inválido.\n");
+						break;
+					case NOT_FOUND_DIR:
+						fprintf(stderr, "Diretório/arquivo inexistente.\n");
+						break;
+					case NOT_A_DIR:
+						fprintf(stderr, "Não é um diretório.\n");
+						break;
+					case ALREADY_EXISTS:
+						fprintf(stderr, "O destino já existe.\n");
+						break;
+					case FULL_DIR:
+						fprintf(stderr, "Diretório lotado.\n");
+						break;
+					case MOVE_INTO_SELF:
+						fprintf(stderr, "Não é possível mover um diretório para dentro de si mesmo.\n");
+						break;
+					case BLOATED_SYSTEM:
+						fprintf(stderr, "Não há espaço disponível.\n");
+						break;
+					default:
+						fprintf(stderr, "Não foi possível mover o diretório/arquivo. (%d)\n", return_info);
+				}
+			}
+		}
+		else
+			fprintf(stderr, "Número de argumentos inválidos para o comando %s.\n", command_pieces[0]);
+
+		save();
+	}
+	else if (strcmp(command_pieces[0], "cp") == 0)
+	{
+		bool reflink = command_pieces_size == 4 && strcmp(command_pieces[1], "--reflink") == 0;
+		if (command_pieces_size == 3 || reflink)
+		{
+			unsigned index = 0, return_info = 0, type = 0;
+			unsigned dest_index = 0, dest_depth = 0;
+			path_component_t* dest_name = NULL;
+			bool success = false;
+
+			path_t source;
+			if (!parse_path(command_pieces[command_pieces_size - 2], &source) || source.size == 0)
+				return_info = INVALID_DIR;
+			// Resolve o destino, como no mv, e navega até o diretório que contém a origem. O destino vem antes: abrir espaço nele, em
+			// um diretório ordenado, pode mudar a folha onde a origem está.
+			else if (resolve_destination(&path, &source, &dest_index, &dest_depth, &dest_name, &return_info) && directory_navigator(&source, source.size - 1, &index, &return_info, &type, NAV_READ))
+			{
+				if (type != SUB_DIR)
+					return_info = NOT_A_DIR;
+				else
+					success = clone_file(&source, index, dest_index, dest_name, reflink, &return_info);
+			}
+
+			if (!success)
+			{
+				// Caso a operação falhe, mostra o erro correspondente.
+				switch (return_info)
+				{
+					case INVALID_DIR:
+						fprintf(stderr, "Diretório inválido.\n");
+						break;
+					case NOT_FOUND_DIR:
+						fprintf(stderr, "Diretório inexistente.\n");
+						break;
+					case NOT_FOUND_FILE:
+						fprintf(stderr, "Arquivo não encontrado.\n");
+						break;
+					case NOT_A_DIR:
+						fprintf(stderr, "Não é um diretório.\n");
+						break;
+					case NOT_A_FILE:
+						fprintf(stderr, "Não é um arquivo.\n");
+						break;
+					case ALREADY_EXISTS:
+						fprintf(stderr, "O destino já existe.\n");
+						break;
+					case FULL_DIR:
+						fprintf(stderr, "Diretório lotado.\n");
+						break;
+					case BLOATED_SYSTEM:
+						fprintf(stderr, "Não há espaço disponível.\n");
+						break;
+					default:
+						fprintf(stderr, "Não foi possível copiar o arquivo. (%d)\n", return_info);
+				}
+			}
+		}
+		else
+			fprintf(stderr, "Número de argumentos inválidos para o comando cp.\n");
+
+		save();
+	}
 	else if (strcmp(command_pieces[0], "write") == 0)
 	{
 		if (command_pieces_size > 2)
 		{
 			unsigned index = 0, return_info = 0, type = 0;
 			// Caminha até o diretório onde o arquivo em que será escrito está, caso alguma entrada de diretório não seja encontrada, dará erro (NAV_READ).
-			if (directory_navigator(directory_pieces, directory_pieces_size - 2, &index, &return_info, &type, NAV_READ))
+			if (directory_navigator(&path, path.size - 1, &index, &return_info, &type, NAV_READ))
 			{
 				return_info = 0;
 				// Escreve no arquivo passado, uma vez que o caminho até ele está correto.
-				if (!write_file(directory_pieces, directory_pieces_size, index, input_string, &return_info))
+				if (!write_file(&path, index, input_string, &return_info))
 				{
 					// Caso a operação (escrita no arquivo) falhe, mostra o erro correspondente.
 					switch (return_info)
@@ -404,11 +995,11 @@ void command_interpreter(char* command)
 		{
 			unsigned index = 0, return_info = 0, type = 0;
 			// Caminha até o diretório onde o arquivo em que será acrescido conteúdo está, caso alguma entrada de diretório não seja encontrada, dará erro (NAV_READ).
-			if (directory_navigator(directory_pieces, directory_pieces_size - 2, &index, &return_info, &type, NAV_READ))
+			if (directory_navigator(&path, path.size - 1, &index, &return_info, &type, NAV_READ))
 			{
 				return_info = 0;
 				// Acrescenta o conteúdo no arquivo, uma vez que o caminho até o mesmo está correto.
-				if (!append_file(directory_pieces, directory_pieces_size, index, input_string, &return_info))
+				if (!append_file(&path, index, input_string, &return_info))
 				{
 					// Caso a operação (acrescer dados no arquivo) falhe, mostra o erro correspondente.
 					switch (return_info)
@@ -455,12 +1046,12 @@ void command_interpreter(char* command)
 			unsigned index = 0, return_info = 0, type = 0;
 
 			// Caminha até o diretório onde o arquivo que será lido está, caso alguma entrada de diretório não seja encontrada, dará erro (NAV_READ).
-			if (directory_navigator(directory_pieces, directory_pieces_size - 2, &index, &return_info, &type, NAV_READ))
+			if (directory_navigator(&path, path.size - 1, &index, &return_info, &type, NAV_READ))
 			{
 				return_info = 0;
 				char* read_data = NULL;
 				// Lê o arquivo, uma vez que o caminho até ele esteja correto.
-				if (read_file(directory_pieces, directory_pieces_size, index, &read_data, &return_info))
+				if (read_file(&path, index, &read_data, &return_info))
 				{
 					fprintf(stdout, "%s\n", read_data);
 					free(read_data);
@@ -476,6 +1067,9 @@ void command_interpreter(char* command)
 						case NOT_FOUND_FILE:
 							fprintf(stderr, "Arquivo não encontrado.\n");
 							break;
+						case CORRUPTED_FILE:
+							fprintf(stderr, "Arquivo corrompido.\n");
+							break;
 						default:
 							fprintf(stderr, "Não foi possível ler o arquivo. (%d)\n", return_info);
 					}
@@ -505,139 +1099,480 @@ void command_interpreter(char* command)
 
 		save();
 	}
-	else if (strcmp(command_pieces[0], "exit") == 0)
-		end_shell = true;
-	else
-		fprintf(stderr, "Comando inexistente.\n");
-
-	free_structure(&command_pieces, command_pieces_size);
-	free_structure(&directory_pieces, directory_pieces_size);
-	free(input_string);
-
-	if (end_shell)
-		exit(EXIT_SUCCESS);
-}
-
-// Separa o comando por ' '.
-void explode_command(char* command, char*** command_pieces, unsigned* command_pieces_size)
-{
-	unsigned piece_counter = 0;
-	char* token = strtok(command, " \t"); // Faz o slice inicial.
-
-	while (token != NULL)
+	else if (strcmp(command_pieces[0], "import-tree") == 0)
 	{
-		if (strcmp(token, "\n") != 0)
+		if (command_pieces_size == 3)
 		{
-			(*command_pieces) = (char**) realloc((*command_pieces), (piece_counter + 1) * sizeof(char*)); // Cria mais um espaço.
-			(*command_pieces)[piece_counter] = (char*) malloc((strlen(token) + 1) * sizeof(char)); // Aloca mais uma string.
-			strcpy((*command_pieces)[piece_counter], token); // Copia o token.
-			piece_counter++; // Incrementa o contador.
+			unsigned return_info = 0;
+			// Importa toda a árvore do diretório do host para dentro do diretório de destino, que é criado (com as partes não existentes
+			// do caminho) só depois que toda a importação couber.
+			if (!import_tree(command_pieces[1], &path, &return_info))
+			{
+				// Caso a operação (importar a árvore) falhe, mostra o erro correspondente.
+				switch (return_info)
+				{
+					case INVALID_DIR:
+						fprintf(stderr, "Diretório inválido.\n");
+						break;
+					case NOT_A_DIR:
+						fprintf(stderr, "Não é um diretório.\n");
+						break;
+					case HOST_ERROR:
+						fprintf(stderr, "Não foi possível ler %s no host.\n", command_pieces[1]);
+						break;
+					case NAME_TOO_LONG:
+						fprintf(stderr, "Nome de entrada muito longo (máximo de 17 caracteres).\n");
+						break;
+					case FULL_DIR:
+						fprintf(stderr, "Diretório lotado.\n");
+						break;
+					case ALREADY_EXISTS:
+						fprintf(stderr, "Entrada de diretório já existente.\n");
+						break;
+					case BLOATED_SYSTEM:
+						fprintf(stderr, "Não há espaço disponível no sistema de arquivos.\n");
+						break;
+					default:
+						fprintf(stderr, "Não foi possível importar o diretório. (%d)\n", return_info);
+				}
+			}
 		}
+		else
+			fprintf(stderr, "Número de argumentos inválido para o comando import-tree.\n");
 
-		token = strtok(NULL, " \t"); // Faz 'slice'
-	}
-
-	// Caso haja '\n' no final do comando, substitui por '\0'.
-	if (piece_counter > 0)
-		if ((*command_pieces)[piece_counter - 1][strlen((*command_pieces)[piece_counter - 1]) - 1] == '\n')
-			(*command_pieces)[piece_counter - 1][strlen((*command_pieces)[piece_counter - 1]) - 1] = '\0';
-
-	*command_pieces_size = piece_counter;
-}
-
-// Separa o diretório passado por '/'.
-void explode_directory(char* directory, char*** directory_pieces, unsigned* directory_pieces_size)
-{
-	unsigned piece_counter = 0;
-
-	// Caso só haja '/' no diretório passado, cria um vetor de uma posição com o '/' e retorna.
-	if (strlen(directory) == 1)
-	{
-		(*directory_pieces) = (char**) malloc(1 * sizeof(char*));
-		(*directory_pieces)[piece_counter] = (char*) malloc(2 * sizeof(char));
-		strcpy((*directory_pieces)[piece_counter], "/");
-		*directory_pieces_size = ++piece_counter;
-		return;
+		save();
 	}
-
-	// Faz o slice inicial.
-	char* token = strtok(directory, "/");
-
-	while (token != NULL)
+	else if (strcmp(command_pieces[0], "export-tree") == 0)
 	{
-		if (strcmp(token, "\n") != 0)
+		if (command_pieces_size == 3)
 		{
-			// A cada 'parte' do diretório, aloca um espaoço para o '/' e outro para o nome da entrada de diretório.
-			(*directory_pieces) = (char**) realloc((*directory_pieces), (piece_counter + 2) * sizeof(char*));
-			(*directory_pieces)[piece_counter] = (char*) malloc(2 * sizeof(char)); // Aloca espaço para o '/' e para o '\0'.
-			(*directory_pieces)[piece_counter + 1] = (char*) malloc((strlen(token) + 1) * sizeof(char*)); // Aloca espaço para o nome da entrada de diretório e para o '\0'.
-
-			strcpy((*directory_pieces)[piece_counter], "/"); // Copia a '/'.
-			strcpy((*directory_pieces)[piece_counter + 1], token); // Copia o nome da entrada de diretório.
-
-			piece_counter = piece_counter + 2;
-		}
-
-		token = strtok(NULL, "/");
-	}
-
-	// Caso o último caractere seja '\n', substitui por '\0'.
-	if (piece_counter > 0)
-		if ((*directory_pieces)[piece_counter - 1][strlen((*directory_pieces)[piece_counter - 1]) - 1] == '\n')
-			(*directory_pieces)[piece_counter - 1][strlen((*directory_pieces)[piece_counter - 1]) - 1] = '\0';
-
-	*directory_pieces_size = piece_counter;
-}
-
-void get_input_string(char* command, char** string_input)
-{
-	unsigned indicator_found = 0, input_size = 0;
+			unsigned index = 0, return_info = 0, type = 0;
+			// Caminha até o diretório de origem, caso alguma entrada de diretório não seja encontrada, dará erro (NAV_READ).
+			if (directory_navigator(&path, path.size, &index, &return_info, &type, NAV_READ))
+			{
+				return_info = 0;
+				if (type != SUB_DIR && type != SORTED_DIR)
+					fprintf(stderr, "Não é um diretório.\n");
+				// Exporta toda a árvore do diretório de origem para o diretório do host.
+				else if (!export_tree(index, type == SORTED_DIR, command_pieces[2], &return_info))
+				{
+					// Caso a operação (exportar a árvore) falhe, mostra o erro correspondente.
+					switch (return_info)
+					{
+						case HOST_ERROR:
+							fprintf(stderr, "Não foi possível escrever em %s no host.\n", command_pieces[2]);
+							break;
+						case UNSAFE_NAME:
+							fprintf(stderr, "A árvore tem um nome de entrada inválido no host (\".\", \"..\" ou com '/').\n");
+							break;
+						default:
+							fprintf(stderr, "Não foi possível exportar o diretório. (%d)\n", return_info);
+					}
+				}
+			}
+			else
+			{
+				// Caso a operação (caminhar até o diretório de origem) falhe, mostra o erro correspondente.
+				switch (return_info)
+				{
+					case INVALID_DIR:
+						fprintf(stderr, "Diretório inválido.\n");
+						break;
+					case NOT_FOUND_DIR:
+						fprintf(stderr, "Diretório inexistente.\n");
+						break;
+					case NOT_A_DIR:
+						fprintf(stderr, "Não é um diretório.\n");
+						break;
+					default:
+						fprintf(stderr, "Não foi possível navegar até o diretório. (%d)\n", return_info);
+				}
+			}
+		}
+		else
+			fprintf(stderr, "Número de argumentos inválido para o comando export-tree.\n");
+
+		save();
+	}
+	else if (strcmp(command_pieces[0], "defrag") == 0)
+	{
+		if (command_pieces_size == 1)
+		{
+			unsigned links = 0, broken_links = 0, files = 0, fragmented_files = 0;
+			fragmentation_score(&links, &broken_links, &files, &fragmented_files);
+			fprintf(stdout, "Fragmentação antes: %.1f%% (%u de %u ligações descontínuas, %u de %u arquivos fragmentados).\n", links == 0 ? 0.0 : (100.0 * broken_links) / links, broken_links, links, fragmented_files, files);
+
+			unsigned moved = 0, return_info = 0;
+			bool interrupted = false;
+			// Move os clusters para a disposição ótima; o sistema de arquivos fica consistente após cada movimentação.
+			if (!defrag(&moved, &interrupted, &return_info))
+			{
+				switch (return_info)
+				{
+					case BLOATED_SYSTEM:
+						fprintf(stderr, "Não há cluster livre para a desfragmentação.\n");
+						break;
+					default:
+						fprintf(stderr, "Não foi possível desfragmentar. (%d)\n", return_info);
+				}
+			}
+
+			if (interrupted)
+				fprintf(stderr, "Desfragmentação interrompida. Execute defrag novamente para continuar.\n");
+
+			fragmentation_score(&links, &broken_links, &files, &fragmented_files);
+			fprintf(stdout, "Fragmentação depois: %.1f%% (%u de %u ligações descontínuas, %u de %u arquivos fragmentados).\n", links == 0 ? 0.0 : (100.0 * broken_links) / links, broken_links, links, fragmented_files, files);
+			fprintf(stdout, "%u clusters movidos.\n", moved);
+		}
+		else
+			fprintf(stderr, "Número de argumentos inválido para o comando defrag.\n");
+
+		save();
+	}
+	else if (strcmp(command_pieces[0], "df") == 0)
+	{
+		// Os contadores são mantidos a cada operação, então nada precisa ser percorrido.
+		if (command_pieces_size == 1)
+		{
+			unsigned total_clusters = NUM_CLUSTER - 10;
+			fprintf(stdout, "Clusters: %u no total, %u usados, %u livres (%.1f%% em uso).\n", total_clusters, total_clusters - free_clusters, free_clusters, (100.0 * (total_clusters - free_clusters)) / total_clusters);
+			fprintf(stdout, "Espaço livre: %u bytes.\n", free_clusters * CLUSTER_SIZE);
+			fprintf(stdout, "Dados em arquivos: %llu bytes.\n", used_bytes);
+		}
+		else
+			fprintf(stderr, "Número de argumentos inválido para o comando df.\n");
+	}
+	else if (strcmp(command_pieces[0], "du") == 0 || strcmp(command_pieces[0], "tree") == 0)
+	{
+		if (command_pieces_size <= 2)
+		{
+			unsigned index = 0, return_info = 0, type = 0;
+			// Caminha até o diretório a ser percorrido (o root_dir, caso nenhum seja passado).
+			if (directory_navigator(&path, path.size, &index, &return_info, &type, NAV_READ))
+			{
+				if (type != SUB_DIR && type != SORTED_DIR)
+					fprintf(stderr, "Não é um diretório.\n");
+				else
+				{
+					// Percorre a subárvore uma única vez, em largura, agregando os tamanhos de baixo para cima.
+					usage_node_t* nodes = NULL;
+					unsigned num_nodes = collect_usage(index, type == SORTED_DIR, &nodes);
+
+					if (strcmp(command_pieces[0], "du") == 0)
+					{
+						// Assim como no du do Unix, os subdiretórios são mostrados antes de seus pais.
+						for (int n = num_nodes - 1; n >= 0; n--)
+						{
+							if (!nodes[n].is_dir)
+								continue;
+
+							fprintf(stdout, "%llu\t%u\t", nodes[n].bytes, nodes[n].clusters);
+							if (n == 0 && path.size == 0)
+								fprintf(stdout, "/");
+							print_usage_path(nodes, n, &path);
+							fprintf(stdout, "\n");
+						}
+					}
+					else
+						print_usage_tree(nodes, 0, 0);
+
+					free(nodes);
+				}
+			}
+			else
+			{
+				// Caso a operação falhe, mostra o erro correspondente.
+				switch (return_info)
+				{
+					case INVALID_DIR:
+						fprintf(stderr, "Diretório inválido.\n");
+						break;
+					case NOT_FOUND_DIR:
+						fprintf(stderr, "Diretório inexistente.\n");
+						break;
+					case NOT_A_DIR:
+						fprintf(stderr, "Não é um diretório.\n");
+						break;
+					default:
+						fprintf(stderr, "Não foi possível navegar até o diretório. (%d)\n", return_info);
+				}
+			}
+		}
+		else
+			fprintf(stderr, "Número de argumentos inválido para o comando %s.\n", command_pieces[0]);
+	}
+	else if (strcmp(command_pieces[0], "snapshot") == 0)
+	{
+		unsigned return_info = 0;
+		bool success = true;
+		if (command_pieces_size == 2 && strcmp(command_pieces[1], "list") == 0)
+			snapshot_list();
+		else if (command_pieces_size == 3 && strcmp(command_pieces[1], "create") == 0)
+			success = snapshot_create(command_pieces[2], &return_info);
+		else if (command_pieces_size == 3 && strcmp(command_pieces[1], "restore") == 0)
+			success = snapshot_restore(command_pieces[2], &return_info);
+		else if (command_pieces_size == 3 && strcmp(command_pieces[1], "delete") == 0)
+			success = snapshot_delete(command_pieces[2], &return_info);
+		else
+			fprintf(stderr, "Uso: snapshot create|restore|delete NOME ou snapshot list.\n");
+
+		if (!success)
+		{
+			// Caso a operação falhe, mostra o erro correspondente.
+			switch (return_info)
+			{
+				case NAME_TOO_LONG:
+					fprintf(stderr, "Nome muito longo (máximo de 17 caracteres).\n");
+					break;
+				case ALREADY_EXISTS:
+					fprintf(stderr, "O snapshot já existe.\n");
+					break;
+				case NOT_FOUND_SNAP:
+					fprintf(stderr, "Snapshot inexistente.\n");
+					break;
+				case FULL_SNAPSHOTS:
+					fprintf(stderr, "Limite de %d snapshots atingido.\n", MAX_SNAPSHOTS);
+					break;
+				case WRITE_FAILED:
+					fprintf(stderr, "Não foi possível gravar as alterações no disco.\n");
+					break;
+				default:
+					fprintf(stderr, "Não foi possível concluir a operação com o snapshot. (%d)\n", return_info);
+			}
+		}
+
+		save();
+	}
+	else if (strcmp(command_pieces[0], "dedup") == 0)
+	{
+		if (command_pieces_size == 2 && strcmp(command_pieces[1], "on") == 0)
+		{
+			// O índice passa a ser gravado a cada save; a passada offline indexa o que já está no volume.
+			dedup_enabled = true;
+			cluster_digests_changed = true;
+		}
+		else if (command_pieces_size == 2 && strcmp(command_pieces[1], "off") == 0)
+		{
+			// Uma gravação do índice em andamento recriaria o arquivo.
+			dedup_enabled = false;
+			sync_volume(false);
+			remove(fat_name dedup_suffix);
+		}
+		else if (command_pieces_size == 1)
+		{
+			unsigned merged = 0, files = 0;
+			unsigned free_before = free_clusters;
+			dedup_volume(0x00, false, &merged, &files);
+			fprintf(stdout, "%u arquivos verificados, %u clusters compartilhados, %u clusters liberados.\n", files, merged, free_clusters - free_before);
+		}
+		else
+			fprintf(stderr, "Uso: dedup [on|off].\n");
+
+		save();
+	}
+	else if (strcmp(command_pieces[0], "compress") == 0 || strcmp(command_pieces[0], "decompress") == 0)
+	{
+		if (command_pieces_size == 2)
+		{
+			unsigned index = 0, return_info = 0, type = 0;
+			// Caminha até o diretório onde o arquivo está, caso alguma entrada de diretório não seja encontrada, dará erro (NAV_READ).
+			if (directory_navigator(&path, path.size - 1, &index, &return_info, &type, NAV_READ))
+			{
+				return_info = 0;
+				// Regrava o arquivo no novo formato, uma vez que o caminho até ele está correto.
+				if (!set_file_compression(&path, index, strcmp(command_pieces[0], "compress") == 0, &return_info))
+				{
+					// Caso a operação (regravar o arquivo) falhe, mostra o erro correspondente.
+					switch (return_info)
+					{
+						case NOT_A_FILE:
+							fprintf(stderr, "Não é um arquivo.\n");
+							break;
+						case NOT_FOUND_FILE:
+							fprintf(stderr, "Arquivo não encontrado.\n");
+							break;
+						case CORRUPTED_FILE:
+							fprintf(stderr, "Arquivo corrompido.\n");
+							break;
+						case BLOATED_SYSTEM:
+							fprintf(stderr, "Não há espaço disponível.\n");
+							break;
+						default:
+							fprintf(stderr, "Não foi possível regravar o arquivo. (%d)\n", return_info);
+					}
+				}
+			}
+			else
+			{
+				// Caso a operação (caminhar até o arquivo) falhe, mostra o erro correspondente.
+				switch (return_info)
+				{
+					case INVALID_DIR:
+						fprintf(stderr, "Diretório inválido.\n");
+						break;
+					case NOT_FOUND_DIR:
+						fprintf(stderr, "Diretório inexistente.\n");
+						break;
+					case NOT_A_DIR:
+						fprintf(stderr, "Não é um diretório.\n");
+						break;
+					default:
+						fprintf(stderr, "Não foi possível navegar até o arquivo. (%d)\n", return_info);
+				}
+			}
+		}
+		else
+			fprintf(stderr, "Número de argumentos inválido para o comando %s.\n", command_pieces[0]);
+
+		save();
+	}
+	else if (strcmp(command_pieces[0], "sync") == 0)
+	{
+		// Grava no disco tudo o que ainda está pendente e só então retorna.
+		if (command_pieces_size != 1)
+			fprintf(stderr, "Número de argumentos inválido para o comando sync.\n");
+		else if (!sync_volume(true))
+			fprintf(stderr, "Não foi possível gravar as alterações no disco.\n");
+	}
+	else if (strcmp(command_pieces[0], "exit") == 0)
+		end_shell = true;
+	else
+		fprintf(stderr, "Comando inexistente.\n");
+
+	if (end_shell)
+	{
+		if (is_fs_loaded)
+			close_volume();
+		exit(EXIT_SUCCESS);
+	}
+}
+
+// Propriedades do comando na tabela commands (0 para um comando desconhecido).
+unsigned command_flags(char* name)
+{
+	for (unsigned i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+		if (strcmp(commands[i].name, name) == 0)
+			return commands[i].flags;
+
+	return 0;
+}
+
+// Separa o comando por ' ', no próprio buffer: cada parte é terminada com '\0' no lugar do separador.
+// O texto entre aspas duplas forma uma única parte, e a primeira delas é devolvida em input_string.
+void explode_command(char* command, char** command_pieces, unsigned* command_pieces_size, char** input_string)
+{
+	unsigned piece_counter = 0;
+	bool found_input = false;
+	char* cursor = command;
 
-	// Percorre o comando passado pelo usuário procurando aspas duplas '"'.
-	for (int i = 0; i < strlen(command); i++)
+	while (*cursor != '\0')
 	{
-		if (command[i] == '"')
+		// Pula os separadores (inclusive o '\n' do final do comando).
+		if (*cursor == ' ' || *cursor == '\t' || *cursor == '\n')
 		{
-			indicator_found++;
+			cursor++;
 			continue;
 		}
 
-		// Tudo entre duas aspas duplas é considerado como dado de entrada, logo posto dentro de um vetor.
-		if (indicator_found == 1)
+		char* piece = cursor;
+		if (*cursor == '"')
+		{
+			// Tudo entre duas aspas duplas é considerado como dado de entrada.
+			piece = ++cursor;
+			while (*cursor != '\0' && *cursor != '"')
+				cursor++;
+
+			if (!found_input)
+			{
+				*input_string = piece;
+				found_input = true;
+			}
+		}
+		else
 		{
-			(*string_input) = (char*) realloc((*string_input), (input_size + 1) * sizeof(char));
-			(*string_input)[input_size] = command[i];
-			input_size++;
+			while (*cursor != '\0' && *cursor != ' ' && *cursor != '\t' && *cursor != '\n')
+				cursor++;
 		}
 
-		// O código para na segunda aspa dupla encontrada.
-		if (indicator_found > 1)
-			break;
+		command_pieces[piece_counter++] = piece;
+
+		// Termina a parte, caso ainda não esteja no fim do comando.
+		if (*cursor != '\0')
+			*cursor++ = '\0';
 	}
 
-	// Aloca mais um espaço para o '\0', para a string poder ser usada no strlen, uma vez que o sistema de arquivos inteiro é preenchido com 0x00.
-	(*string_input) = (char*) realloc((*string_input), (input_size + 1) * sizeof(char));
-	(*string_input)[input_size] = '\0';
+	*command_pieces_size = piece_counter;
 }
 
-bool validate_directory(char** directory_pieces, unsigned directory_pieces_size)
+// Separa o caminho passado por '/', no próprio buffer, normalizando-o: barras repetidas e '.' são ignorados e '..' volta uma parte.
+// Retorna false caso alguma parte não caiba no nome de uma entrada de diretório.
+bool parse_path(char* directory, path_t* path)
 {
-	// Checa em intervalo de intermitência (1:2) se possui '/' nos lugares corretos.
-	for (int i = 0; i < directory_pieces_size; i = i + 2)
-		if (i >= directory_pieces_size)
+	char* cursor = directory;
+	path->size = 0;
+
+	while (*cursor != '\0')
+	{
+		char* name = cursor;
+		while (*cursor != '\0' && *cursor != '/')
+			cursor++;
+
+		unsigned length = cursor - name;
+		if (*cursor == '/')
+			*cursor++ = '\0';
+
+		if (length == 0 || strcmp(name, ".") == 0)
+			continue;
+
+		if (strcmp(name, "..") == 0)
+		{
+			if (path->size > 0)
+				path->size--;
+			continue;
+		}
+
+		if (length > 17 || path->size == MAX_PATH_DEPTH)
 			return false;
-		else
-			if (strcmp(directory_pieces[i], "/") != 0)
-				return false;
+
+		path->components[path->size].name = name;
+		path->components[path->size].length = length;
+		path->components[path->size].hash = entry_name_hash(name, length);
+		path->size++;
+	}
 
 	return true;
 }
 
-bool directory_navigator(char** directory_pieces, unsigned directory_pieces_size, unsigned* index, unsigned* return_info, unsigned* type, unsigned nav_type)
+// Compara o nome da entrada de diretório com a parte do caminho, usando o tamanho já calculado.
+bool entry_matches(dir_entry_t* entry, path_component_t* component)
+{
+	// O filename das entradas de continuação é conteúdo de arquivo, não um nome.
+	if (entry->attributes == INLINE_SLOT)
+		return false;
+
+	return entry->filename[component->length] == '\0' && memcmp(entry->filename, component->name, component->length) == 0;
+}
+
+// Entradas do diretório (32) que podem ter o nome do componente, pelo hash guardado nelas: um bit por entrada. Só essas passam
+// por entry_matches.
+uint32_t name_candidates(dir_entry_t* dir, path_component_t* component)
 {
-	unsigned short next_block = 0x00;
+	return name_scan(dir, component->hash);
+}
+
+// Guarda na entrada o hash do filename. Precisa ser chamada sempre que o nome de uma entrada é escrito.
+void set_name_hash(dir_entry_t* entry)
+{
+	uint32_t hash = entry_name_hash((char*) entry->filename, strnlen((char*) entry->filename, sizeof(entry->filename)));
+	memcpy(&entry->reserved[NAME_HASH_OFFSET], &hash, sizeof(hash));
+}
 
-	if (directory_pieces_size == 1)
+bool directory_navigator(path_t* path, unsigned depth, unsigned* index, unsigned* return_info, unsigned* type, unsigned nav_type)
+{
+	unsigned next_block = 0x00;
+	bool creating = nav_type == NAV_CREATE || nav_type == NAV_CREATE_SORTED;
+
+	if (depth == 0)
 	{
 		*index = next_block;
 		*return_info = ROOT_DIR;
@@ -645,48 +1580,50 @@ bool directory_navigator(char** directory_pieces, unsigned directory_pieces_size
 		return true;
 	}
 
-	for (int i = 1; i < directory_pieces_size; i = i + 2)
+	for (int i = 0; i < depth; i++)
 	{
-		if (i == 1)
+		if (i == 0)
 		{
 			bool find_dir = false;
+			uint32_t candidates = name_candidates(root_dir, &path->components[0]);
 			// Percorre os diretórios do root_dir.
 			for (int j = 0; j < 32; j++)
 			{
-				if (strcmp(root_dir[j].filename, directory_pieces[1]) == 0)
+				if ((candidates >> j & 1) && entry_matches(&root_dir[j], &path->components[0]))
 				{
 					if (root_dir[j].attributes == 0x1)
 					{
 						find_dir = true;
-						next_block = root_dir[j].first_block;
 
 						// Caso o diretório seja encontrado, e o comando delete seja passado, apaga a entrada de diretório.
-						if (nav_type == NAV_DELETE && directory_pieces_size == 2)
+						if (nav_type == NAV_DELETE && depth == 1)
 						{
 							// Checa para ver se o diretório está vazio.
-							for (int k = 0; k < 32; k++)
+							if (!is_empty_directory(&root_dir[j]))
 							{
-								if (get_data_cluster(next_block).dir[k].first_block != 0x00)
-								{
-									*return_info = NOT_EMPTY_DIR;
-									return false;
-								}
+								*return_info = NOT_EMPTY_DIR;
+								return false;
 							}
 
-							// Reseta os valores da entrada de diretório.
+							// Libera os clusters do diretório e reseta os valores da entrada de diretório.
+							release_directory(&root_dir[j]);
+							memset(root_dir[j].reserved, 0x00, sizeof(root_dir[j].reserved));
 							root_dir[j].first_block = 0x00;
 							root_dir[j].attributes = 0x0;
-							fat[root_dir[j].first_block] = 0x00;
 							memset(root_dir[j].filename, 0x00, 18);
 							return true;
 						}
 
+						// Em um diretório ordenado, o próximo nome é procurado na folha que cobre ele.
+						*type = SUB_DIR;
+						if (!enter_directory(&root_dir[j], path, 1, creating, &next_block, type, return_info))
+							return false;
+
 						// Diretório encontrado.
-						if (directory_pieces_size == 2)
+						if (depth == 1)
 						{
 							*index = next_block;
 							*return_info = DATA_DIR;
-							*type = SUB_DIR;
 							return true;
 						}
 
@@ -694,7 +1631,7 @@ bool directory_navigator(char** directory_pieces, unsigned directory_pieces_size
 					}
 					else
 					{
-						if (directory_pieces_size == 2)
+						if (depth == 1)
 						{
 							if (nav_type == NAV_DELETE)
 							{
@@ -706,7 +1643,7 @@ bool directory_navigator(char** directory_pieces, unsigned directory_pieces_size
 								do
 								{
 									if (iteration != 0)
-										local_next_block = fat[local_next_block];
+										local_next_block = fat_get(local_next_block);
 
 									if (local_next_block != 0xffff)
 									{
@@ -717,18 +1654,16 @@ bool directory_navigator(char** directory_pieces, unsigned directory_pieces_size
 								}
 								while (local_next_block != 0xffff);
 
-								// Percorre o vetor resetando os valores da fat e dos clusters de dados.
+								// Percorre o vetor liberando os clusters de dados.
 								for (int k = 0; k < iteration; k++)
-								{
-									fat[file_trace_back[k]] = 0x00;
-									data_cluster cluster;
-									memset(cluster.data, 0x00, CLUSTER_SIZE);
-									save_data_cluster(file_trace_back[k], cluster);
-								}
+									release_cluster(file_trace_back[k]);
 
 								free(file_trace_back);
 
-								// Reseta os valores da entrada de diretório.
+								// Reseta os valores da entrada de diretório (e libera as entradas de continuação, caso o arquivo seja embutido).
+								used_bytes -= root_dir[j].size;
+								release_inline_slots(root_dir, j);
+								memset(root_dir[j].reserved, 0x00, sizeof(root_dir[j].reserved));
 								root_dir[j].first_block = 0x00;
 								root_dir[j].attributes = 0x0;
 								root_dir[j].size = 0x00;
@@ -763,7 +1698,7 @@ bool directory_navigator(char** directory_pieces, unsigned directory_pieces_size
 					return false;
 				}
 				// Cria o diretório, caso necessário para os comandos create e mkdir.
-				else if (nav_type == NAV_CREATE)
+				else if (creating)
 				{
 					bool full_dir = true;
 
@@ -771,7 +1706,9 @@ bool directory_navigator(char** directory_pieces, unsigned directory_pieces_size
 					{
 						if (root_dir[j].first_block == 0x00)
 						{
-							root_dir[j].first_block = get_available_cluster();
+							// No mkdir -s, o último diretório do caminho é criado ordenado.
+							bool sorted = nav_type == NAV_CREATE_SORTED && depth == 1;
+							root_dir[j].first_block = sorted ? create_sorted_directory() : allocate_empty_cluster();
 							// Sistema de arquivos cheio, não há espaço disponível.
 							if (root_dir[j].first_block == 0x00)
 							{
@@ -780,8 +1717,10 @@ bool directory_navigator(char** directory_pieces, unsigned directory_pieces_size
 							}
 							// Cria a entrada de diretório.
 							root_dir[j].attributes = 0x1;
-							strcpy(root_dir[j].filename, directory_pieces[1]);
-							fat[root_dir[j].first_block] = 0xffff;
+							strcpy(root_dir[j].filename, path->components[0].name);
+							memset(root_dir[j].reserved, 0x00, sizeof(root_dir[j].reserved));
+							root_dir[j].reserved[0] = sorted ? ENTRY_SORTED : 0x00;
+							set_name_hash(&root_dir[j]);
 							next_block = root_dir[j].first_block;
 							full_dir = false;
 							*index = root_dir[j].first_block;
@@ -801,49 +1740,53 @@ bool directory_navigator(char** directory_pieces, unsigned directory_pieces_size
 		// Lida com diretórios/arquivos fora do root_dir.
 		else
 		{
+			// O cluster do diretório é lido uma única vez; as entradas são consultadas na cópia.
+			data_cluster dir_cluster;
+			get_data_cluster(next_block, &dir_cluster);
+
 			bool find_dir = false;
+			uint32_t candidates = name_candidates(dir_cluster.dir, &path->components[i]);
 			for (int j = 0; j < 32; j++)
 			{
-				if (strcmp(get_data_cluster(next_block).dir[j].filename, directory_pieces[i]) == 0)
+				if ((candidates >> j & 1) && entry_matches(&dir_cluster.dir[j], &path->components[i]))
 				{
-					if (get_data_cluster(next_block).dir[j].attributes == 0x1)
+					if (dir_cluster.dir[j].attributes == 0x1)
 					{
 						find_dir = true;
 
 						// Caso o diretório seja encontrado, e o comando delete seja passado, apaga o diretório.
-						if (nav_type == NAV_DELETE && (directory_pieces_size - 1) == i)
+						if (nav_type == NAV_DELETE && (depth - 1) == i)
 						{
 							// Checa para ver se o diretório está vazio.
-							for (int k = 0; k < 32; k++)
+							if (!is_empty_directory(&dir_cluster.dir[j]))
 							{
-								if (get_data_cluster(get_data_cluster(next_block).dir[j].first_block).dir[k].first_block != 0x00)
-								{
-									*return_info = NOT_EMPTY_DIR;
-									return false;
-								}
+								*return_info = NOT_EMPTY_DIR;
+								return false;
 							}
 
 							// Reseta os valores da entrada de diretório.
 							data_cluster cluster;
 							memset(cluster.dir, 0x00, CLUSTER_SIZE);
-							cluster = get_data_cluster(next_block);
+							get_data_cluster(next_block, &cluster);
+							release_directory(&cluster.dir[j]);
+							memset(cluster.dir[j].reserved, 0x00, sizeof(cluster.dir[j].reserved));
 							cluster.dir[j].first_block = 0x00;
 							cluster.dir[j].attributes = 0x0;
-							fat[cluster.dir[j].first_block] = 0x00;
 							memset(cluster.dir[j].filename, 0x00, 18);
-							save_data_cluster(next_block, cluster);
+							save_data_cluster(next_block, &cluster);
 							return true;
 						}
 
-						// Atualiza o próximo bloco a ser visto.
-						next_block = get_data_cluster(next_block).dir[j].first_block;
+						// Atualiza o próximo bloco a ser visto (em um diretório ordenado, a folha que cobre o próximo nome).
+						*type = SUB_DIR;
+						if (!enter_directory(&dir_cluster.dir[j], path, i + 1, creating, &next_block, type, return_info))
+							return false;
 
 						// Caso seja a última 'peça' do diretório, retorna as informações e o 'next_block'.
-						if ((directory_pieces_size - 1) == i)
+						if ((depth - 1) == i)
 						{
 							*index = next_block;
 							*return_info = DATA_DIR;
-							*type = SUB_DIR;
 							return true;
 						}
 
@@ -851,11 +1794,11 @@ bool directory_navigator(char** directory_pieces, unsigned directory_pieces_size
 					}
 					else
 					{
-						if ((directory_pieces_size - 1) == i)
+						if ((depth - 1) == i)
 						{
 							if (nav_type == NAV_DELETE)
 							{
-								unsigned local_next_block = get_data_cluster(next_block).dir[j].first_block;
+								unsigned local_next_block = dir_cluster.dir[j].first_block;
 								unsigned* file_trace_back = NULL;
 
 								int iteration = 0;
@@ -863,7 +1806,7 @@ bool directory_navigator(char** directory_pieces, unsigned directory_pieces_size
 								do
 								{
 									if (iteration != 0)
-										local_next_block = fat[local_next_block];
+										local_next_block = fat_get(local_next_block);
 
 									if (local_next_block != 0xffff)
 									{
@@ -874,26 +1817,24 @@ bool directory_navigator(char** directory_pieces, unsigned directory_pieces_size
 								}
 								while (local_next_block != 0xffff);
 
-								// Percorre o vetor resetando os valores da fat e dos clusters de dados.
+								// Percorre o vetor liberando os clusters de dados.
 								for (int k = 0; k < iteration; k++)
-								{
-									fat[file_trace_back[k]] = 0x00;
-									data_cluster cluster;
-									memset(cluster.data, 0x00, CLUSTER_SIZE);
-									save_data_cluster(file_trace_back[k], cluster);
-								}
+									release_cluster(file_trace_back[k]);
 
 								free(file_trace_back);
 
 								// Reseta os valores da entrada de diretório.
 								data_cluster cluster;
 								memset(cluster.dir, 0x00, CLUSTER_SIZE);
-								cluster = get_data_cluster(next_block);
+								get_data_cluster(next_block, &cluster);
+								used_bytes -= cluster.dir[j].size;
+								release_inline_slots(cluster.dir, j);
+								memset(cluster.dir[j].reserved, 0x00, sizeof(cluster.dir[j].reserved));
 								cluster.dir[j].first_block = 0x00;
 								cluster.dir[j].attributes = 0x0;
 								cluster.dir[j].size = 0x00;
 								memset(cluster.dir[j].filename, 0x00, 18);
-								save_data_cluster(next_block, cluster);
+								save_data_cluster(next_block, &cluster);
 
 								return true;
 							}
@@ -924,18 +1865,19 @@ bool directory_navigator(char** directory_pieces, unsigned directory_pieces_size
 					return false;
 				}
 				// Diretório não encontrado, cria-o, dependendo da necessidade.
-				else if (nav_type == NAV_CREATE)
+				else if (creating)
 				{
 					bool full_dir = true;
 					for (int j = 0; j < 32; j++)
 					{
 						// Cria um novo diretório, caso necessário.
-						if (get_data_cluster(next_block).dir[j].first_block == 0x00)
+						if (dir_cluster.dir[j].first_block == 0x00)
 						{
 							data_cluster cluster;
 							memset(cluster.dir, 0x00, CLUSTER_SIZE);
-							cluster = get_data_cluster(next_block);
-							cluster.dir[j].first_block = get_available_cluster();
+							get_data_cluster(next_block, &cluster);
+							bool sorted = nav_type == NAV_CREATE_SORTED && (depth - 1) == i;
+							cluster.dir[j].first_block = sorted ? create_sorted_directory() : allocate_empty_cluster();
 							// Sistema de arquivos cheio, não há espaço disponível.
 							if (cluster.dir[j].first_block == 0x00)
 							{
@@ -944,10 +1886,12 @@ bool directory_navigator(char** directory_pieces, unsigned directory_pieces_size
 							}
 							// Cria entrada de diretório.
 							cluster.dir[j].attributes = 0x1;
-							strcpy(cluster.dir[j].filename, directory_pieces[i]);
-							save_data_cluster(next_block, cluster);
-							fat[get_data_cluster(next_block).dir[j].first_block] = 0xffff;
-							next_block = get_data_cluster(next_block).dir[j].first_block;
+							strcpy(cluster.dir[j].filename, path->components[i].name);
+							memset(cluster.dir[j].reserved, 0x00, sizeof(cluster.dir[j].reserved));
+							cluster.dir[j].reserved[0] = sorted ? ENTRY_SORTED : 0x00;
+							set_name_hash(&cluster.dir[j]);
+							save_data_cluster(next_block, &cluster);
+							next_block = cluster.dir[j].first_block;
 							full_dir = false;
 							*index = next_block;
 							break;
@@ -965,11 +1909,11 @@ bool directory_navigator(char** directory_pieces, unsigned directory_pieces_size
 		}
 	}
 
-	if (nav_type == NAV_CREATE)
+	if (creating)
 		return true;
 }
 
-bool create_file(char** directory_pieces, unsigned directory_pieces_size, unsigned* return_info, unsigned index)
+bool create_file(path_t* path, unsigned* return_info, unsigned index)
 {
 	unsigned next_block = index;
 
@@ -983,17 +1927,12 @@ bool create_file(char** directory_pieces, unsigned directory_pieces_size, unsign
 			if (root_dir[i].first_block == 0x00)
 			{
 				full_dir = false;
-				root_dir[i].first_block = get_available_cluster();
-				// Sistema de arquivos cheio, não há espaço disponível.
-				if (root_dir[i].first_block == 0x00)
-				{
-					*return_info = BLOATED_SYSTEM;
-					return false;
-				}
-				// Cria a entrada de diretório para o arquivo.
-				root_dir[i].attributes = 0x0;
-				fat[root_dir[i].first_block] = 0xffff;
-				strcpy(root_dir[i].filename, directory_pieces[directory_pieces_size - 1]);
+				// Cria a entrada de diretório para o arquivo, vazio e embutido: nenhum cluster é alocado até o conteúdo deixar de caber no diretório.
+				memset(&root_dir[i], 0x00, sizeof(dir_entry_t));
+				root_dir[i].first_block = 0xffff;
+				root_dir[i].reserved[0] = ENTRY_INLINE;
+				strcpy(root_dir[i].filename, path->components[path->size - 1].name);
+				set_name_hash(&root_dir[i]);
 
 				return true;
 			}
@@ -1010,27 +1949,21 @@ bool create_file(char** directory_pieces, unsigned directory_pieces_size, unsign
 	else
 	{
 		bool full_dir = true;
+		data_cluster cluster;
+		get_data_cluster(next_block, &cluster);
 		// Percorre os diretórios do cluster a procura de uma entrada de diretório vazia.
 		for (int i = 0; i < 32; i++)
 		{
-			if (get_data_cluster(next_block).dir[i].first_block == 0x00)
+			if (cluster.dir[i].first_block == 0x00)
 			{
 				full_dir = false;
-				data_cluster cluster;
-				memset(cluster.dir, 0x00, CLUSTER_SIZE);
-				cluster = get_data_cluster(next_block);
-				cluster.dir[i].first_block = get_available_cluster();
-				// Sistema de arquivos cheio, não há espaço disponível.
-				if (cluster.dir[i].first_block == 0x00)
-				{
-					*return_info = BLOATED_SYSTEM;
-					return false;
-				}
-				// Cria a entrada de diretório para o arquivo.
-				cluster.dir[i].attributes = 0x0;
-				fat[cluster.dir[i].first_block] = 0xffff;
-				strcpy(cluster.dir[i].filename, directory_pieces[directory_pieces_size - 1]);
-				save_data_cluster(next_block, cluster);
+				// Cria a entrada de diretório para o arquivo, vazio e embutido.
+				memset(&cluster.dir[i], 0x00, sizeof(dir_entry_t));
+				cluster.dir[i].first_block = 0xffff;
+				cluster.dir[i].reserved[0] = ENTRY_INLINE;
+				strcpy(cluster.dir[i].filename, path->components[path->size - 1].name);
+				set_name_hash(&cluster.dir[i]);
+				save_data_cluster(next_block, &cluster);
 
 				return true;
 			}
@@ -1045,19 +1978,21 @@ bool create_file(char** directory_pieces, unsigned directory_pieces_size, unsign
 	}
 }
 
-bool write_file(char** directory_pieces, unsigned directory_pieces_size, unsigned index, char* data, unsigned* return_info)
+bool write_file(path_t* path, unsigned index, char* data, unsigned* return_info)
 {
 	unsigned next_block = index;
 	unsigned dir_entry_block = 0x00;
 	unsigned dir_entry_index = 0x00;
 	bool find_file = false;
+	unsigned char entry_flags = 0x00;
 
 	if (next_block == 0x00)
 	{
+		uint32_t candidates = name_candidates(root_dir, &path->components[path->size - 1]);
 		// Percorre os diretórios de root_dir a procura do arquivo.
 		for (int i = 0; i < 32; i++)
 		{
-			if (strcmp(root_dir[i].filename, directory_pieces[directory_pieces_size - 1]) == 0)
+			if ((candidates >> i & 1) && entry_matches(&root_dir[i], &path->components[path->size - 1]))
 			{
 				// A entrada de diretório encontrada não é um arquivo.
 				if (root_dir[i].attributes == 0x1)
@@ -1068,6 +2003,7 @@ bool write_file(char** directory_pieces, unsigned directory_pieces_size, unsigne
 
 				find_file = true;
 				next_block = root_dir[i].first_block;
+				entry_flags = root_dir[i].reserved[0];
 				dir_entry_index = i;
 				break;
 			}
@@ -1076,20 +2012,24 @@ bool write_file(char** directory_pieces, unsigned directory_pieces_size, unsigne
 	else
 	{
 		// Percorre os diretórios dos clusteres de dados a procura do arquivo.
+		data_cluster dir_cluster;
+		get_data_cluster(next_block, &dir_cluster);
+		uint32_t candidates = name_candidates(dir_cluster.dir, &path->components[path->size - 1]);
 		for (int i = 0; i < 32; i++)
 		{
-			if (strcmp(get_data_cluster(next_block).dir[i].filename, directory_pieces[directory_pieces_size - 1]) == 0)
+			if ((candidates >> i & 1) && entry_matches(&dir_cluster.dir[i], &path->components[path->size - 1]))
 			{
 				// A entrada de diretório encontrada não é um arquivo.
-				if (get_data_cluster(next_block).dir[i].attributes == 0x1)
+				if (dir_cluster.dir[i].attributes == 0x1)
 				{
 					*return_info = NOT_A_FILE;
 					return false;
 				}
 
 				find_file = true;
-				next_block = get_data_cluster(next_block).dir[i].first_block;
 				dir_entry_block = next_block;
+				entry_flags = dir_cluster.dir[i].reserved[0];
+				next_block = dir_cluster.dir[i].first_block;
 				dir_entry_index = i;
 				break;
 			}
@@ -1103,80 +2043,175 @@ bool write_file(char** directory_pieces, unsigned directory_pieces_size, unsigne
 		return false;
 	}
 
-	int data_size = strlen(data);
-	int ceiling = 0;
-	int multiplier = 0;
+	unsigned data_size = strlen(data);
 
-	// A cada iteração escreve em um cluster.
-	do
+	// Arquivos pequenos ficam embutidos no próprio diretório, em entradas de continuação livres, sem cluster de dados.
+	// Sem entradas livres suficientes, o conteúdo vai para uma cadeia de clusters como nos demais arquivos.
+	if (data_size <= INLINE_MAX_SIZE && !(entry_flags & ENTRY_COMPRESSED))
 	{
-		// Na primeira iteração naõ é necessário criar um bloco novo.
-		if (multiplier != 0)
+		data_cluster cluster;
+		dir_entry_t* dir = root_dir;
+		if (dir_entry_block != 0x00)
+		{
+			get_data_cluster(dir_entry_block, &cluster);
+			dir = cluster.dir;
+		}
+
+		if (store_inline(dir, dir_entry_index, data, data_size))
 		{
-			// Caso seja necessário, aloca um cluster novo para o arquivo.
-			if (fat[next_block] == 0xffff)
+			for (unsigned block = next_block; block != 0xffff; )
 			{
-				fat[next_block] = get_available_cluster();
-				// Sistema de arquivos cheio, não há espaço disponível.
-				if (fat[next_block] == 0x00)
-				{
-					*return_info = BLOATED_SYSTEM;
-					return false;
-				}
+				unsigned following_block = fat_get(block);
+				release_cluster(block);
+				block = following_block;
 			}
 
-			next_block = fat[next_block];
-			fat[next_block] = 0xffff;
+			used_bytes = used_bytes - dir[dir_entry_index].size + data_size;
+			dir[dir_entry_index].size = data_size;
+			if (dir_entry_block != 0x00)
+				save_data_cluster(dir_entry_block, &cluster);
+
+			return true;
 		}
+	}
 
-		// Define o teto, para não escrever onde não se deve.
-		if (data_size >= CLUSTER_SIZE)
-			ceiling = CLUSTER_SIZE;
-		else
-			ceiling = data_size;
+	// Arquivos comprimidos gravam o conteúdo comprimido em pedaços; o tamanho da entrada continua sendo o dos dados originais.
+	uint8_t* payload = (uint8_t*) data;
+	unsigned payload_size = data_size;
+	if (entry_flags & ENTRY_COMPRESSED)
+		payload_size = lz_pack((uint8_t*) data, data_size, &payload);
 
-		// Até o teto estipulado, escreve os dados.
-		for (int i = 0; i < ceiling; i++)
+	unsigned needed = payload_size == 0 ? 1 : (payload_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+
+	// Com a deduplicação ligada, a nova cadeia é montada à parte, do fim para o começo, reaproveitando clusters com o mesmo conteúdo;
+	// a cadeia antiga só é liberada depois. Sem espaço para isso, a escrita segue o caminho normal, reaproveitando a cadeia antiga.
+	unsigned first_block = next_block;
+	if (dedup_enabled && payload_size > 0 && write_deduplicated((char*) payload, payload_size, &first_block))
+	{
+		for (unsigned block = next_block; block != 0xffff; )
 		{
-			data_cluster cluster;
-			memset(cluster.data, 0x00, CLUSTER_SIZE);
-			cluster = get_data_cluster(next_block);
-			cluster.data[i] = data[(multiplier * CLUSTER_SIZE) + i];
-			save_data_cluster(next_block, cluster);
+			unsigned following_block = fat_get(block);
+			release_cluster(block);
+			block = following_block;
 		}
-
-		// Incrementa o tamanho do arquivo.
-		if (dir_entry_block == 0x00)
-			root_dir[dir_entry_index].size += CLUSTER_SIZE;
-		else
+	}
+	else
+	{
+		// Conta os clusters que pertencem somente a este arquivo (a parte compartilhada com clones, se houver, é sempre o final da cadeia).
+		unsigned owned = 0, last_owned = 0xffff, shared_block = 0xffff;
+		for (unsigned block = next_block; block != 0xffff; block = fat_get(block))
 		{
-			data_cluster cluster;
-			memset(cluster.dir, 0x00, CLUSTER_SIZE);
-			cluster = get_data_cluster(dir_entry_block);
-			cluster.dir[dir_entry_index].size += CLUSTER_SIZE;
-			save_data_cluster(dir_entry_block, cluster);
+			if (is_shared_cluster(block))
+			{
+				shared_block = block;
+				break;
+			}
+
+			last_owned = block;
+			owned++;
 		}
 
-		data_size = data_size - ceiling; // Remove o teto do tamanho do dado a ser escrito para a próxima iteração.
-		multiplier++;
-	} while (data_size != 0);
+		// Confere a capacidade antes de tocar em qualquer cluster, para que uma escrita sem espaço não deixe alocações pela metade.
+		if (needed > owned && needed - owned > free_clusters)
+		{
+			if (payload != (uint8_t*) data)
+				free(payload);
+			*return_info = BLOATED_SYSTEM;
+			return false;
+		}
+
+		// O conteúdo todo é substituído: a parte compartilhada fica com os clones e o arquivo só perde sua referência a ela, sem cópias.
+		if (shared_block != 0xffff)
+		{
+			for (unsigned block = shared_block; block != 0xffff; )
+			{
+				unsigned following_block = fat_get(block);
+				release_cluster(block);
+				block = following_block;
+			}
+
+			if (last_owned == 0xffff)
+				first_block = next_block = allocate_cluster();
+			else
+				fat_set(last_owned, 0xffff);
+		}
+
+		// Um arquivo embutido ainda não tem cadeia: ela começa em um cluster novo.
+		if (next_block == 0xffff)
+			first_block = next_block = allocate_cluster();
+
+		// A cada iteração escreve um cluster inteiro, reaproveitando a cadeia existente e estendendo-a quando necessário.
+		for (unsigned k = 0; k < needed; k++)
+		{
+			if (k != 0)
+			{
+				if (fat_get(next_block) == 0xffff)
+					fat_set(next_block, allocate_cluster());
+
+				next_block = fat_get(next_block);
+			}
+
+			// O restante do cluster é preenchido com 0x00, que marca o fim dos dados.
+			unsigned ceiling = payload_size - (k * CLUSTER_SIZE) >= CLUSTER_SIZE ? CLUSTER_SIZE : payload_size - (k * CLUSTER_SIZE);
+			data_cluster cluster;
+			memset(cluster.data, 0x00, CLUSTER_SIZE);
+			memcpy(cluster.data, payload + (k * CLUSTER_SIZE), ceiling);
+			save_data_cluster(next_block, &cluster);
+		}
+
+		// Libera os clusters que sobraram da versão anterior do arquivo, caso ela fosse maior.
+		unsigned rest_block = fat_get(next_block);
+		fat_set(next_block, 0xffff);
+		while (rest_block != 0xffff)
+		{
+			unsigned following_block = fat_get(rest_block);
+			release_cluster(rest_block);
+			rest_block = following_block;
+		}
+	}
+
+	// Atualiza o tamanho e o primeiro cluster do arquivo (a cadeia é nova caso ela fosse inteira compartilhada ou o arquivo estivesse embutido).
+	data_cluster dir_cluster;
+	dir_entry_t* dir = root_dir;
+	if (dir_entry_block != 0x00)
+	{
+		get_data_cluster(dir_entry_block, &dir_cluster);
+		dir = dir_cluster.dir;
+	}
+
+	used_bytes = used_bytes - dir[dir_entry_index].size + data_size;
+	dir[dir_entry_index].size = data_size;
+	dir[dir_entry_index].first_block = first_block;
+	if (dir[dir_entry_index].reserved[0] & ENTRY_INLINE)
+	{
+		release_inline_slots(dir, dir_entry_index);
+		dir[dir_entry_index].reserved[0] &= ~ENTRY_INLINE;
+	}
+
+	if (dir_entry_block != 0x00)
+		save_data_cluster(dir_entry_block, &dir_cluster);
+
+	if (payload != (uint8_t*) data)
+		free(payload);
 
 	return true;
 }
 
-bool append_file (char** directory_pieces, unsigned directory_pieces_size, unsigned index, char* data, unsigned* return_info)
+bool append_file (path_t* path, unsigned index, char* data, unsigned* return_info)
 {
 	unsigned next_block = index;
 	unsigned dir_entry_block = 0x00;
 	unsigned dir_entry_index = 0x00;
 	bool find_file = false;
+	unsigned char entry_flags = 0x00;
 
 	if (next_block == 0x00)
 	{
+		uint32_t candidates = name_candidates(root_dir, &path->components[path->size - 1]);
 		// Percorre os diretórios de root_dir a procura do arquivo.
 		for (int i = 0; i < 32; i++)
 		{
-			if (strcmp(root_dir[i].filename, directory_pieces[directory_pieces_size - 1]) == 0)
+			if ((candidates >> i & 1) && entry_matches(&root_dir[i], &path->components[path->size - 1]))
 			{
 				// A entrada de diretório encontrada não é um arquivo.
 				if (root_dir[i].attributes == 0x1)
@@ -1187,6 +2222,7 @@ bool append_file (char** directory_pieces, unsigned directory_pieces_size, unsig
 
 				find_file = true;
 				next_block = root_dir[i].first_block;
+				entry_flags = root_dir[i].reserved[0];
 				dir_entry_index = i;
 				break;
 			}
@@ -1195,20 +2231,24 @@ bool append_file (char** directory_pieces, unsigned directory_pieces_size, unsig
 	else
 	{
 		// Percorre os diretórios dos clusteres de dados a procura do arquivo.
+		data_cluster dir_cluster;
+		get_data_cluster(next_block, &dir_cluster);
+		uint32_t candidates = name_candidates(dir_cluster.dir, &path->components[path->size - 1]);
 		for (int i = 0; i < 32; i++)
 		{
-			if (strcmp(get_data_cluster(next_block).dir[i].filename, directory_pieces[directory_pieces_size - 1]) == 0)
+			if ((candidates >> i & 1) && entry_matches(&dir_cluster.dir[i], &path->components[path->size - 1]))
 			{
 				// A entrada de diretório encontrada não é um arquivo.
-				if (get_data_cluster(next_block).dir[i].attributes == 0x1)
+				if (dir_cluster.dir[i].attributes == 0x1)
 				{
 					*return_info = NOT_A_FILE;
 					return false;
 				}
 
 				find_file = true;
-				next_block = get_data_cluster(next_block).dir[i].first_block;
 				dir_entry_block = next_block;
+				entry_flags = dir_cluster.dir[i].reserved[0];
+				next_block = dir_cluster.dir[i].first_block;
 				dir_entry_index = i;
 				break;
 			}
@@ -1222,102 +2262,122 @@ bool append_file (char** directory_pieces, unsigned directory_pieces_size, unsig
 		return false;
 	}
 
-	// Encontra o primeiro espaço vazio no arquivo.
-	int iteration = 0;
-	int empty_index = 0;
-	do
+	// Em arquivos comprimidos o final do conteúdo está dentro de um pedaço comprimido, e nos embutidos ele pode deixar de caber
+	// no diretório: o arquivo é lido e regravado.
+	if (entry_flags & (ENTRY_COMPRESSED | ENTRY_INLINE))
 	{
-		if (iteration != 0)
-			next_block = fat[next_block];
-
-		// Percorre o cluster procurando espaço vazio.
-		for (int i = 0; i < CLUSTER_SIZE; i++)
+		char* content = NULL;
+		if (!read_file(path, index, &content, return_info))
 		{
-			if (get_data_cluster(next_block).data[i] == 0x00)
-			{
-				empty_index = i;
-				break;
-			}
+			free(content);
+			return false;
 		}
 
-		iteration++;
-	} while (fat[next_block] != 0xffff);
+		unsigned content_size = strlen(content);
+		content = (char*) realloc(content, (content_size + strlen(data) + 1) * sizeof(char));
+		strcpy(content + content_size, data);
 
-	// Insere os dados partindo do espaço vazio encontrado anteriormente.
-	int data_size = strlen(data);
-	int ceiling = 0;
-	int multiplier = 0;
-	do
+		bool success = write_file(path, index, content, return_info);
+		free(content);
+		return success;
+	}
+
+	// Encontra o último cluster do arquivo e o primeiro espaço vazio nele, contando os clusters compartilhados com clones.
+	unsigned first_block = next_block, shared = 0;
+	while (true)
 	{
-		// Na primeira iteração não é necessário criar um bloco novo.
-		if (multiplier != 0)
-		{
-			// Aloca um novo cluster para o arquivo, caso necessário.
-			if (fat[next_block] == 0xffff)
-			{
-				fat[next_block] = get_available_cluster();
-				// Sistema de arquivos cheio, não há espaço disponível.
-				if (fat[next_block] == 0x00)
-				{
-					*return_info = BLOATED_SYSTEM;
-					return false;
-				}
-			}
+		if (is_shared_cluster(next_block))
+			shared++;
 
-			next_block = fat[next_block];
-			fat[next_block] = 0xffff;
-		}
+		if (fat_get(next_block) == 0xffff)
+			break;
 
-		// Define o teto, para não escrever onde não se deve.
-		if ((data_size + empty_index) >= CLUSTER_SIZE)
-			ceiling = CLUSTER_SIZE;
-		else
-			ceiling = data_size + empty_index;
+		next_block = fat_get(next_block);
+	}
+
+	data_cluster cluster;
+	get_data_cluster(next_block, &cluster);
+	unsigned empty_index = 0;
+	while (empty_index < CLUSTER_SIZE && cluster.data[empty_index] != 0x00)
+		empty_index++;
+
+	// Confere a capacidade antes de tocar em qualquer cluster.
+	unsigned data_size = strlen(data);
+	unsigned needed = (empty_index + data_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+	if (needed < 1)
+		needed = 1;
+	if (data_size > 0 && needed - 1 + shared > free_clusters)
+	{
+		*return_info = BLOATED_SYSTEM;
+		return false;
+	}
+
+	// O último cluster (e o ponteiro para o próximo) será alterado: a parte compartilhada com clones é copiada antes.
+	if (data_size > 0 && shared > 0)
+	{
+		first_block = unshare_chain(first_block);
+		next_block = first_block;
+		while (fat_get(next_block) != 0xffff)
+			next_block = fat_get(next_block);
+	}
 
-		// Escreve os dados até o teto estipulado.
-		for (int i = empty_index; i < ceiling; i++)
+	// Insere os dados partindo do espaço vazio encontrado anteriormente, um cluster inteiro por escrita.
+	unsigned written = 0;
+	while (written < data_size)
+	{
+		// Cluster cheio: aloca um novo para o arquivo.
+		if (empty_index == CLUSTER_SIZE)
 		{
-			data_cluster cluster;
+			fat_set(next_block, allocate_cluster());
+			next_block = fat_get(next_block);
 			memset(cluster.data, 0x00, CLUSTER_SIZE);
-			cluster = get_data_cluster(next_block);
-			cluster.data[i] = data[(multiplier * CLUSTER_SIZE) + (i - empty_index)];
-			save_data_cluster(next_block, cluster);
+			empty_index = 0;
 		}
 
-		// Incrementa o tamanho do arquivo.
-		if (dir_entry_block == 0x00)
-			root_dir[dir_entry_index].size += CLUSTER_SIZE;
-		else
-		{
-			data_cluster cluster;
-			memset(cluster.dir, 0x00, CLUSTER_SIZE);
-			cluster = get_data_cluster(dir_entry_block);
-			cluster.dir[dir_entry_index].size += CLUSTER_SIZE;
-			save_data_cluster(dir_entry_block, cluster);
-		}
+		unsigned ceiling = data_size - written >= CLUSTER_SIZE - empty_index ? CLUSTER_SIZE - empty_index : data_size - written;
+		memcpy(cluster.data + empty_index, data + written, ceiling);
+		save_data_cluster(next_block, &cluster);
 
-		data_size = data_size - ceiling;
-		empty_index = 0;
-		multiplier++;
-	} while (data_size != 0);
+		empty_index += ceiling;
+		written += ceiling;
+	}
+
+	// Incrementa o tamanho do arquivo (e atualiza o primeiro cluster, caso a cadeia tenha sido copiada).
+	used_bytes += data_size;
+	if (dir_entry_block == 0x00)
+	{
+		root_dir[dir_entry_index].size += data_size;
+		root_dir[dir_entry_index].first_block = first_block;
+	}
+	else
+	{
+		data_cluster dir_cluster;
+		get_data_cluster(dir_entry_block, &dir_cluster);
+		dir_cluster.dir[dir_entry_index].size += data_size;
+		dir_cluster.dir[dir_entry_index].first_block = first_block;
+		save_data_cluster(dir_entry_block, &dir_cluster);
+	}
 
 	return true;
 }
 
-bool read_file (char** directory_pieces, unsigned directory_pieces_size, unsigned index, char** data, unsigned* return_info)
+bool read_file (path_t* path, unsigned index, char** data, unsigned* return_info)
 {
 	unsigned next_block = index;
 	unsigned dir_entry_block = 0x00;
 	unsigned dir_entry_index = 0x00;
 	bool find_file = false;
+	unsigned char entry_flags = 0x00;
+	unsigned entry_size = 0;
 
 	// Caso a entrada de diretório do arquivo solicitado esteja no root_dir.
 	if (next_block == 0x00)
 	{
+		uint32_t candidates = name_candidates(root_dir, &path->components[path->size - 1]);
 		// Percorre os diretórios a procura da entrada de diretório do arquivo.
 		for (int i = 0; i < 32; i++)
 		{
-			if (strcmp(root_dir[i].filename, directory_pieces[directory_pieces_size - 1]) == 0)
+			if ((candidates >> i & 1) && entry_matches(&root_dir[i], &path->components[path->size - 1]))
 			{
 				// Checa se a entrada de diretório encontrada corresponde a um arquivo.
 				if (root_dir[i].attributes == 0x1)
@@ -1328,6 +2388,8 @@ bool read_file (char** directory_pieces, unsigned directory_pieces_size, unsigne
 
 				find_file = true;
 				next_block = root_dir[i].first_block;
+				entry_flags = root_dir[i].reserved[0];
+				entry_size = root_dir[i].size;
 				dir_entry_index = i;
 				break;
 			}
@@ -1337,21 +2399,26 @@ bool read_file (char** directory_pieces, unsigned directory_pieces_size, unsigne
 	else
 	{
 		// Percorre os diretórios a procura da entrada de diretório do arquivo.
+		data_cluster dir_cluster;
+		get_data_cluster(next_block, &dir_cluster);
+		uint32_t candidates = name_candidates(dir_cluster.dir, &path->components[path->size - 1]);
 		for (int i = 0; i < 32; i++)
 		{
 			// Se o nome passado der match.
-			if (strcmp(get_data_cluster(next_block).dir[i].filename, directory_pieces[directory_pieces_size - 1]) == 0)
+			if ((candidates >> i & 1) && entry_matches(&dir_cluster.dir[i], &path->components[path->size - 1]))
 			{
 				// Checa se a entrada de diretório encontrada corresponde a um arquivo.
-				if (get_data_cluster(next_block).dir[i].attributes == 0x1)
+				if (dir_cluster.dir[i].attributes == 0x1)
 				{
 					*return_info = NOT_A_FILE;
 					return false;
 				}
 
 				find_file = true;
-				next_block = get_data_cluster(next_block).dir[i].first_block;
 				dir_entry_block = next_block;
+				entry_flags = dir_cluster.dir[i].reserved[0];
+				entry_size = dir_cluster.dir[i].size;
+				next_block = dir_cluster.dir[i].first_block;
 				dir_entry_index = i;
 				break;
 			}
@@ -1365,6 +2432,47 @@ bool read_file (char** directory_pieces, unsigned directory_pieces_size, unsigne
 		return false;
 	}
 
+	// Arquivos embutidos: o conteúdo está nas entradas de continuação do próprio diretório.
+	if (entry_flags & ENTRY_INLINE)
+	{
+		data_cluster cluster;
+		dir_entry_t* dir = root_dir;
+		if (dir_entry_block != 0x00)
+		{
+			get_data_cluster(dir_entry_block, &cluster);
+			dir = cluster.dir;
+		}
+
+		(*data) = (char*) realloc((*data), (entry_size + 1) * sizeof(char));
+		read_inline(dir, dir_entry_index, *data);
+		return true;
+	}
+
+	// Arquivos comprimidos: lê a cadeia inteira de uma vez e descomprime os pedaços; o tamanho vem da entrada.
+	if (entry_flags & ENTRY_COMPRESSED)
+	{
+		unsigned* blocks = NULL;
+		unsigned num_blocks = 0;
+		for (unsigned block = next_block; block != 0xffff && block != 0x00 && num_blocks < NUM_CLUSTER; block = fat_get(block))
+		{
+			blocks = (unsigned*) realloc(blocks, (num_blocks + 1) * sizeof(unsigned));
+			blocks[num_blocks++] = block;
+		}
+
+		data_cluster* clusters = (data_cluster*) malloc((num_blocks + 1) * sizeof(data_cluster));
+		read_cluster_batch(blocks, num_blocks, clusters);
+
+		(*data) = (char*) realloc((*data), (entry_size + 1) * sizeof(char));
+		bool success = lz_unpack((uint8_t*) clusters, num_blocks * CLUSTER_SIZE, (uint8_t*) (*data), entry_size);
+		(*data)[success ? entry_size : 0] = '\0';
+
+		free(blocks);
+		free(clusters);
+		if (!success)
+			*return_info = CORRUPTED_FILE;
+		return success;
+	}
+
 	int iteration = 0;
 	int multiplier = 1;
 	int data_iterator = 0;
@@ -1372,19 +2480,22 @@ bool read_file (char** directory_pieces, unsigned directory_pieces_size, unsigne
 	do
 	{
 		if (iteration != 0)
-			next_block = fat[next_block];
+			next_block = fat_get(next_block);
 
+		// O cluster é lido uma única vez por iteração; seguir a cadeia assim aciona a leitura antecipada do cache.
 		(*data) = (char*) realloc((*data), multiplier * CLUSTER_SIZE * sizeof(char));
+		data_cluster cluster;
+		get_data_cluster(next_block, &cluster);
 		for (int i = 0; i < CLUSTER_SIZE; i++)
 		{
-			if (get_data_cluster(next_block).data[i] != 0x00)
-				(*data)[data_iterator++] = get_data_cluster(next_block).data[i];
+			if (cluster.data[i] != 0x00)
+				(*data)[data_iterator++] = cluster.data[i];
 			else
 				break;
 		}
 		iteration++;
 		multiplier++;
-	} while (fat[next_block] != 0xffff);
+	} while (fat_get(next_block) != 0xffff);
 
 	// Cria mais um espaço para o '\0' caso necessário.
 	if (data_iterator == CLUSTER_SIZE)
@@ -1396,122 +2507,3979 @@ bool read_file (char** directory_pieces, unsigned directory_pieces_size, unsigne
 	return true;
 }
 
-unsigned get_available_cluster()
+// Regrava o arquivo com (compress) ou sem (decompress) compressão: lê o conteúdo, troca a flag da entrada e escreve de novo.
+// Caso não haja espaço para a nova versão, a flag original é restaurada e o arquivo continua como estava.
+bool set_file_compression(path_t* path, unsigned index, bool compressed, unsigned* return_info)
 {
-	// Percorre a fat a procura de um índice livre.
-	for (int i = 10; i < NUM_CLUSTER; i++)
+	char* data = NULL;
+	if (!read_file(path, index, &data, return_info))
 	{
-		if (fat[i] == 0x00)
-			return i;
+		free(data);
+		return false;
 	}
 
-	// Caso não encontre, retorna um índice inválido.
-	return 0x00;
+	// Encontra a entrada (read_file já garantiu que ela existe e é um arquivo) para trocar a flag.
+	data_cluster cluster;
+	if (index != 0x00)
+		get_data_cluster(index, &cluster);
+	dir_entry_t* dir = index == 0x00 ? root_dir : cluster.dir;
+	unsigned char flags = 0x00;
+	uint32_t candidates = name_candidates(dir, &path->components[path->size - 1]);
+	for (int i = 0; i < 32; i++)
+	{
+		if ((candidates >> i & 1) && entry_matches(&dir[i], &path->components[path->size - 1]))
+		{
+			flags = dir[i].reserved[0];
+			break;
+		}
+	}
+
+	if (((flags & ENTRY_COMPRESSED) != 0) == compressed)
+	{
+		free(data);
+		return true;
+	}
+
+	set_entry_flags(path, index, compressed ? (flags | ENTRY_COMPRESSED) : (flags & ~ENTRY_COMPRESSED));
+	bool success = write_file(path, index, data, return_info);
+	if (!success)
+		set_entry_flags(path, index, flags);
+
+	free(data);
+	return success;
 }
 
-void init(void)
+// Grava as flags (reserved[0]) da entrada do arquivo no diretório index.
+void set_entry_flags(path_t* path, unsigned index, unsigned char flags)
 {
-	FILE* ptr_file;
-	int i;
-	ptr_file = fopen(fat_name,"wb");
-	if (ptr_file == NULL)
+	if (index == 0x00)
 	{
-		fprintf(stderr, "Não foi possível abrir o arquivo %s.\n", fat_name);
-		exit(EXIT_FAILURE);
+		uint32_t candidates = name_candidates(root_dir, &path->components[path->size - 1]);
+		for (int i = 0; i < 32; i++)
+		{
+			if ((candidates >> i & 1) && entry_matches(&root_dir[i], &path->components[path->size - 1]))
+			{
+				root_dir[i].reserved[0] = flags;
+				return;
+			}
+		}
+		return;
 	}
-	for (i = 0; i < 2; ++i)
-		boot_block[i] = 0xbb;
 
-	fwrite(&boot_block, sizeof(boot_block), 1,ptr_file);
+	data_cluster cluster;
+	get_data_cluster(index, &cluster);
+	uint32_t candidates = name_candidates(cluster.dir, &path->components[path->size - 1]);
+	for (int i = 0; i < 32; i++)
+	{
+		if ((candidates >> i & 1) && entry_matches(&cluster.dir[i], &path->components[path->size - 1]))
+		{
+			cluster.dir[i].reserved[0] = flags;
+			save_data_cluster(index, &cluster);
+			return;
+		}
+	}
+}
 
-	fat[0] = 0xfffd;
-	for (i = 1; i < 9; ++i)
-		fat[i] = 0xfffe;
+// Entrada de continuação: guarda parte do conteúdo de um arquivo embutido e não aparece como entrada de diretório.
+bool is_inline_slot(dir_entry_t* entry)
+{
+	return entry->first_block != 0x00 && entry->attributes == INLINE_SLOT;
+}
 
-	fat[9] = 0xffff;
-	for (i = 10; i < NUM_CLUSTER; ++i)
-		fat[i] = 0x0000;
+unsigned inline_slots_needed(unsigned size)
+{
+	return (size + INLINE_SLOT_BYTES - 1) / INLINE_SLOT_BYTES;
+}
 
-	fwrite(&fat, sizeof(fat), 1, ptr_file);
-	fwrite(&root_dir, sizeof(root_dir), 1,ptr_file);
+// Copia o conteúdo do arquivo embutido dir[entry_index] para buffer (com espaço para size + 1 bytes), terminando-o com '\0'.
+void read_inline(dir_entry_t* dir, unsigned entry_index, char* buffer)
+{
+	unsigned size = dir[entry_index].size, copied = 0;
+	for (unsigned s = 0; s < INLINE_MAX_SLOTS && copied < size; s++)
+	{
+		unsigned slot = dir[entry_index].reserved[1 + s];
+		if (slot == 0 || slot > 32)
+			break;
 
-	for (i = 0; i < 4086; ++i)
-		fwrite(&clusters, sizeof(data_cluster), 1, ptr_file);
+		// O conteúdo ocupa o filename (18 bytes) e, depois dele, os 7 bytes de reserved.
+		unsigned length = size - copied >= INLINE_SLOT_BYTES ? INLINE_SLOT_BYTES : size - copied;
+		memcpy(buffer + copied, dir[slot - 1].filename, length < 18 ? length : 18);
+		if (length > 18)
+			memcpy(buffer + copied + 18, dir[slot - 1].reserved, length - 18);
+		copied += length;
+	}
 
-	fclose(ptr_file);
+	buffer[copied] = '\0';
 }
 
-void load()
+// Grava data nas entradas de continuação livres do diretório, trocando as que o arquivo já tinha, e marca a entrada como embutida.
+// O chamador atualiza o tamanho e grava o diretório. Caso não haja entradas livres suficientes, nada é alterado e retorna false.
+bool store_inline(dir_entry_t* dir, unsigned entry_index, char* data, unsigned size)
 {
-	FILE* ptr_file;
-	int i;
-	ptr_file = fopen(fat_name, "rb");
-	if (ptr_file == NULL)
+	unsigned needed = inline_slots_needed(size), available = 0;
+	for (int i = 0; i < 32; i++)
+		if (dir[i].first_block == 0x00)
+			available++;
+	for (unsigned s = 0; s < INLINE_MAX_SLOTS; s++)
+		if (dir[entry_index].reserved[1 + s] != 0)
+			available++;
+
+	if (size > INLINE_MAX_SIZE || needed > available)
+		return false;
+
+	release_inline_slots(dir, entry_index);
+
+	unsigned i = 0;
+	for (unsigned s = 0; s < needed; s++)
 	{
-		fprintf(stderr, "Não foi possível abrir o arquivo %s.\n", fat_name);
-		exit(EXIT_FAILURE);
+		while (dir[i].first_block != 0x00)
+			i++;
+
+		unsigned length = size - (s * INLINE_SLOT_BYTES) >= INLINE_SLOT_BYTES ? INLINE_SLOT_BYTES : size - (s * INLINE_SLOT_BYTES);
+		memset(&dir[i], 0x00, sizeof(dir_entry_t));
+		memcpy(dir[i].filename, data + (s * INLINE_SLOT_BYTES), length < 18 ? length : 18);
+		if (length > 18)
+			memcpy(dir[i].reserved, data + (s * INLINE_SLOT_BYTES) + 18, length - 18);
+		dir[i].attributes = INLINE_SLOT;
+		dir[i].first_block = 0xffff;
+		dir[entry_index].reserved[1 + s] = i + 1;
 	}
-	fseek(ptr_file, sizeof(boot_block), SEEK_SET); // Chega até a FAT.
-	fread(fat, sizeof(fat), 1, ptr_file); // Lê a FAT.
-	fread(root_dir, sizeof(root_dir), 1, ptr_file); // Lê o root_dir.
-	fclose(ptr_file);
+
+	dir[entry_index].reserved[0] |= ENTRY_INLINE;
+	dir[entry_index].first_block = 0xffff;
+	return true;
 }
 
-void save()
+// Libera as entradas de continuação de dir[entry_index] (o próprio diretório é gravado pelo chamador).
+void release_inline_slots(dir_entry_t* dir, unsigned entry_index)
 {
-	FILE* ptr_file;
-	ptr_file = fopen(fat_name, "r+b");
-	fseek(ptr_file, sizeof(boot_block), SEEK_SET); // Chega até a FAT.
-	fwrite(fat, sizeof(unsigned short), NUM_CLUSTER, ptr_file); // Escreve a FAT.
-	fwrite(root_dir, sizeof(dir_entry_t), 32, ptr_file); // Escreve o root_dir.
-	fclose(ptr_file);
+	for (unsigned s = 0; s < INLINE_MAX_SLOTS; s++)
+	{
+		unsigned slot = dir[entry_index].reserved[1 + s];
+		if (slot != 0 && slot <= 32 && is_inline_slot(&dir[slot - 1]))
+			memset(&dir[slot - 1], 0x00, sizeof(dir_entry_t));
+		dir[entry_index].reserved[1 + s] = 0x00;
+	}
 }
 
-data_cluster get_data_cluster(unsigned index)
+// Cria um diretório ordenado vazio: a raiz do índice, com uma única folha vazia. Retorna a raiz, ou 0x00 caso não haja dois clusters livres.
+unsigned create_sorted_directory()
 {
-	FILE* ptr_file;
-	data_cluster cluster;
-	memset(&cluster, 0x00, CLUSTER_SIZE);
-	ptr_file = fopen(fat_name, "rb");
-	if (ptr_file == NULL)
+	if (free_clusters < 2)
+		return 0x00;
+
+	unsigned leaf = allocate_empty_cluster();
+	unsigned root = allocate_cluster();
+
+	data_cluster node;
+	memset(node.data, 0x00, CLUSTER_SIZE);
+	node.node.level = 1;
+	node.node.count = 1;
+	node.node.keys[0].block = leaf;
+	save_data_cluster(root, &node);
+	return root;
+}
+
+// Posição do filho do nó que cobre name: o último cuja chave não passa de name (o primeiro cobre tudo abaixo da segunda chave).
+unsigned sorted_child(sorted_node_t* node, char* name)
+{
+	unsigned low = 1, high = node->count;
+	while (low < high)
 	{
-		fprintf(stderr, "Não foi possível abrir o arquivo %s.\n", fat_name);
-		exit(EXIT_FAILURE);
+		unsigned middle = (low + high) / 2;
+		if (strncmp((char*) node->keys[middle].name, name, sizeof(node->keys[middle].name)) <= 0)
+			low = middle + 1;
+		else
+			high = middle;
 	}
-	fseek(ptr_file, 10 * sizeof(data_cluster), SEEK_SET); // Chega aos clusteres de dados.
-	fseek(ptr_file, index * sizeof(data_cluster), SEEK_CUR); // Vai ao índice desejado.
-	fread(&cluster, sizeof(data_cluster), 1, ptr_file); // Lê o cluster e coloca no union.
-	fclose(ptr_file);
-	return cluster;
+
+	return low - 1;
 }
 
-void save_data_cluster(unsigned index, data_cluster cluster)
+// Desce da raiz do índice até a folha que cobre name, guardando em trail os nós visitados (trail[0] é a raiz), em positions o filho
+// seguido em cada um e em depth quantos são. Com unshare, os nós e a folha do caminho que ainda pertencem a snapshots são trocados
+// por cópias (a raiz é copiada junto com o diretório, por unshare_directories). Retorna a folha, ou 0x00 caso não haja espaço.
+unsigned sorted_descend(unsigned root, char* name, bool unshare, unsigned* trail, unsigned* positions, unsigned* depth)
 {
-	FILE* ptr_file;
-	ptr_file = fopen(fat_name, "r+b");
-	if (ptr_file == NULL)
+	unsigned block = root;
+	*depth = 0;
+	while (true)
 	{
-		fprintf(stderr, "Não foi possível abrir o arquivo %s.\n", fat_name);
-		exit(EXIT_FAILURE);
+		data_cluster node;
+		get_data_cluster(block, &node);
+		unsigned position = sorted_child(&node.node, name);
+		unsigned child = node.node.keys[position].block;
+
+		trail[*depth] = block;
+		positions[*depth] = position;
+		(*depth)++;
+
+		if (unshare && is_shared_cluster(child))
+		{
+			if (free_clusters == 0)
+				return 0x00;
+
+			unsigned copy = allocate_cluster();
+			copy_data_cluster(child, copy);
+			release_cluster(child);
+			node.node.keys[position].block = copy;
+			save_data_cluster(block, &node);
+			child = copy;
+		}
+
+		if (node.node.level <= 1 || *depth == SORTED_MAX_DEPTH)
+			return child;
+
+		block = child;
 	}
-	fseek(ptr_file, 10 * sizeof(data_cluster), SEEK_SET); // Chega aos clusteres de dados
-	fseek(ptr_file, index * sizeof(data_cluster), SEEK_CUR); // Vai ao índice desejado
-	fwrite(&cluster, sizeof(data_cluster), 1, ptr_file); // Lê o union e escreve no cluster
-	fclose(ptr_file);
 }
 
-bool check_file_existence()
+// Folha do diretório ordenado que cobre name: onde a entrada está, ou onde ficaria.
+unsigned sorted_leaf(unsigned root, char* name)
 {
-	if (access(fat_name, F_OK) != -1)
-		return true;
+	unsigned trail[SORTED_MAX_DEPTH], positions[SORTED_MAX_DEPTH], depth = 0;
+	return sorted_descend(root, name, false, trail, positions, &depth);
+}
+
+// Prepara, no diretório ordenado, a folha que cobre name para receber uma entrada nova (com as de continuação), dividindo-a antes
+// caso esteja quase cheia. O caminho até ela deixa de ser compartilhado com snapshots. Retorna a folha em leaf.
+bool sorted_make_room(unsigned root, char* name, unsigned* leaf, unsigned* return_info)
+{
+	// Uma divisão deixa as duas folhas com mais de SORTED_LEAF_ROOM entradas livres; as demais voltas só cobrem uma imagem corrompida.
+	for (unsigned attempt = 0; attempt < 4; attempt++)
+	{
+		unsigned trail[SORTED_MAX_DEPTH], positions[SORTED_MAX_DEPTH], depth = 0;
+		*leaf = sorted_descend(root, name, true, trail, positions, &depth);
+		if (*leaf == 0x00)
+		{
+			*return_info = BLOATED_SYSTEM;
+			return false;
+		}
+
+		data_cluster cluster;
+		get_data_cluster(*leaf, &cluster);
+		unsigned free_entries = 0;
+		for (int i = 0; i < 32; i++)
+			if (cluster.dir[i].first_block == 0x00)
+				free_entries++;
+
+		if (free_entries >= SORTED_LEAF_ROOM)
+			return true;
+
+		// A divisão usa a folha nova, um nó por nível que também precise dividir e mais um para a raiz.
+		if (free_clusters < depth + 2)
+		{
+			*return_info = BLOATED_SYSTEM;
+			return false;
+		}
+
+		sorted_split_leaf(trail, positions, depth, name);
+	}
+
+	*return_info = FULL_DIR;
+	return false;
+}
+
+// Divide a folha em que a descida (trail, positions, depth) terminou: as entradas a partir da mediana dos nomes, com o conteúdo
+// embutido, vão para uma folha nova, acrescentada ao índice logo depois dela. Quando name vem depois de todos os nomes da folha
+// (nomes criados em ordem crescente), nada é movido: a folha nova começa vazia, em name, e a antiga fica cheia.
+void sorted_split_leaf(unsigned* trail, unsigned* positions, unsigned depth, char* name)
+{
+	data_cluster parent;
+	get_data_cluster(trail[depth - 1], &parent);
+	unsigned leaf = parent.node.keys[positions[depth - 1]].block;
+
+	data_cluster old_leaf, new_leaf;
+	get_data_cluster(leaf, &old_leaf);
+	memset(new_leaf.data, 0x00, CLUSTER_SIZE);
+
+	unsigned char order[32], separator[18];
+	unsigned count = entries_by_name(old_leaf.dir, order), split = count / 2;
+	memset(separator, 0x00, sizeof(separator));
+	if (count == 0 || strncmp((char*) old_leaf.dir[order[count - 1]].filename, name, sizeof(separator)) < 0)
+	{
+		split = count;
+		strncpy((char*) separator, name, sizeof(separator) - 1);
+	}
 	else
-		return false;
+		memcpy(separator, old_leaf.dir[order[split]].filename, sizeof(separator));
+
+	for (unsigned k = split; k < count; k++)
+	{
+		dir_entry_t* entry = &old_leaf.dir[order[k]];
+		unsigned slot = 0;
+		while (new_leaf.dir[slot].first_block != 0x00)
+			slot++;
+
+		new_leaf.dir[slot] = *entry;
+		if (entry->attributes != 0x1 && (entry->reserved[0] & ENTRY_INLINE))
+		{
+			char inline_data[INLINE_MAX_SIZE + 1];
+			read_inline(old_leaf.dir, order[k], inline_data);
+			memset(&new_leaf.dir[slot].reserved[1], 0x00, INLINE_MAX_SLOTS);
+			store_inline(new_leaf.dir, slot, inline_data, entry->size);
+			release_inline_slots(old_leaf.dir, order[k]);
+		}
+
+		memset(entry, 0x00, sizeof(dir_entry_t));
+	}
+
+	// A folha nova é gravada antes de entrar no índice, e a antiga só perde as entradas depois disso.
+	unsigned block = allocate_cluster();
+	save_data_cluster(block, &new_leaf);
+	sorted_insert_child(trail, positions, depth - 1, separator, block);
+	save_data_cluster(leaf, &old_leaf);
+}
+
+// Acrescenta ao nó trail[depth], logo depois do filho positions[depth], o filho block, que cobre os nomes a partir de key. Um nó
+// cheio é dividido e a metade de cima entra no nó acima; a raiz, que é o first_block do diretório e não muda de cluster, passa as
+// duas metades para nós novos e sobe um nível.
+void sorted_insert_child(unsigned* trail, unsigned* positions, unsigned depth, unsigned char* key, unsigned block)
+{
+	data_cluster node;
+	get_data_cluster(trail[depth], &node);
+
+	sorted_key_t keys[SORTED_FANOUT + 1];
+	unsigned position = positions[depth] + 1, count = node.node.count;
+	memcpy(keys, node.node.keys, position * sizeof(sorted_key_t));
+	memcpy(keys[position].name, key, sizeof(keys[position].name));
+	keys[position].block = block;
+	memcpy(&keys[position + 1], &node.node.keys[position], (count - position) * sizeof(sorted_key_t));
+	count++;
+
+	if (count <= SORTED_FANOUT)
+	{
+		memcpy(node.node.keys, keys, count * sizeof(sorted_key_t));
+		node.node.count = count;
+		save_data_cluster(trail[depth], &node);
+		return;
+	}
+
+	// Quando o filho novo é o último (nomes em ordem crescente), a metade de baixo fica cheia.
+	unsigned split = position == count - 1 ? count - 1 : count / 2;
+	data_cluster lower, upper;
+	memset(lower.data, 0x00, CLUSTER_SIZE);
+	memset(upper.data, 0x00, CLUSTER_SIZE);
+	lower.node.level = upper.node.level = node.node.level;
+	lower.node.count = split;
+	upper.node.count = count - split;
+	memcpy(lower.node.keys, keys, split * sizeof(sorted_key_t));
+	memcpy(upper.node.keys, &keys[split], (count - split) * sizeof(sorted_key_t));
+
+	unsigned char separator[18];
+	memcpy(separator, upper.node.keys[0].name, sizeof(separator));
+	memset(upper.node.keys[0].name, 0x00, sizeof(upper.node.keys[0].name));
+
+	unsigned upper_block = allocate_cluster();
+	save_data_cluster(upper_block, &upper);
+
+	if (depth > 0)
+	{
+		sorted_insert_child(trail, positions, depth - 1, separator, upper_block);
+		save_data_cluster(trail[depth], &lower);
+		return;
+	}
+
+	unsigned lower_block = allocate_cluster();
+	save_data_cluster(lower_block, &lower);
+
+	memset(node.data, 0x00, CLUSTER_SIZE);
+	node.node.level = lower.node.level + 1;
+	node.node.count = 2;
+	node.node.keys[0].block = lower_block;
+	memcpy(node.node.keys[1].name, separator, sizeof(separator));
+	node.node.keys[1].block = upper_block;
+	save_data_cluster(trail[0], &node);
+}
+
+// Retira do índice a folha que cobre name, caso ela tenha ficado vazia, e a libera junto com os nós que ficariam sem filhos. Os
+// nomes que ela cobria passam ao filho anterior (ou ao seguinte, quando ela era o primeiro). A última folha do diretório fica.
+void sorted_drop_leaf(unsigned root, char* name)
+{
+	unsigned trail[SORTED_MAX_DEPTH], positions[SORTED_MAX_DEPTH], depth = 0;
+	unsigned leaf = sorted_descend(root, name, true, trail, positions, &depth);
+	if (leaf == 0x00)
+		return;
+
+	data_cluster cluster;
+	get_data_cluster(leaf, &cluster);
+	for (int i = 0; i < 32; i++)
+		if (cluster.dir[i].first_block != 0x00)
+			return;
+
+	// Sobe enquanto o nó tem só o filho que sai.
+	unsigned level = depth - 1;
+	data_cluster node;
+	get_data_cluster(trail[level], &node);
+	while (node.node.count == 1 && level > 0)
+		get_data_cluster(trail[--level], &node);
+
+	if (node.node.count <= 1)
+		return;
+
+	// O índice deixa de apontar para a folha (e para os nós abaixo de trail[level]) antes que eles sejam liberados.
+	unsigned position = positions[level];
+	memmove(&node.node.keys[position], &node.node.keys[position + 1], (node.node.count - position - 1) * sizeof(sorted_key_t));
+	node.node.count--;
+	memset(&node.node.keys[node.node.count], 0x00, sizeof(sorted_key_t));
+	memset(node.node.keys[0].name, 0x00, sizeof(node.node.keys[0].name));
+	save_data_cluster(trail[level], &node);
+
+	for (unsigned k = level + 1; k < depth; k++)
+		release_cluster(trail[k]);
+	release_cluster(leaf);
 }
 
-void free_structure(char*** pieces, unsigned pieces_size)
+// Percorre o índice a partir do nó block, acrescentando a leaves, em ordem de nome, as folhas que podem ter nomes começando com
+// prefix ("" para todas). nodes, caso não seja NULL, recebe os nós do próprio índice. Os vetores têm espaço para NUM_CLUSTER clusters.
+void sorted_collect(unsigned block, char* prefix, unsigned* leaves, unsigned* num_leaves, unsigned* nodes, unsigned* num_nodes)
 {
-	for (int i = 0; i < pieces_size; i++)
-		free((*pieces)[i]);
+	data_cluster node;
+	get_data_cluster(block, &node);
+	if (nodes != NULL && *num_nodes < NUM_CLUSTER)
+		nodes[(*num_nodes)++] = block;
+
+	unsigned length = strlen(prefix);
+	for (unsigned i = 0; i < node.node.count && i < SORTED_FANOUT && *num_leaves < NUM_CLUSTER; i++)
+	{
+		// O filho cobre de keys[i] até antes de keys[i + 1]: fica de fora se esse intervalo está todo abaixo ou todo acima do prefixo.
+		char* lower = (char*) node.node.keys[i].name;
+		if (i + 1 < node.node.count && strncmp((char*) node.node.keys[i + 1].name, prefix, 18) <= 0)
+			continue;
+		if (i > 0 && strncmp(lower, prefix, 18) > 0 && strncmp(lower, prefix, length) != 0)
+			break;
+
+		if (node.node.level <= 1)
+			leaves[(*num_leaves)++] = node.node.keys[i].block;
+		else
+			sorted_collect(node.node.keys[i].block, prefix, leaves, num_leaves, nodes, num_nodes);
+	}
+}
+
+// Guarda em order os índices das entradas do diretório (sem as de continuação), em ordem de nome. Retorna quantas são.
+unsigned entries_by_name(dir_entry_t* dir, unsigned char* order)
+{
+	unsigned count = 0;
+	for (unsigned i = 0; i < 32; i++)
+	{
+		if (dir[i].first_block == 0x00 || is_inline_slot(&dir[i]))
+			continue;
+
+		// Inserção ordenada: são no máximo 32 entradas.
+		unsigned k = count++;
+		while (k > 0 && strncmp((char*) dir[order[k - 1]].filename, (char*) dir[i].filename, sizeof(dir[i].filename)) > 0)
+		{
+			order[k] = order[k - 1];
+			k--;
+		}
+		order[k] = i;
+	}
+
+	return count;
+}
+
+// Copia para um vetor alocado em entries as entradas do diretório index cujo nome começa com prefix ("" para todas). Em um diretório
+// ordenado, só as folhas que podem ter o prefixo são lidas, em lotes, e as entradas saem em ordem de nome. Retorna quantas são.
+unsigned list_entries(unsigned index, bool sorted, char* prefix, dir_entry_t** entries)
+{
+	unsigned length = strlen(prefix), num_entries = 0;
+	if (!sorted)
+	{
+		data_cluster cluster;
+		dir_entry_t* dir = root_dir;
+		if (index != 0x00)
+		{
+			get_data_cluster(index, &cluster);
+			dir = cluster.dir;
+		}
+
+		*entries = (dir_entry_t*) malloc(32 * sizeof(dir_entry_t));
+		for (int i = 0; i < 32; i++)
+			if (dir[i].first_block != 0x00 && dir[i].attributes != INLINE_SLOT && strncmp((char*) dir[i].filename, prefix, length) == 0)
+				(*entries)[num_entries++] = dir[i];
+		return num_entries;
+	}
+
+	unsigned* leaves = (unsigned*) malloc(NUM_CLUSTER * sizeof(unsigned));
+	unsigned num_leaves = 0;
+	sorted_collect(index, prefix, leaves, &num_leaves, NULL, NULL);
+
+	*entries = (dir_entry_t*) malloc((num_leaves * 32 + 1) * sizeof(dir_entry_t));
+	data_cluster* clusters = (data_cluster*) malloc(LIST_BATCH * sizeof(data_cluster));
+	for (unsigned first = 0; first < num_leaves; first += LIST_BATCH)
+	{
+		unsigned batch = num_leaves - first < LIST_BATCH ? num_leaves - first : LIST_BATCH;
+		read_cluster_batch(&leaves[first], batch, clusters);
+		for (unsigned l = 0; l < batch; l++)
+		{
+			unsigned char order[32];
+			unsigned count = entries_by_name(clusters[l].dir, order);
+			for (unsigned k = 0; k < count; k++)
+				if (strncmp((char*) clusters[l].dir[order[k]].filename, prefix, length) == 0)
+					(*entries)[num_entries++] = clusters[l].dir[order[k]];
+		}
+	}
+
+	free(clusters);
+	free(leaves);
+	return num_entries;
+}
+
+// Passo da navegação para dentro do diretório entry: block recebe o cluster onde procurar o nome seguinte do caminho
+// (components[next]). Em um diretório ordenado, é a folha que cobre o nome, já com espaço para criá-lo caso room seja true; sem
+// nome seguinte, o diretório é representado pela raiz do índice e type passa a SORTED_DIR.
+bool enter_directory(dir_entry_t* entry, path_t* path, unsigned next, bool room, unsigned* block, unsigned* type, unsigned* return_info)
+{
+	*block = entry->first_block;
+	if (!(entry->reserved[0] & ENTRY_SORTED))
+		return true;
+
+	if (next == path->size)
+	{
+		*type = SORTED_DIR;
+		return true;
+	}
+
+	if (room)
+		return sorted_make_room(entry->first_block, path->components[next].name, block, return_info);
+
+	*block = sorted_leaf(entry->first_block, path->components[next].name);
+	return true;
+}
+
+// Diretório sem nenhuma entrada; em um diretório ordenado, todas as folhas precisam estar vazias.
+bool is_empty_directory(dir_entry_t* entry)
+{
+	unsigned block = entry->first_block, num_leaves = 1;
+	unsigned* leaves = &block;
+	if (entry->reserved[0] & ENTRY_SORTED)
+	{
+		leaves = (unsigned*) malloc(NUM_CLUSTER * sizeof(unsigned));
+		num_leaves = 0;
+		sorted_collect(entry->first_block, "", leaves, &num_leaves, NULL, NULL);
+	}
+
+	bool empty = true;
+	for (unsigned l = 0; l < num_leaves && empty; l++)
+	{
+		data_cluster child;
+		get_data_cluster(leaves[l], &child);
+		for (int k = 0; k < 32 && empty; k++)
+			empty = child.dir[k].first_block == 0x00;
+	}
+
+	if (leaves != &block)
+		free(leaves);
+	return empty;
+}
+
+// Depois que a última parte do caminho (de tamanho depth) sai do seu diretório (unlink, rm, mv), libera a folha onde ela estava,
+// caso o diretório seja ordenado e a folha tenha ficado vazia.
+void release_empty_leaf(path_t* path, unsigned depth)
+{
+	if (depth < 2)
+		return;
+
+	unsigned index = 0, type = 0, return_info = 0;
+	dir_entry_t entry;
+	if (directory_navigator(path, depth - 2, &index, &return_info, &type, NAV_READ) && find_entry(index, &path->components[depth - 2], &entry) && (entry.reserved[0] & ENTRY_SORTED))
+		sorted_drop_leaf(entry.first_block, path->components[depth - 1].name);
+}
+
+// Libera os clusters de um diretório vazio: o seu cluster ou, em um diretório ordenado, as folhas e os nós do índice.
+void release_directory(dir_entry_t* entry)
+{
+	if (!(entry->reserved[0] & ENTRY_SORTED))
+	{
+		release_cluster(entry->first_block);
+		return;
+	}
+
+	unsigned* leaves = (unsigned*) malloc(NUM_CLUSTER * sizeof(unsigned));
+	unsigned* nodes = (unsigned*) malloc(NUM_CLUSTER * sizeof(unsigned));
+	unsigned num_leaves = 0, num_nodes = 0;
+	sorted_collect(entry->first_block, "", leaves, &num_leaves, nodes, &num_nodes);
+	for (unsigned l = 0; l < num_leaves; l++)
+		release_cluster(leaves[l]);
+	for (unsigned k = 0; k < num_nodes; k++)
+		release_cluster(nodes[k]);
+
+	free(leaves);
+	free(nodes);
+}
+
+bool import_tree(char* host_dir, path_t* path, unsigned* return_info)
+{
+	tree_plan_t plan = { NULL, 0 };
+
+	// Percorre a árvore do host montando o plano com todas as entradas a serem importadas.
+	if (!plan_import(host_dir, -1, &plan, return_info))
+	{
+		free_tree_plan(&plan);
+		return false;
+	}
+
+	// Procura o destino sem alterar nada: a parte do caminho que ainda não existe só é criada depois que o plano inteiro couber.
+	unsigned index = 0, type = 0, existing = path->size;
+	while (!directory_navigator(path, existing, &index, return_info, &type, NAV_READ))
+	{
+		if (*return_info != NOT_FOUND_DIR)
+		{
+			free_tree_plan(&plan);
+			return false;
+		}
+		existing--;
+	}
+
+	if (type == FILE_DIR)
+	{
+		*return_info = NOT_A_DIR;
+		free_tree_plan(&plan);
+		return false;
+	}
+
+	// Cada diretório que falta ocupa um cluster. Em um diretório ordenado, cada entrada nova pode ainda copiar o caminho do índice
+	// (snapshots) e dividir a folha e os nós dele: esses clusters precisam continuar livres.
+	unsigned missing = path->size - existing, spare = missing;
+	bool sorted = type == SORTED_DIR;
+	data_cluster dest_cluster;
+	if (sorted)
+	{
+		get_data_cluster(index, &dest_cluster);
+		spare += 2 * dest_cluster.node.level + 3;
+	}
+
+	if (missing > 0 && !sorted)
+	{
+		// O primeiro diretório que falta precisa de uma entrada livre no último que existe.
+		dir_entry_t* parent_dir = root_dir;
+		if (index != 0x00)
+		{
+			get_data_cluster(index, &dest_cluster);
+			parent_dir = dest_cluster.dir;
+		}
+
+		unsigned free_entries = 0;
+		for (int i = 0; i < 32; i++)
+			if (parent_dir[i].first_block == 0x00)
+				free_entries++;
+
+		if (free_entries == 0)
+		{
+			*return_info = FULL_DIR;
+			free_tree_plan(&plan);
+			return false;
+		}
+	}
+
+	// Carrega o diretório de destino (root_dir ou cluster de dados). Em um diretório ordenado, cada nome é procurado na folha que o
+	// cobre. Um destino que ainda não existe será um diretório vazio.
+	dir_entry_t* dest_dir = root_dir;
+	if (missing > 0)
+	{
+		memset(dest_cluster.dir, 0x00, CLUSTER_SIZE);
+		dest_dir = dest_cluster.dir;
+		sorted = false;
+	}
+	else if (index != 0x00 && !sorted)
+	{
+		get_data_cluster(index, &dest_cluster);
+		dest_dir = dest_cluster.dir;
+	}
+
+	// Confere se há entradas livres suficientes no destino e se nenhum nome já existe nele.
+	unsigned free_entries = 0, top_level = 0;
+	for (int i = 0; i < 32 && !sorted; i++)
+		if (dest_dir[i].first_block == 0x00)
+			free_entries++;
+
+	for (unsigned n = 0; n < plan.size; n++)
+	{
+		if (plan.nodes[n].parent != -1)
+			continue;
+
+		top_level++;
+		dir_entry_t* dir = dest_dir;
+		data_cluster leaf;
+		if (sorted)
+		{
+			get_data_cluster(sorted_leaf(index, plan.nodes[n].name), &leaf);
+			dir = leaf.dir;
+		}
+
+		for (int i = 0; i < 32; i++)
+		{
+			if (dir[i].first_block != 0x00 && dir[i].attributes != INLINE_SLOT && strcmp(dir[i].filename, plan.nodes[n].name) == 0)
+			{
+				*return_info = ALREADY_EXISTS;
+				free_tree_plan(&plan);
+				return false;
+			}
+		}
+	}
+
+	if (top_level > free_entries && !sorted)
+	{
+		*return_info = FULL_DIR;
+		free_tree_plan(&plan);
+		return false;
+	}
+
+	// Reserva de uma só vez, em ordem crescente de disco, todos os clusters livres necessários para o plano.
+	unsigned needed = 0, found = 0;
+	for (unsigned n = 0; n < plan.size; n++)
+		needed += plan.nodes[n].num_clusters;
+
+	if (sorted)
+		spare *= top_level;
+
+	unsigned* blocks = (unsigned*) malloc((needed + 1) * sizeof(unsigned));
+	for (int i = 10; i < NUM_CLUSTER && found < needed; i++)
+		if (is_free_cluster(i))
+			blocks[found++] = i;
+
+	// Sistema de arquivos cheio, nada foi alterado.
+	if (found < needed || free_clusters < needed + spare)
+	{
+		*return_info = BLOATED_SYSTEM;
+		free(blocks);
+		free_tree_plan(&plan);
+		return false;
+	}
+
+	// Cada nó recebe uma faixa consecutiva dos clusters reservados (contígua no disco sempre que o espaço livre for contíguo).
+	unsigned** chains = (unsigned**) malloc((plan.size + 1) * sizeof(unsigned*));
+	unsigned cursor = 0;
+	for (unsigned n = 0; n < plan.size; n++)
+	{
+		chains[n] = &blocks[cursor];
+		plan.nodes[n].first_block = blocks[cursor];
+		cursor += plan.nodes[n].num_clusters;
+	}
+
+	// Monta em memória os clusters dos diretórios novos com as entradas de seus filhos.
+	unsigned* used_entries = (unsigned*) calloc(plan.size + 1, sizeof(unsigned));
+	for (unsigned n = 0; n < plan.size; n++)
+	{
+		tree_node_t* node = &plan.nodes[n];
+		if (node->is_dir)
+			node->buffer = (uint8_t*) device_alloc(CLUSTER_SIZE);
+
+		if (node->parent == -1)
+			continue;
+
+		dir_entry_t* entry = &((data_cluster*) plan.nodes[node->parent].buffer)->dir[used_entries[node->parent]++];
+		strcpy(entry->filename, node->name);
+		set_name_hash(entry);
+		entry->attributes = node->is_dir ? 0x1 : 0x0;
+		entry->first_block = node->first_block;
+		entry->size = node->size;
+	}
+	free(used_entries);
+
+	// As escritas vão direto ao disco: uma gravação do flusher em andamento não pode chegar depois delas.
+	sync_volume(false);
+
+	// Leitores paralelos carregam os arquivos do host enquanto um único escritor grava os clusters em ordem de disco.
+	worker_pool_t pool;
+	worker_pool_start(&pool, plan.size, import_read_job, &plan);
+
+	// As escritas de cada nó são enviadas sem espera: enquanto o lote de um nó está na fila do dispositivo, o escritor já espera o
+	// próximo arquivo do host. Há no máximo dois lotes em andamento, e o buffer de um nó só é liberado quando o seu lote termina.
+	device_batch_t batches[2];
+	int batch_node[2] = { -1, -1 };
+	unsigned current_batch = 0;
+	bool read_failed = false;
+	for (unsigned n = 0; n < plan.size && !read_failed; n++)
+	{
+		tree_node_t* node = &plan.nodes[n];
+		if (!node->is_dir)
+		{
+			worker_pool_wait_job(&pool, n);
+			if (node->failed)
+			{
+				read_failed = true;
+				break;
+			}
+		}
+
+		cluster_io_t* writes = (cluster_io_t*) malloc((node->num_clusters + 1) * sizeof(cluster_io_t));
+		for (unsigned k = 0; k < node->num_clusters; k++)
+		{
+			writes[k].block = chains[n][k];
+			writes[k].buffer = node->buffer + (k * CLUSTER_SIZE);
+			cache_invalidate(chains[n][k]);
+		}
+
+		device_submit(&batches[current_batch], writes, node->num_clusters, true);
+		batch_node[current_batch] = n;
+		free(writes);
+
+		// Espera o lote anterior enquanto o atual segue em andamento.
+		current_batch = 1 - current_batch;
+		if (batch_node[current_batch] != -1)
+		{
+			device_wait(&batches[current_batch]);
+			free(plan.nodes[batch_node[current_batch]].buffer);
+			plan.nodes[batch_node[current_batch]].buffer = NULL;
+			batch_node[current_batch] = -1;
+		}
+	}
+
+	for (unsigned b = 0; b < 2; b++)
+	{
+		if (batch_node[b] != -1)
+		{
+			device_wait(&batches[b]);
+			free(plan.nodes[batch_node[b]].buffer);
+			plan.nodes[batch_node[b]].buffer = NULL;
+		}
+	}
+
+	worker_pool_join(&pool);
+
+	// Falha na leitura de algum arquivo do host: a FAT e o destino não foram tocados, logo os clusters escritos continuam livres.
+	if (read_failed)
+	{
+		*return_info = HOST_ERROR;
+		free(chains);
+		free(blocks);
+		free_tree_plan(&plan);
+		return false;
+	}
+
+	// Com os dados já no disco, efetiva as cadeias na FAT.
+	free_clusters -= needed;
+	for (unsigned n = 0; n < plan.size; n++)
+	{
+		tree_node_t* node = &plan.nodes[n];
+		used_bytes += node->size;
+		for (unsigned k = 0; k + 1 < node->num_clusters; k++)
+			fat_set(chains[n][k], chains[n][k + 1]);
+		fat_set(chains[n][node->num_clusters - 1], 0xffff);
+		for (unsigned k = 0; k < node->num_clusters; k++)
+			dedup_forget(chains[n][k]);
+	}
+
+	// Só agora, com as cadeias na FAT (os clusters reservados deixaram de estar livres), cria a parte do caminho que faltava.
+	if (missing > 0)
+	{
+		if (!directory_navigator(path, path->size, &index, return_info, &type, NAV_CREATE))
+		{
+			// Não deve ocorrer (o espaço e a entrada livre foram conferidos); desfaz as cadeias para não deixar clusters perdidos.
+			release_import_chains(&plan, chains, 0);
+			free(chains);
+			free(blocks);
+			free_tree_plan(&plan);
+			return false;
+		}
+
+		get_data_cluster(index, &dest_cluster);
+	}
+
+	// E, depois de todas as cadeias (uma divisão de folha aloca clusters), as entradas no diretório de destino.
+	bool success = true;
+	for (unsigned n = 0; n < plan.size && success; n++)
+	{
+		tree_node_t* node = &plan.nodes[n];
+		if (node->parent != -1)
+			continue;
+
+		unsigned leaf = 0x00;
+		dir_entry_t* dir = dest_dir;
+		data_cluster leaf_cluster;
+		if (sorted)
+		{
+			// Sem espaço para dividir a folha (a reserva é uma estimativa): as entradas que ainda não foram ligadas ao destino são
+			// desfeitas, e as já ligadas continuam importadas.
+			if (!sorted_make_room(index, node->name, &leaf, return_info))
+			{
+				release_import_chains(&plan, chains, n);
+				success = false;
+				break;
+			}
+
+			get_data_cluster(leaf, &leaf_cluster);
+			dir = leaf_cluster.dir;
+		}
+
+		for (int i = 0; i < 32; i++)
+		{
+			if (dir[i].first_block == 0x00)
+			{
+				strcpy(dir[i].filename, node->name);
+				set_name_hash(&dir[i]);
+				dir[i].attributes = node->is_dir ? 0x1 : 0x0;
+				dir[i].first_block = node->first_block;
+				dir[i].size = node->size;
+				break;
+			}
+		}
+
+		if (sorted)
+			save_data_cluster(leaf, &leaf_cluster);
+	}
+
+	if (index != 0x00 && !sorted)
+		save_data_cluster(index, &dest_cluster);
+
+	free(chains);
+	free(blocks);
+	free_tree_plan(&plan);
+	return success;
+}
+
+// Desfaz as cadeias já efetivadas na FAT dos nós do plano cuja entrada de primeiro nível (o próprio nó ou um ancestral dele) é
+// from ou uma posterior, ainda não ligadas ao destino.
+void release_import_chains(tree_plan_t* plan, unsigned** chains, unsigned from)
+{
+	for (unsigned n = 0; n < plan->size; n++)
+	{
+		unsigned top = n;
+		while (plan->nodes[top].parent != -1)
+			top = plan->nodes[top].parent;
+
+		if (top < from)
+			continue;
+
+		used_bytes -= plan->nodes[n].size;
+		for (unsigned k = 0; k < plan->nodes[n].num_clusters; k++)
+			release_cluster(chains[n][k]);
+	}
+}
+
+bool plan_import(char* host_path, int parent, tree_plan_t* plan, unsigned* return_info)
+{
+	// Lista o diretório do host em ordem alfabética, para que o plano seja determinístico.
+	struct dirent** host_entries = NULL;
+	int num_host_entries = scandir(host_path, &host_entries, NULL, alphasort);
+	if (num_host_entries < 0)
+	{
+		*return_info = HOST_ERROR;
+		return false;
+	}
+
+	bool success = true;
+	unsigned children = 0;
+	for (int i = 0; i < num_host_entries; i++)
+	{
+		char* name = host_entries[i]->d_name;
+		if (!success || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+		{
+			free(host_entries[i]);
+			continue;
+		}
+
+		char* child_path = (char*) malloc((strlen(host_path) + strlen(name) + 2) * sizeof(char));
+		sprintf(child_path, "%s/%s", host_path, name);
+
+		// lstat não segue links simbólicos: um link para um diretório acima dele faria o plano descer sem fim.
+		struct stat host_stat;
+		if (lstat(child_path, &host_stat) != 0)
+		{
+			*return_info = HOST_ERROR;
+			success = false;
+			free(child_path);
+		}
+		// Somente arquivos regulares e diretórios são importados (links simbólicos são ignorados).
+		else if (!S_ISDIR(host_stat.st_mode) && !S_ISREG(host_stat.st_mode))
+			free(child_path);
+		else if (strlen(name) > 17)
+		{
+			*return_info = NAME_TOO_LONG;
+			success = false;
+			free(child_path);
+		}
+		// As entradas do primeiro nível são conferidas pelo destino, que pode ser um diretório ordenado (sem limite de 32).
+		else if ((++children > 32 && parent != -1) || host_stat.st_size > (off_t) NUM_CLUSTER * CLUSTER_SIZE)
+		{
+			*return_info = children > 32 && parent != -1 ? FULL_DIR : BLOATED_SYSTEM;
+			success = false;
+			free(child_path);
+		}
+		else
+		{
+			// Acrescenta o nó ao plano (pais sempre antes dos filhos).
+			plan->nodes = (tree_node_t*) realloc(plan->nodes, (plan->size + 1) * sizeof(tree_node_t));
+			tree_node_t* node = &plan->nodes[plan->size];
+			memset(node, 0x00, sizeof(tree_node_t));
+			node->host_path = child_path;
+			strcpy(node->name, name);
+			node->is_dir = S_ISDIR(host_stat.st_mode);
+			node->parent = parent;
+			node->size = node->is_dir ? 0 : host_stat.st_size;
+			node->num_clusters = node->size == 0 ? 1 : (node->size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+
+			unsigned node_index = plan->size++;
+			if (node->is_dir)
+				success = plan_import(child_path, node_index, plan, return_info);
+		}
+
+		free(host_entries[i]);
+	}
+
+	free(host_entries);
+	return success;
+}
+
+void import_read_job(unsigned job, void* context)
+{
+	tree_node_t* node = &((tree_plan_t*) context)->nodes[job];
+	if (node->is_dir)
+		return;
+
+	// Lê o arquivo do host inteiro para um buffer já preenchido com zeros até o fim do último cluster.
+	node->buffer = (uint8_t*) device_alloc(node->num_clusters * CLUSTER_SIZE);
+	FILE* host_file = fopen(node->host_path, "rb");
+	if (host_file == NULL || fread(node->buffer, 1, node->size, host_file) != node->size)
+		node->failed = true;
+
+	if (host_file != NULL)
+		fclose(host_file);
+}
+
+void free_tree_plan(tree_plan_t* plan)
+{
+	for (unsigned n = 0; n < plan->size; n++)
+	{
+		free(plan->nodes[n].host_path);
+		free(plan->nodes[n].buffer);
+	}
+
+	free(plan->nodes);
+	plan->nodes = NULL;
+	plan->size = 0;
+}
+
+bool export_tree(unsigned index, bool sorted, char* host_dir, unsigned* return_info)
+{
+	tree_plan_t plan = { NULL, 0 };
+	bool unsafe_name = false;
+
+	// Fotografa a árvore em largura: cada diretório visitado acrescenta seus filhos ao fim do plano.
+	int current = -1;
+	unsigned current_block = index;
+	bool current_sorted = sorted;
+	while (true)
+	{
+		// Um diretório ordenado é lido folha por folha.
+		unsigned* leaves = &current_block;
+		unsigned num_leaves = 1;
+		if (current_sorted)
+		{
+			leaves = (unsigned*) malloc(NUM_CLUSTER * sizeof(unsigned));
+			num_leaves = 0;
+			sorted_collect(current_block, "", leaves, &num_leaves, NULL, NULL);
+		}
+
+		char* parent_path = current == -1 ? host_dir : plan.nodes[current].host_path;
+		for (unsigned l = 0; l < num_leaves; l++)
+		{
+			data_cluster cluster;
+			dir_entry_t* dir = root_dir;
+			if (leaves[l] != 0x00)
+			{
+				get_data_cluster(leaves[l], &cluster);
+				dir = cluster.dir;
+			}
+
+			for (int i = 0; i < 32; i++)
+			{
+				if (dir[i].first_block == 0x00 || is_inline_slot(&dir[i]))
+					continue;
+
+				// Os nomes viram caminhos no host: um nome como ".." (de uma imagem montada fora do fat) escreveria fora do destino.
+				char name[18];
+				snprintf(name, sizeof(name), "%.17s", dir[i].filename);
+				if (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strchr(name, '/') != NULL)
+				{
+					unsafe_name = true;
+					continue;
+				}
+
+				plan.nodes = (tree_node_t*) realloc(plan.nodes, (plan.size + 1) * sizeof(tree_node_t));
+				tree_node_t* node = &plan.nodes[plan.size++];
+				memset(node, 0x00, sizeof(tree_node_t));
+				strcpy(node->name, name);
+				node->host_path = (char*) malloc((strlen(parent_path) + strlen(node->name) + 2) * sizeof(char));
+				sprintf(node->host_path, "%s/%s", parent_path, node->name);
+				node->is_dir = dir[i].attributes == 0x1;
+				node->sorted = node->is_dir && (dir[i].reserved[0] & ENTRY_SORTED);
+				node->parent = current;
+				node->first_block = dir[i].first_block;
+				node->size = dir[i].size;
+				node->compressed = (dir[i].reserved[0] & ENTRY_COMPRESSED) != 0;
+
+				// O conteúdo de arquivos embutidos já está no cluster de diretório lido.
+				if (!node->is_dir && (dir[i].reserved[0] & ENTRY_INLINE))
+				{
+					node->inlined = true;
+					node->buffer = (uint8_t*) malloc(node->size + 1);
+					read_inline(dir, i, (char*) node->buffer);
+				}
+			}
+		}
+
+		if (current_sorted)
+			free(leaves);
+
+		// Próximo diretório da fila.
+		do
+			current++;
+		while (current < (int) plan.size && !plan.nodes[current].is_dir);
+
+		if (current >= (int) plan.size)
+			break;
+
+		current_block = plan.nodes[current].first_block;
+		current_sorted = plan.nodes[current].sorted;
+	}
+
+	// Nada é escrito no host se algum nome da árvore for inválido.
+	if (unsafe_name)
+	{
+		*return_info = UNSAFE_NAME;
+		free_tree_plan(&plan);
+		return false;
+	}
+
+	// Cria o diretório de destino no host, caso ainda não exista.
+	if (mkdir(host_dir, 0755) != 0 && errno != EEXIST)
+	{
+		*return_info = HOST_ERROR;
+		free_tree_plan(&plan);
+		return false;
+	}
+
+	// Recria a estrutura de diretórios no host (pais sempre antes dos filhos).
+	bool failed = false;
+	for (unsigned n = 0; n < plan.size && !failed; n++)
+		if (plan.nodes[n].is_dir && mkdir(plan.nodes[n].host_path, 0755) != 0 && errno != EEXIST)
+			failed = true;
+
+	// Calcula as extensões de todos os arquivos a partir da FAT em memória: cada cluster é lido direto para sua posição no buffer do arquivo.
+	cluster_io_t* reads = NULL;
+	unsigned num_reads = 0;
+	for (unsigned n = 0; n < plan.size && !failed; n++)
+	{
+		tree_node_t* node = &plan.nodes[n];
+		if (node->is_dir || node->inlined)
+			continue;
+
+		unsigned next_block = node->first_block;
+		do
+		{
+			node->num_clusters++;
+			next_block = fat_get(next_block);
+		} while (next_block != 0xffff && next_block != 0x00 && node->num_clusters < NUM_CLUSTER);
+
+		node->buffer = (uint8_t*) device_alloc(node->num_clusters * CLUSTER_SIZE);
+		reads = (cluster_io_t*) realloc(reads, (num_reads + node->num_clusters) * sizeof(cluster_io_t));
+
+		next_block = node->first_block;
+		for (unsigned k = 0; k < node->num_clusters; k++, num_reads++)
+		{
+			reads[num_reads].block = next_block;
+			reads[num_reads].buffer = node->buffer + (k * CLUSTER_SIZE);
+			next_block = fat_get(next_block);
+		}
+	}
+
+	// Clusters alterados que o flusher ainda não gravou saem do cache; a camada de dispositivo lê os demais em ordem de disco,
+	// com uma operação por trecho contíguo.
+	unsigned num_misses = 0;
+	for (unsigned i = 0; i < num_reads && !failed; i++)
+		if (!cache_lookup(reads[i].block, reads[i].buffer))
+			reads[num_misses++] = reads[i];
+
+	if (!failed && !device_read_clusters(reads, num_misses))
+		failed = true;
+	free(reads);
+
+	// Um conjunto de threads grava os arquivos no host.
+	if (!failed)
+	{
+		worker_pool_t pool;
+		worker_pool_start(&pool, plan.size, export_write_job, &plan);
+		worker_pool_join(&pool);
+
+		for (unsigned n = 0; n < plan.size; n++)
+			if (plan.nodes[n].failed)
+				failed = true;
+	}
+
+	free_tree_plan(&plan);
+
+	if (failed)
+	{
+		*return_info = HOST_ERROR;
+		return false;
+	}
+
+	return true;
+}
+
+void export_write_job(unsigned job, void* context)
+{
+	tree_node_t* node = &((tree_plan_t*) context)->nodes[job];
+	if (node->is_dir)
+		return;
+
+	// Assim como no read, o conteúdo de cada cluster vai até o primeiro 0x00, e arquivos comprimidos são descomprimidos aqui.
+	unsigned data_size = 0;
+	if (node->inlined)
+		data_size = node->size;
+	else if (node->compressed)
+	{
+		uint8_t* content = (uint8_t*) malloc(node->size + 1);
+		if (!lz_unpack(node->buffer, node->num_clusters * CLUSTER_SIZE, content, node->size))
+		{
+			free(content);
+			node->failed = true;
+			return;
+		}
+
+		free(node->buffer);
+		node->buffer = content;
+		data_size = node->size;
+	}
+	else
+	{
+		for (unsigned k = 0; k < node->num_clusters; k++)
+		{
+			uint8_t* cluster_data = node->buffer + (k * CLUSTER_SIZE);
+			unsigned length = 0;
+			while (length < CLUSTER_SIZE && cluster_data[length] != 0x00)
+				length++;
+
+			memmove(node->buffer + data_size, cluster_data, length);
+			data_size += length;
+		}
+	}
+
+	FILE* host_file = fopen(node->host_path, "wb");
+	if (host_file == NULL || fwrite(node->buffer, 1, data_size, host_file) != data_size)
+		node->failed = true;
+
+	if (host_file != NULL && fclose(host_file) != 0)
+		node->failed = true;
+}
+
+void worker_pool_start(worker_pool_t* pool, unsigned num_jobs, void (*job)(unsigned, void*), void* context)
+{
+	pool->num_jobs = num_jobs;
+	pool->next_job = 0;
+	pool->job_done = (bool*) calloc(num_jobs + 1, sizeof(bool));
+	pool->job = job;
+	pool->context = context;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->job_finished, NULL);
+
+	// As tarefas são limitadas por E/S, logo o número de threads não depende do número de processadores.
+	pool->num_threads = num_jobs < MAX_WORKERS ? num_jobs : MAX_WORKERS;
+	for (unsigned i = 0; i < pool->num_threads; i++)
+		pthread_create(&pool->threads[i], NULL, worker_pool_thread, pool);
+}
+
+void* worker_pool_thread(void* arg)
+{
+	worker_pool_t* pool = (worker_pool_t*) arg;
+
+	while (true)
+	{
+		// Pega a próxima tarefa ainda não iniciada.
+		pthread_mutex_lock(&pool->lock);
+		if (pool->next_job >= pool->num_jobs)
+		{
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		unsigned job = pool->next_job++;
+		pthread_mutex_unlock(&pool->lock);
+
+		pool->job(job, pool->context);
+
+		// Sinaliza o término da tarefa para quem estiver esperando por ela.
+		pthread_mutex_lock(&pool->lock);
+		pool->job_done[job] = true;
+		pthread_cond_broadcast(&pool->job_finished);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return NULL;
+}
+
+void worker_pool_wait_job(worker_pool_t* pool, unsigned job)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->job_done[job])
+		pthread_cond_wait(&pool->job_finished, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void worker_pool_join(worker_pool_t* pool)
+{
+	for (unsigned i = 0; i < pool->num_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->job_finished);
+	free(pool->job_done);
+}
+
+unsigned get_available_cluster()
+{
+	unsigned start = next_free_hint >= 10 && next_free_hint < NUM_CLUSTER ? next_free_hint : 10;
+
+	// Com o mapa de clusters livres pronto, a procura anda uma palavra de 64 clusters por vez.
+	if (free_map_ready)
+	{
+		unsigned block = find_free_cluster(start, NUM_CLUSTER);
+		return block != 0x00 ? block : find_free_cluster(10, start);
+	}
+
+	// Antes disso, percorre a fat a partir da dica, lendo do disco apenas os setores necessários.
+	for (unsigned i = start; i < NUM_CLUSTER; i++)
+		if (is_free_cluster(i))
+			return i;
+
+	for (unsigned i = 10; i < start; i++)
+		if (is_free_cluster(i))
+			return i;
+
+	// Caso não encontre, retorna um índice inválido.
+	return 0x00;
+}
+
+// Primeiro cluster livre do mapa no intervalo [from, to), ou 0x00.
+unsigned find_free_cluster(unsigned from, unsigned to)
+{
+	for (unsigned word = from / 64; word * 64 < to; word++)
+	{
+		uint64_t bits = free_map[word];
+		if (word == from / 64)
+			bits &= ~0ULL << (from % 64);
+
+		if (bits != 0)
+		{
+			unsigned block = word * 64 + __builtin_ctzll(bits);
+			return block < to ? block : 0x00;
+		}
+	}
+
+	return 0x00;
+}
+
+// Marca o cluster como livre ou ocupado no mapa, mantendo a dica da próxima alocação.
+void set_free_map(unsigned block, bool free)
+{
+	if (free)
+	{
+		free_map[block / 64] |= 1ULL << (block % 64);
+		if (block < next_free_hint)
+			next_free_hint = block;
+	}
+	else
+		free_map[block / 64] &= ~(1ULL << (block % 64));
+}
+
+// Recalcula no mapa os clusters de um setor da FAT.
+void rebuild_free_map_sector(unsigned sector)
+{
+	for (unsigned block = sector * FAT_ENTRIES_BY_SECTOR; block < (sector + 1) * FAT_ENTRIES_BY_SECTOR; block++)
+		set_free_map(block, block >= 10 && is_free_cluster(block));
+}
+
+// Reserva um cluster livre como fim de cadeia, mantendo o contador de clusters livres. Retorna 0x00 caso não haja espaço.
+unsigned allocate_cluster()
+{
+	unsigned block = get_available_cluster();
+	if (block == 0x00)
+		return 0x00;
+
+	fat_set(block, 0xffff);
+	free_clusters--;
+	if (block >= next_free_hint)
+		next_free_hint = block + 1;
+	dedup_forget(block);
+	return block;
+}
+
+// Reserva um cluster livre e o zera, para quem não o sobrescreve por inteiro (diretórios novos e arquivos vazios).
+unsigned allocate_empty_cluster()
+{
+	unsigned block = allocate_cluster();
+	if (block == 0x00)
+		return 0x00;
+
+	data_cluster cluster;
+	memset(cluster.data, 0x00, CLUSTER_SIZE);
+	save_data_cluster(block, &cluster);
+	return block;
+}
+
+// Devolve um cluster à FAT. Apenas metadados: o conteúdo antigo só é sobrescrito quando o cluster for alocado novamente.
+// Clusters compartilhados por clones apenas perdem uma referência, e os usados por snapshots só voltam a ser livres quando
+// o último snapshot for apagado. Retorna true caso o cluster tenha voltado a ser livre.
+bool release_cluster(unsigned block)
+{
+	if (cluster_refs[block] > 0)
+	{
+		cluster_refs[block]--;
+		cluster_refs_changed = true;
+		return false;
+	}
+
+	fat_set(block, 0x00);
+	if (cluster_pins[block] > 0)
+		return false;
+
+	free_clusters++;
+	return true;
+}
+
+// Um cluster compartilhado (por clones ou snapshots) não pode ser alterado nem movido: a FAT tem um único ponteiro de próximo
+// cluster, então, se um cluster é compartilhado, todo o restante da cadeia também é.
+bool is_shared_cluster(unsigned block)
+{
+	return cluster_refs[block] > 0 || cluster_pins[block] > 0;
+}
+
+// Livre para alocação: fora de uso no volume e em todos os snapshots.
+bool is_free_cluster(unsigned block)
+{
+	return fat_get(block) == 0x00 && cluster_pins[block] == 0;
+}
+
+// Antes de um comando alterar diretórios, troca os clusters de diretório do caminho que ainda pertencem a algum snapshot
+// por cópias, a partir do root_dir (o pai de cada um já foi copiado quando o filho é visitado). Retorna false caso não haja espaço.
+bool unshare_directories(path_t* path, unsigned depth)
+{
+	unsigned parent = 0x00;
+	for (unsigned i = 0; i < depth; i++)
+	{
+		data_cluster parent_cluster;
+		dir_entry_t* dir = root_dir;
+		if (parent != 0x00)
+		{
+			get_data_cluster(parent, &parent_cluster);
+			dir = parent_cluster.dir;
+		}
+
+		dir_entry_t* entry = NULL;
+		uint32_t candidates = name_candidates(dir, &path->components[i]);
+		for (int j = 0; j < 32; j++)
+		{
+			if (dir[j].first_block != 0x00 && (candidates >> j & 1) && entry_matches(&dir[j], &path->components[i]))
+			{
+				entry = &dir[j];
+				break;
+			}
+		}
+
+		// O restante do caminho não existe (ou é um arquivo): nada mais a copiar.
+		if (entry == NULL || entry->attributes != 0x1)
+			return true;
+
+		if (is_shared_cluster(entry->first_block))
+		{
+			if (free_clusters == 0)
+				return false;
+
+			unsigned copy = allocate_cluster();
+			copy_data_cluster(entry->first_block, copy);
+			release_cluster(entry->first_block);
+			entry->first_block = copy;
+
+			if (parent != 0x00)
+				save_data_cluster(parent, &parent_cluster);
+		}
+
+		parent = entry->first_block;
+
+		// Em um diretório ordenado, o próximo nome fica em uma das folhas: copia também os nós do índice e a folha até ela.
+		if ((entry->reserved[0] & ENTRY_SORTED) && i + 1 < depth)
+		{
+			unsigned trail[SORTED_MAX_DEPTH], positions[SORTED_MAX_DEPTH], trail_size = 0;
+			parent = sorted_descend(entry->first_block, path->components[i + 1].name, true, trail, positions, &trail_size);
+			if (parent == 0x00)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+// Cria um snapshot com os metadados atuais. O custo é o de gravar uma cópia da FAT, do root_dir e da tabela de referências,
+// independente da quantidade de dados: a partir daqui, os clusters em uso passam a ser copiados antes de qualquer alteração.
+bool snapshot_create(char* name, unsigned* return_info)
+{
+	if (strlen(name) > 17)
+	{
+		*return_info = NAME_TOO_LONG;
+		return false;
+	}
+
+	snapshot_t* snapshot = (snapshot_t*) calloc(1, sizeof(snapshot_t));
+	if (find_snapshot(name, snapshot) >= 0)
+	{
+		*return_info = ALREADY_EXISTS;
+		free(snapshot);
+		return false;
+	}
+
+	int slot = -1;
+	for (unsigned i = 0; i < MAX_SNAPSHOTS && slot == -1; i++)
+		if (!read_snapshot(i, snapshot))
+			slot = i;
+
+	if (slot == -1)
+	{
+		*return_info = FULL_SNAPSHOTS;
+		free(snapshot);
+		return false;
+	}
+
+	// Os clusters que a cópia dos metadados aponta precisam estar no disco antes dela: com alterações ainda no cache, o
+	// snapshot restaurado depois de uma queda apontaria para conteúdo antigo.
+	if (!sync_volume(true))
+	{
+		*return_info = WRITE_FAILED;
+		free(snapshot);
+		return false;
+	}
+
+	memset(snapshot, 0x00, sizeof(snapshot_t));
+	strcpy(snapshot->name, name);
+	snapshot->used = true;
+	snapshot->created = (long long) time(NULL);
+	load_full_fat();
+	memcpy(snapshot->fat, fat, sizeof(fat));
+	memcpy(snapshot->root_dir, root_dir, sizeof(root_dir));
+	memcpy(snapshot->cluster_refs, cluster_refs, sizeof(cluster_refs));
+	if (!write_snapshot(slot, snapshot))
+	{
+		*return_info = WRITE_FAILED;
+		free(snapshot);
+		return false;
+	}
+
+	for (int i = 10; i < NUM_CLUSTER; i++)
+		if (fat_get(i) != 0x00)
+			cluster_pins[i]++;
+
+	free(snapshot);
+	return true;
+}
+
+// Mostra os snapshots, com os clusters que cada um usa e quantos seriam liberados ao apagá-lo.
+void snapshot_list()
+{
+	snapshot_t* snapshot = (snapshot_t*) malloc(sizeof(snapshot_t));
+	bool found_anything = false;
+	for (unsigned i = 0; i < MAX_SNAPSHOTS; i++)
+	{
+		if (!read_snapshot(i, snapshot))
+			continue;
+
+		unsigned used = 0, exclusive = 0;
+		for (int c = 10; c < NUM_CLUSTER; c++)
+		{
+			if (snapshot->fat[c] == 0x00)
+				continue;
+
+			used++;
+			if (cluster_pins[c] == 1 && fat_get(c) == 0x00)
+				exclusive++;
+		}
+
+		char created[32];
+		time_t created_time = (time_t) snapshot->created;
+		strftime(created, sizeof(created), "%Y-%m-%d %H:%M:%S", localtime(&created_time));
+		fprintf(stdout, "%s\t%s\t%u clusters\t%u exclusivos\n", snapshot->name, created, used, exclusive);
+		found_anything = true;
+	}
+
+	if (!found_anything)
+		fprintf(stderr, "Nenhum snapshot.\n");
+
+	free(snapshot);
+}
+
+// Volta o volume ao estado do snapshot, que continua existindo. Apenas os metadados são trocados.
+bool snapshot_restore(char* name, unsigned* return_info)
+{
+	snapshot_t* snapshot = (snapshot_t*) malloc(sizeof(snapshot_t));
+	if (find_snapshot(name, snapshot) < 0)
+	{
+		*return_info = NOT_FOUND_SNAP;
+		free(snapshot);
+		return false;
+	}
+
+	load_full_fat();
+	memcpy(fat, snapshot->fat, sizeof(fat));
+	memcpy(root_dir, snapshot->root_dir, sizeof(root_dir));
+	memcpy(cluster_refs, snapshot->cluster_refs, sizeof(cluster_refs));
+	cluster_refs_changed = true;
+	count_usage();
+
+	free(snapshot);
+	return true;
+}
+
+// Apaga o snapshot; os clusters que só ele usava voltam a ser livres.
+bool snapshot_delete(char* name, unsigned* return_info)
+{
+	snapshot_t* snapshot = (snapshot_t*) malloc(sizeof(snapshot_t));
+	int slot = find_snapshot(name, snapshot);
+	if (slot < 0)
+	{
+		*return_info = NOT_FOUND_SNAP;
+		free(snapshot);
+		return false;
+	}
+
+	// A posição é liberada no arquivo antes dos clusters: caso a gravação falhe, o snapshot continua valendo, com seus clusters.
+	snapshot_t* empty = (snapshot_t*) calloc(1, sizeof(snapshot_t));
+	bool written = write_snapshot(slot, empty);
+	free(empty);
+	if (!written)
+	{
+		*return_info = WRITE_FAILED;
+		free(snapshot);
+		return false;
+	}
+
+	for (int i = 10; i < NUM_CLUSTER; i++)
+	{
+		if (snapshot->fat[i] == 0x00)
+			continue;
+
+		cluster_pins[i]--;
+		if (is_free_cluster(i))
+		{
+			free_clusters++;
+			set_free_map(i, true);
+		}
+	}
+
+	free(snapshot);
+	return true;
+}
+
+// Procura o snapshot pelo nome, carregando-o em snapshot. Retorna a posição no arquivo de snapshots, ou -1.
+int find_snapshot(char* name, snapshot_t* snapshot)
+{
+	for (unsigned i = 0; i < MAX_SNAPSHOTS; i++)
+		if (read_snapshot(i, snapshot) && strcmp(snapshot->name, name) == 0)
+			return i;
+
+	return -1;
+}
+
+// Lê uma posição do arquivo de snapshots. Retorna false caso ela esteja vazia (ou o arquivo ainda não exista).
+bool read_snapshot(unsigned slot, snapshot_t* snapshot)
+{
+	memset(snapshot, 0x00, sizeof(snapshot_t));
+
+	FILE* ptr_file = fopen(fat_name snap_suffix, "rb");
+	if (ptr_file == NULL)
+		return false;
+
+	fseek(ptr_file, slot * sizeof(snapshot_t), SEEK_SET);
+	if (fread(snapshot, sizeof(snapshot_t), 1, ptr_file) != 1)
+		memset(snapshot, 0x00, sizeof(snapshot_t));
+	fclose(ptr_file);
+
+	return snapshot->used;
+}
+
+// Grava uma posição do arquivo de snapshots, esperando que chegue ao meio físico. Retorna false caso a gravação falhe.
+bool write_snapshot(unsigned slot, snapshot_t* snapshot)
+{
+	int fd = open(fat_name snap_suffix, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return false;
+
+	bool success = pwrite(fd, snapshot, sizeof(snapshot_t), slot * sizeof(snapshot_t)) == sizeof(snapshot_t);
+	success = fsync(fd) == 0 && success;
+	close(fd);
+
+	return success;
+}
+
+// Recalcula, a partir das FATs dos snapshots, quantos snapshots usam cada cluster.
+void load_snapshot_pins()
+{
+	memset(cluster_pins, 0x00, sizeof(cluster_pins));
+
+	snapshot_t* snapshot = (snapshot_t*) malloc(sizeof(snapshot_t));
+	for (unsigned i = 0; i < MAX_SNAPSHOTS; i++)
+	{
+		if (!read_snapshot(i, snapshot))
+			continue;
+
+		for (int c = 10; c < NUM_CLUSTER; c++)
+			if (snapshot->fat[c] != 0x00)
+				cluster_pins[c]++;
+	}
+
+	free(snapshot);
+}
+
+// Copia para clusters novos a parte compartilhada da cadeia, que passa a pertencer só a este arquivo. Retorna o novo primeiro cluster.
+// O chamador já conferiu que há clusters livres suficientes.
+unsigned unshare_chain(unsigned first_block)
+{
+	unsigned new_first_block = first_block;
+	unsigned previous_block = 0xffff;
+	unsigned block = first_block;
+	while (block != 0xffff)
+	{
+		unsigned next_block = fat_get(block);
+		unsigned own_block = block;
+		if (is_shared_cluster(block))
+		{
+			own_block = allocate_cluster();
+			copy_data_cluster(block, own_block);
+			release_cluster(block);
+
+			if (previous_block == 0xffff)
+				new_first_block = own_block;
+			else
+				fat_set(previous_block, own_block);
+		}
+
+		previous_block = own_block;
+		block = next_block;
+	}
+
+	return new_first_block;
+}
+
+// Resolve o destino de mv/cp: um diretório existente recebe a entrada com o nome da origem; caso contrário, o destino é o novo caminho,
+// cujo diretório pai precisa existir. dest_depth é a quantidade de partes de dest que levam ao diretório de destino.
+bool resolve_destination(path_t* dest, path_t* source, unsigned* dest_index, unsigned* dest_depth, path_component_t** dest_name, unsigned* return_info)
+{
+	unsigned dest_type = 0;
+	if (directory_navigator(dest, dest->size, dest_index, return_info, &dest_type, NAV_READ))
+	{
+		if (dest_type != SUB_DIR && dest_type != SORTED_DIR)
+		{
+			*return_info = ALREADY_EXISTS;
+			return false;
+		}
+
+		*dest_depth = dest->size;
+		*dest_name = &source->components[source->size - 1];
+		return make_room(dest, *dest_depth, *dest_name, dest_index, return_info);
+	}
+
+	if (*return_info != NOT_FOUND_DIR || !directory_navigator(dest, dest->size - 1, dest_index, return_info, &dest_type, NAV_READ))
+		return false;
+
+	if (dest_type != SUB_DIR)
+	{
+		*return_info = NOT_A_DIR;
+		return false;
+	}
+
+	*dest_depth = dest->size - 1;
+	*dest_name = &dest->components[dest->size - 1];
+	return make_room(dest, *dest_depth, *dest_name, dest_index, return_info);
+}
+
+// Antes de acrescentar name ao diretório da profundidade depth do caminho, cujo cluster está em index: em um diretório ordenado,
+// index passa a ser a folha que cobre o nome, dividida antes caso esteja quase cheia. Nos demais diretórios, nada muda.
+bool make_room(path_t* path, unsigned depth, path_component_t* name, unsigned* index, unsigned* return_info)
+{
+	if (depth == 0)
+		return true;
+
+	unsigned parent = 0x00, type = 0;
+	dir_entry_t entry;
+	if (!directory_navigator(path, depth - 1, &parent, return_info, &type, NAV_READ) || !find_entry(parent, &path->components[depth - 1], &entry) || !(entry.reserved[0] & ENTRY_SORTED))
+		return true;
+
+	return sorted_make_room(entry.first_block, name->name, index, return_info);
+}
+
+// Cria no diretório dest_index, com o nome dest_name, uma cópia do arquivo da última parte de source (no diretório source_index).
+// Com reflink a cadeia é apenas compartilhada (cada cluster ganha uma referência) e só é copiada quando um dos arquivos a alterar.
+bool clone_file(path_t* source, unsigned source_index, unsigned dest_index, path_component_t* dest_name, bool reflink, unsigned* return_info)
+{
+	dir_entry_t* source_dir = root_dir;
+	data_cluster source_cluster;
+	if (source_index != 0x00)
+	{
+		get_data_cluster(source_index, &source_cluster);
+		source_dir = source_cluster.dir;
+	}
+
+	dir_entry_t* source_entry = NULL;
+	uint32_t source_candidates = name_candidates(source_dir, &source->components[source->size - 1]);
+	for (int i = 0; i < 32; i++)
+	{
+		if (source_dir[i].first_block != 0x00 && (source_candidates >> i & 1) && entry_matches(&source_dir[i], &source->components[source->size - 1]))
+		{
+			source_entry = &source_dir[i];
+			break;
+		}
+	}
+
+	if (source_entry == NULL)
+	{
+		*return_info = NOT_FOUND_FILE;
+		return false;
+	}
+
+	if (source_entry->attributes == 0x1)
+	{
+		*return_info = NOT_A_FILE;
+		return false;
+	}
+
+	data_cluster dest_cluster;
+	dir_entry_t* dest_dir = root_dir;
+	if (dest_index != 0x00)
+	{
+		get_data_cluster(dest_index, &dest_cluster);
+		dest_dir = dest_cluster.dir;
+	}
+
+	int free_entry = -1;
+	uint32_t dest_candidates = name_candidates(dest_dir, dest_name);
+	for (int i = 0; i < 32; i++)
+	{
+		if (dest_dir[i].first_block == 0x00)
+		{
+			if (free_entry == -1)
+				free_entry = i;
+		}
+		else if ((dest_candidates >> i & 1) && entry_matches(&dest_dir[i], dest_name))
+		{
+			*return_info = ALREADY_EXISTS;
+			return false;
+		}
+	}
+
+	if (free_entry == -1)
+	{
+		*return_info = FULL_DIR;
+		return false;
+	}
+
+	// Um arquivo embutido é copiado para entradas de continuação do destino, sem clusters (também com --reflink).
+	if (source_entry->reserved[0] & ENTRY_INLINE)
+	{
+		char inline_data[INLINE_MAX_SIZE + 1];
+		read_inline(source_dir, source_entry - source_dir, inline_data);
+
+		if (dest_index == source_index && dest_index != 0x00)
+			dest_dir = source_dir;
+
+		dest_dir[free_entry] = *source_entry;
+		memset(dest_dir[free_entry].filename, 0x00, sizeof(dest_dir[free_entry].filename));
+		memcpy(dest_dir[free_entry].filename, dest_name->name, dest_name->length);
+		set_name_hash(&dest_dir[free_entry]);
+		memset(&dest_dir[free_entry].reserved[1], 0x00, INLINE_MAX_SLOTS);
+		if (!store_inline(dest_dir, free_entry, inline_data, source_entry->size))
+		{
+			memset(&dest_dir[free_entry], 0x00, sizeof(dir_entry_t));
+			*return_info = FULL_DIR;
+			return false;
+		}
+
+		if (dest_index != 0x00)
+			save_data_cluster(dest_index, dest_index == source_index ? &source_cluster : &dest_cluster);
+
+		used_bytes += source_entry->size;
+		return true;
+	}
+
+	unsigned chain_size = 0;
+	for (unsigned block = source_entry->first_block; block != 0xffff; block = fat_get(block))
+		chain_size++;
+
+	unsigned first_block = source_entry->first_block;
+	if (reflink)
+	{
+		for (unsigned block = first_block; block != 0xffff; block = fat_get(block))
+			cluster_refs[block]++;
+		cluster_refs_changed = true;
+	}
+	else
+	{
+		// Cópia completa: confere o espaço antes de alocar qualquer cluster.
+		if (chain_size > free_clusters)
+		{
+			*return_info = BLOATED_SYSTEM;
+			return false;
+		}
+
+		unsigned previous_block = 0xffff;
+		for (unsigned block = source_entry->first_block; block != 0xffff; block = fat_get(block))
+		{
+			unsigned copy = allocate_cluster();
+			copy_data_cluster(block, copy);
+			if (previous_block == 0xffff)
+				first_block = copy;
+			else
+				fat_set(previous_block, copy);
+			previous_block = copy;
+		}
+	}
+
+	dir_entry_t entry = *source_entry;
+	memset(entry.filename, 0x00, sizeof(entry.filename));
+	memcpy(entry.filename, dest_name->name, dest_name->length);
+	set_name_hash(&entry);
+	entry.first_block = first_block;
+
+	// Quando origem e destino são o mesmo cluster, a entrada é gravada no buffer da origem, que é o gravado em seguida.
+	if (dest_index == source_index && dest_index != 0x00)
+		dest_dir = source_dir;
+
+	dest_dir[free_entry] = entry;
+	if (dest_index != 0x00)
+		save_data_cluster(dest_index, dest_index == source_index ? &source_cluster : &dest_cluster);
+
+	used_bytes += entry.size;
+	return true;
+}
+
+// Remove a entrada com o nome da última parte do caminho, no diretório index (diretórios não vazios somente com recursive).
+// Todas as cadeias são coletadas antes e liberadas em uma única passada pela FAT; com secure, os clusters são zerados no disco.
+bool remove_tree(path_t* path, unsigned index, bool recursive, bool secure, unsigned* return_info)
+{
+	data_cluster dir_cluster;
+	dir_entry_t* dir = root_dir;
+	if (index != 0x00)
+	{
+		get_data_cluster(index, &dir_cluster);
+		dir = dir_cluster.dir;
+	}
+
+	dir_entry_t* entry = NULL;
+	uint32_t candidates = name_candidates(dir, &path->components[path->size - 1]);
+	for (int i = 0; i < 32; i++)
+	{
+		if (dir[i].first_block != 0x00 && (candidates >> i & 1) && entry_matches(&dir[i], &path->components[path->size - 1]))
+		{
+			entry = &dir[i];
+			break;
+		}
+	}
+
+	if (entry == NULL)
+	{
+		*return_info = NOT_FOUND_DIR;
+		return false;
+	}
+
+	// Monta a lista de clusters: a cadeia do arquivo ou, para diretórios, toda a subárvore (um único percurso em largura).
+	unsigned* blocks = NULL;
+	unsigned num_blocks = 0;
+	unsigned long long bytes = 0;
+
+	usage_node_t* nodes = NULL;
+	unsigned num_nodes = 0;
+	if (entry->attributes == 0x1)
+	{
+		num_nodes = collect_usage(entry->first_block, (entry->reserved[0] & ENTRY_SORTED) != 0, &nodes);
+		if (num_nodes > 1 && !recursive)
+		{
+			free(nodes);
+			*return_info = NOT_EMPTY_DIR;
+			return false;
+		}
+	}
+	else
+	{
+		num_nodes = 1;
+		nodes = (usage_node_t*) calloc(1, sizeof(usage_node_t));
+		nodes[0].first_block = entry->first_block;
+		nodes[0].bytes = entry->size;
+	}
+
+	for (unsigned n = 0; n < num_nodes; n++)
+	{
+		if (nodes[n].is_dir && !nodes[n].sorted)
+		{
+			blocks = (unsigned*) realloc(blocks, (num_blocks + 1) * sizeof(unsigned));
+			blocks[num_blocks++] = nodes[n].first_block;
+			continue;
+		}
+
+		// Um diretório ordenado ocupa as folhas e os nós do índice.
+		if (nodes[n].is_dir)
+		{
+			blocks = (unsigned*) realloc(blocks, (num_blocks + 2 * NUM_CLUSTER) * sizeof(unsigned));
+			unsigned num_leaves = 0, num_index_nodes = 0;
+			sorted_collect(nodes[n].first_block, "", &blocks[num_blocks], &num_leaves, &blocks[num_blocks + NUM_CLUSTER], &num_index_nodes);
+			memmove(&blocks[num_blocks + num_leaves], &blocks[num_blocks + NUM_CLUSTER], num_index_nodes * sizeof(unsigned));
+			num_blocks += num_leaves + num_index_nodes;
+			continue;
+		}
+
+		for (unsigned block = nodes[n].first_block; block != 0xffff && block != 0x00; block = fat_get(block))
+		{
+			blocks = (unsigned*) realloc(blocks, (num_blocks + 1) * sizeof(unsigned));
+			blocks[num_blocks++] = block;
+		}
+	}
+
+	// Para diretórios, a raiz da agregação já contém a soma dos arquivos da subárvore.
+	bytes = nodes[0].bytes;
+	free(nodes);
+
+	// Retira a entrada do diretório pai (com as entradas de continuação, caso seja um arquivo embutido) e, em seguida, libera todos os clusters de uma vez.
+	// Clusters compartilhados com clones fora da subárvore apenas perdem uma referência e não são apagados.
+	if (entry->attributes != 0x1)
+		release_inline_slots(dir, entry - dir);
+	memset(entry, 0x00, sizeof(dir_entry_t));
+	if (index != 0x00)
+		save_data_cluster(index, &dir_cluster);
+
+	unsigned num_freed = 0;
+	for (unsigned k = 0; k < num_blocks; k++)
+		if (release_cluster(blocks[k]))
+			blocks[num_freed++] = blocks[k];
+
+	if (secure)
+		erase_data_clusters(blocks, num_freed);
+
+	used_bytes -= bytes;
+
+	free(blocks);
+	return true;
+}
+
+// Move a entrada da última parte de source (no diretório source_index) para o diretório dest_index, com o nome dest_name.
+// dest_depth é a quantidade de partes de dest que levam ao diretório de destino. Nenhum cluster de dados é copiado:
+// a entrada é gravada primeiro no destino e só depois retirada da origem, de modo que uma interrupção deixa, no pior caso, uma entrada duplicada.
+bool move_entry(path_t* source, unsigned source_index, path_t* dest, unsigned dest_depth, unsigned dest_index, path_component_t* dest_name, unsigned* return_info)
+{
+	data_cluster source_cluster, dest_cluster;
+	dir_entry_t* source_dir = root_dir;
+	if (source_index != 0x00)
+	{
+		get_data_cluster(source_index, &source_cluster);
+		source_dir = source_cluster.dir;
+	}
+
+	// Quando origem e destino são o mesmo diretório, ambos apontam para o mesmo buffer e a troca é feita com uma única escrita.
+	dir_entry_t* dest_dir = source_dir;
+	if (dest_index != source_index)
+	{
+		dest_dir = root_dir;
+		if (dest_index != 0x00)
+		{
+			get_data_cluster(dest_index, &dest_cluster);
+			dest_dir = dest_cluster.dir;
+		}
+	}
+
+	int source_entry = -1;
+	uint32_t source_candidates = name_candidates(source_dir, &source->components[source->size - 1]);
+	for (int i = 0; i < 32; i++)
+	{
+		if (source_dir[i].first_block != 0x00 && (source_candidates >> i & 1) && entry_matches(&source_dir[i], &source->components[source->size - 1]))
+		{
+			source_entry = i;
+			break;
+		}
+	}
+
+	if (source_entry == -1)
+	{
+		*return_info = NOT_FOUND_DIR;
+		return false;
+	}
+
+	// Um diretório não pode ser movido para a sua própria subárvore (os caminhos já estão normalizados).
+	if (source_dir[source_entry].attributes == 0x1 && source->size <= dest_depth)
+	{
+		bool is_prefix = true;
+		for (unsigned i = 0; i < source->size && is_prefix; i++)
+			is_prefix = source->components[i].length == dest->components[i].length && memcmp(source->components[i].name, dest->components[i].name, source->components[i].length) == 0;
+
+		if (is_prefix)
+		{
+			*return_info = MOVE_INTO_SELF;
+			return false;
+		}
+	}
+
+	int free_entry = -1;
+	uint32_t dest_candidates = name_candidates(dest_dir, dest_name);
+	for (int i = 0; i < 32; i++)
+	{
+		if (dest_dir[i].first_block == 0x00)
+		{
+			if (free_entry == -1)
+				free_entry = i;
+		}
+		else if ((dest_candidates >> i & 1) && entry_matches(&dest_dir[i], dest_name))
+		{
+			// Renomear uma entrada para o próprio nome não altera nada.
+			if (dest_dir == source_dir && i == source_entry)
+				return true;
+
+			*return_info = ALREADY_EXISTS;
+			return false;
+		}
+	}
+
+	// Dentro do mesmo diretório a própria entrada é reaproveitada.
+	if (dest_dir == source_dir)
+		free_entry = source_entry;
+
+	if (free_entry == -1)
+	{
+		*return_info = FULL_DIR;
+		return false;
+	}
+
+	// O conteúdo de um arquivo embutido vai junto para entradas de continuação do diretório de destino.
+	bool inlined = dest_dir != source_dir && source_dir[source_entry].attributes != 0x1 && (source_dir[source_entry].reserved[0] & ENTRY_INLINE);
+	char inline_data[INLINE_MAX_SIZE + 1];
+	if (inlined)
+		read_inline(source_dir, source_entry, inline_data);
+
+	dir_entry_t entry = source_dir[source_entry];
+	memset(entry.filename, 0x00, sizeof(entry.filename));
+	memcpy(entry.filename, dest_name->name, dest_name->length);
+	set_name_hash(&entry);
+	dest_dir[free_entry] = entry;
+
+	if (inlined)
+	{
+		memset(&dest_dir[free_entry].reserved[1], 0x00, INLINE_MAX_SLOTS);
+		if (!store_inline(dest_dir, free_entry, inline_data, entry.size))
+		{
+			memset(&dest_dir[free_entry], 0x00, sizeof(dir_entry_t));
+			*return_info = FULL_DIR;
+			return false;
+		}
+	}
+
+	// Grava o destino (e o root_dir) no disco antes de retirar a entrada da origem.
+	if (dest_index != 0x00)
+		save_data_cluster(dest_index, dest_dir == source_dir ? &source_cluster : &dest_cluster);
+	if (dest_dir != source_dir)
+	{
+		save();
+		sync_volume(false);
+	}
+
+	if (dest_dir != source_dir)
+	{
+		if (inlined)
+			release_inline_slots(source_dir, source_entry);
+		memset(&source_dir[source_entry], 0x00, sizeof(dir_entry_t));
+		if (source_index != 0x00)
+			save_data_cluster(source_index, &source_cluster);
+	}
+
+	return true;
+}
+
+// Resumo (FNV-1a) do conteúdo de um cluster. Nunca é 0, que marca um cluster sem resumo.
+uint32_t cluster_digest(data_cluster* cluster)
+{
+	uint32_t digest = 2166136261u;
+	for (int i = 0; i < CLUSTER_SIZE; i++)
+	{
+		digest ^= cluster->data[i];
+		digest *= 16777619u;
+	}
+
+	return digest == 0 ? 1 : digest;
+}
+
+// Registra o resumo de um cluster de arquivo no índice.
+void dedup_remember(unsigned block, uint32_t digest)
+{
+	dedup_forget(block);
+	cluster_digests[block] = digest;
+	digest_next[block] = digest_buckets[digest % DEDUP_BUCKETS];
+	digest_buckets[digest % DEDUP_BUCKETS] = block;
+	cluster_digests_changed = true;
+}
+
+// Retira um cluster do índice (ele foi realocado ou recebeu outro conteúdo).
+void dedup_forget(unsigned block)
+{
+	if (cluster_digests[block] == 0)
+		return;
+
+	short* link = &digest_buckets[cluster_digests[block] % DEDUP_BUCKETS];
+	while (*link != -1 && *link != (short) block)
+		link = &digest_next[*link];
+
+	if (*link != -1)
+		*link = digest_next[block];
+
+	cluster_digests[block] = 0;
+	cluster_digests_changed = true;
+}
+
+// Procura um cluster em uso com o mesmo conteúdo e que aponte para next na FAT: só assim ele pode ser compartilhado,
+// já que a FAT compartilha o restante da cadeia junto. O conteúdo é sempre conferido, então resumos antigos não causam erros.
+unsigned dedup_lookup(data_cluster* cluster, uint32_t digest, unsigned next, unsigned exclude)
+{
+	for (short block = digest_buckets[digest % DEDUP_BUCKETS]; block != -1; block = digest_next[block])
+	{
+		if (block == (short) exclude || cluster_digests[block] != digest || fat_get(block) != next || cluster_refs[block] == 0xffff)
+			continue;
+
+		data_cluster candidate;
+		get_data_cluster(block, &candidate);
+		if (memcmp(candidate.data, cluster->data, CLUSTER_SIZE) == 0)
+			return block;
+	}
+
+	return 0x00;
+}
+
+// Monta uma cadeia nova para data, do último cluster para o primeiro: enquanto houver um cluster igual apontando para o
+// restante já montado, ele é compartilhado sem nenhuma escrita. Retorna false, sem alterar nada, caso não haja espaço.
+bool write_deduplicated(char* data, unsigned data_size, unsigned* first_block)
+{
+	unsigned needed = (data_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+	unsigned* chain = (unsigned*) malloc(needed * sizeof(unsigned));
+	data_cluster* clusters = (data_cluster*) malloc(needed * sizeof(data_cluster));
+
+	// Primeira passada: só consultas. Depois do primeiro cluster sem par, nenhum anterior pode ter (nada aponta para um cluster novo).
+	unsigned next = 0xffff, missing = 0;
+	for (int k = needed - 1; k >= 0; k--)
+	{
+		unsigned ceiling = data_size - (k * CLUSTER_SIZE) >= CLUSTER_SIZE ? CLUSTER_SIZE : data_size - (k * CLUSTER_SIZE);
+		memset(clusters[k].data, 0x00, CLUSTER_SIZE);
+		memcpy(clusters[k].data, data + (k * CLUSTER_SIZE), ceiling);
+
+		chain[k] = 0x00;
+		if (missing == 0)
+			chain[k] = dedup_lookup(&clusters[k], cluster_digest(&clusters[k]), next, 0x00);
+
+		if (chain[k] == 0x00)
+			missing++;
+		else
+			next = chain[k];
+	}
+
+	if (missing > free_clusters)
+	{
+		free(chain);
+		free(clusters);
+		return false;
+	}
+
+	// Segunda passada: compartilha os clusters encontrados e grava apenas os que faltam.
+	next = 0xffff;
+	for (int k = needed - 1; k >= 0; k--)
+	{
+		if (chain[k] != 0x00)
+		{
+			cluster_refs[chain[k]]++;
+			cluster_refs_changed = true;
+		}
+		else
+		{
+			chain[k] = allocate_cluster();
+			fat_set(chain[k], next);
+			save_data_cluster(chain[k], &clusters[k]);
+			dedup_remember(chain[k], cluster_digest(&clusters[k]));
+		}
+
+		next = chain[k];
+	}
+
+	*first_block = chain[0];
+	free(chain);
+	free(clusters);
+	return true;
+}
+
+// Passada offline: percorre todos os arquivos do diretório (e subdiretórios) juntando clusters repetidos.
+void dedup_volume(unsigned dir_block, bool sorted, unsigned* merged, unsigned* files)
+{
+	// Um diretório ordenado é percorrido folha por folha.
+	if (sorted)
+	{
+		unsigned* leaves = (unsigned*) malloc(NUM_CLUSTER * sizeof(unsigned));
+		unsigned num_leaves = 0;
+		sorted_collect(dir_block, "", leaves, &num_leaves, NULL, NULL);
+		for (unsigned l = 0; l < num_leaves; l++)
+			dedup_volume(leaves[l], false, merged, files);
+
+		free(leaves);
+		return;
+	}
+
+	data_cluster cluster;
+	dir_entry_t* dir = root_dir;
+	if (dir_block != 0x00)
+	{
+		get_data_cluster(dir_block, &cluster);
+		dir = cluster.dir;
+	}
+
+	prefetch_subdirectories(dir, 32);
+
+	bool dir_changed = false;
+	for (int i = 0; i < 32; i++)
+	{
+		// Arquivos embutidos (e suas entradas de continuação) não têm clusters.
+		if (dir[i].first_block == 0x00 || dir[i].first_block == 0xffff)
+			continue;
+
+		if (dir[i].attributes == 0x1)
+			dedup_volume(dir[i].first_block, (dir[i].reserved[0] & ENTRY_SORTED) != 0, merged, files);
+		else
+		{
+			// O primeiro cluster só pode ser trocado se o diretório puder ser alterado (não pertence a um snapshot).
+			unsigned first_block = dir[i].first_block;
+			(*files)++;
+			*merged += dedup_chain(&first_block, dir_block == 0x00 || !is_shared_cluster(dir_block));
+			if (first_block != dir[i].first_block)
+			{
+				dir[i].first_block = first_block;
+				dir_changed = true;
+			}
+		}
+	}
+
+	if (dir_changed && dir_block != 0x00)
+		save_data_cluster(dir_block, &cluster);
+}
+
+// Junta os clusters de uma cadeia a clusters iguais já indexados, do fim para o começo, e indexa os que ficaram.
+// Só clusters exclusivos, cujo antecessor também possa ser alterado, são trocados. Retorna quantos clusters foram trocados.
+unsigned dedup_chain(unsigned* first_block, bool can_change_first)
+{
+	unsigned* chain = NULL;
+	unsigned chain_size = 0;
+	for (unsigned block = *first_block; block != 0xffff && block != 0x00; block = fat_get(block))
+	{
+		chain = (unsigned*) realloc(chain, (chain_size + 1) * sizeof(unsigned));
+		chain[chain_size++] = block;
+	}
+
+	unsigned merged = 0;
+	for (int k = chain_size - 1; k >= 0; k--)
+	{
+		unsigned block = chain[k];
+		data_cluster cluster;
+		get_data_cluster(block, &cluster);
+		uint32_t digest = cluster_digest(&cluster);
+
+		// Clusters vazios não são indexados: só arquivos vazios os têm, e eles se confundiriam com diretórios vazios.
+		bool is_empty = true;
+		for (int i = 0; i < CLUSTER_SIZE && is_empty; i++)
+			is_empty = cluster.data[i] == 0x00;
+		if (is_empty)
+			continue;
+
+		bool can_replace = !is_shared_cluster(block) && (k > 0 ? !is_shared_cluster(chain[k - 1]) : can_change_first);
+		unsigned match = can_replace ? dedup_lookup(&cluster, digest, fat_get(block), block) : 0x00;
+		if (match != 0x00)
+		{
+			if (k > 0)
+				fat_set(chain[k - 1], match);
+			else
+				*first_block = match;
+
+			cluster_refs[match]++;
+			cluster_refs_changed = true;
+			release_cluster(block);
+			dedup_forget(block);
+			merged++;
+		}
+		else if (cluster_digests[block] != digest)
+			dedup_remember(block, digest);
+	}
+
+	free(chain);
+	return merged;
+}
+
+// O índice só existe com a deduplicação ligada; as listas por resumo são montadas a partir dele.
+void load_dedup_index()
+{
+	memset(cluster_digests, 0x00, sizeof(cluster_digests));
+	memset(digest_buckets, 0xff, sizeof(digest_buckets));
+	memset(digest_next, 0xff, sizeof(digest_next));
+	cluster_digests_changed = false;
+	dedup_enabled = false;
+
+	FILE* ptr_file = fopen(fat_name dedup_suffix, "rb");
+	if (ptr_file == NULL)
+		return;
+
+	uint32_t* digests = (uint32_t*) calloc(NUM_CLUSTER, sizeof(uint32_t));
+	fread(digests, sizeof(uint32_t), NUM_CLUSTER, ptr_file);
+	fclose(ptr_file);
+
+	for (int i = 10; i < NUM_CLUSTER; i++)
+		if (digests[i] != 0 && fat_get(i) != 0x00)
+			dedup_remember(i, digests[i]);
+
+	free(digests);
+	dedup_enabled = true;
+	cluster_digests_changed = false;
+}
+
+// Sobrescreve os clusters com zeros usando uma única abertura do arquivo, em ordem de disco.
+void erase_data_clusters(unsigned* blocks, unsigned num_blocks)
+{
+	data_cluster cluster;
+	memset(cluster.data, 0x00, CLUSTER_SIZE);
+
+	// Uma gravação em andamento desses clusters não pode chegar ao disco depois dos zeros.
+	sync_volume(false);
+
+	// Todas as escritas partem do mesmo cluster zerado; a camada de dispositivo as ordena e junta os trechos vizinhos.
+	cluster_io_t* writes = (cluster_io_t*) malloc((num_blocks + 1) * sizeof(cluster_io_t));
+	for (unsigned k = 0; k < num_blocks; k++)
+	{
+		writes[k].block = blocks[k];
+		writes[k].buffer = &cluster;
+		cache_invalidate(blocks[k]);
+	}
+
+	device_write_clusters(writes, num_blocks);
+	device_sync();
+	free(writes);
+}
+
+// Calcula os contadores de uso a partir da FAT e da árvore de diretórios (feito uma única vez, ao carregar).
+void count_usage()
+{
+	// Percorre a FAT inteira, refazendo também o mapa de clusters livres e a dica da próxima alocação.
+	next_free_hint = NUM_CLUSTER;
+	for (unsigned sector = 0; sector < FAT_SECTORS; sector++)
+		rebuild_free_map_sector(sector);
+	free_map_ready = true;
+
+	free_clusters = 0;
+	for (unsigned word = 0; word < NUM_CLUSTER / 64; word++)
+		free_clusters += __builtin_popcountll(free_map[word]);
+
+	used_bytes = directory_bytes(0x00, false);
+}
+
+// Soma dos tamanhos dos arquivos de um diretório e de todos os seus subdiretórios.
+unsigned long long directory_bytes(unsigned dir_block, bool sorted)
+{
+	// Um diretório ordenado soma as suas folhas, cada uma um cluster de diretório comum.
+	if (sorted)
+	{
+		unsigned* leaves = (unsigned*) malloc(NUM_CLUSTER * sizeof(unsigned));
+		unsigned num_leaves = 0;
+		unsigned long long bytes = 0;
+		sorted_collect(dir_block, "", leaves, &num_leaves, NULL, NULL);
+		for (unsigned l = 0; l < num_leaves; l++)
+			bytes += directory_bytes(leaves[l], false);
+
+		free(leaves);
+		return bytes;
+	}
+
+	data_cluster cluster;
+	dir_entry_t* dir = root_dir;
+	if (dir_block != 0x00)
+	{
+		get_data_cluster(dir_block, &cluster);
+		dir = cluster.dir;
+	}
+
+	// Os subdiretórios são pedidos todos de uma vez antes de a recursão descer por cada um.
+	prefetch_subdirectories(dir, 32);
+
+	unsigned long long bytes = 0;
+	for (int i = 0; i < 32; i++)
+	{
+		if (dir[i].first_block == 0x00)
+			continue;
+
+		if (dir[i].attributes == 0x1)
+			bytes += directory_bytes(dir[i].first_block, (dir[i].reserved[0] & ENTRY_SORTED) != 0);
+		else
+			bytes += dir[i].size;
+	}
+
+	return bytes;
+}
+
+// Monta a subárvore do diretório em largura. Os clusters de diretório de cada nível são lidos juntos, em ordem de disco.
+unsigned collect_usage(unsigned index, bool sorted, usage_node_t** nodes)
+{
+	unsigned num_nodes = 1;
+	*nodes = (usage_node_t*) calloc(1, sizeof(usage_node_t));
+	(*nodes)[0].is_dir = true;
+	(*nodes)[0].sorted = sorted;
+	(*nodes)[0].parent = -1;
+	(*nodes)[0].first_block = index;
+
+	unsigned* leaves = (unsigned*) malloc(NUM_CLUSTER * sizeof(unsigned));
+	unsigned* index_nodes = (unsigned*) malloc(NUM_CLUSTER * sizeof(unsigned));
+	unsigned level_start = 0, level_end = 1;
+	while (level_start < level_end)
+	{
+		// Busca antecipadamente todos os clusters de diretório do nível (de um diretório ordenado, todas as folhas).
+		unsigned* blocks = NULL;
+		unsigned* num_dirs = (unsigned*) calloc(level_end - level_start, sizeof(unsigned));
+		unsigned num_blocks = 0;
+		for (unsigned n = level_start; n < level_end; n++)
+		{
+			if (!(*nodes)[n].is_dir || (*nodes)[n].first_block == 0x00)
+				continue;
+
+			unsigned num_leaves = 1, num_index_nodes = 0;
+			leaves[0] = (*nodes)[n].first_block;
+			if ((*nodes)[n].sorted)
+			{
+				// Os nós do índice contam como clusters do diretório (a raiz já foi contada, no lugar do cluster de um diretório comum).
+				num_leaves = 0;
+				sorted_collect((*nodes)[n].first_block, "", leaves, &num_leaves, index_nodes, &num_index_nodes);
+				(*nodes)[n].clusters += num_leaves + num_index_nodes - 1;
+			}
+
+			blocks = (unsigned*) realloc(blocks, (num_blocks + num_leaves) * sizeof(unsigned));
+			memcpy(&blocks[num_blocks], leaves, num_leaves * sizeof(unsigned));
+			num_blocks += num_leaves;
+			num_dirs[n - level_start] = num_leaves;
+		}
+
+		data_cluster* clusters = (data_cluster*) malloc((num_blocks + 1) * sizeof(data_cluster));
+		read_cluster_batch(blocks, num_blocks, clusters);
+
+		unsigned batch_position = 0;
+		for (unsigned n = level_start; n < level_end; n++)
+		{
+			if (!(*nodes)[n].is_dir)
+				continue;
+
+			(*nodes)[n].first_child = num_nodes;
+			unsigned dirs = (*nodes)[n].first_block == 0x00 ? 1 : num_dirs[n - level_start];
+			for (unsigned d = 0; d < dirs; d++)
+			{
+				dir_entry_t* dir = root_dir;
+				if ((*nodes)[n].first_block != 0x00)
+					dir = clusters[batch_position++].dir;
+
+				// Em um diretório ordenado, cada folha é percorrida em ordem de nome; nos demais, na ordem das entradas.
+				unsigned char order[32];
+				unsigned count = 0;
+				if ((*nodes)[n].sorted)
+					count = entries_by_name(dir, order);
+				else for (int i = 0; i < 32; i++)
+					if (dir[i].first_block != 0x00 && !is_inline_slot(&dir[i]))
+						order[count++] = i;
+
+				for (unsigned k = 0; k < count; k++)
+				{
+					unsigned i = order[k];
+					*nodes = (usage_node_t*) realloc(*nodes, (num_nodes + 1) * sizeof(usage_node_t));
+					usage_node_t* child = &(*nodes)[num_nodes];
+					memset(child, 0x00, sizeof(usage_node_t));
+					snprintf(child->name, sizeof(child->name), "%.17s", dir[i].filename);
+					child->is_dir = dir[i].attributes == 0x1;
+					child->sorted = child->is_dir && (dir[i].reserved[0] & ENTRY_SORTED);
+					child->parent = n;
+					child->first_block = dir[i].first_block;
+
+					// Diretórios ocupam um cluster; arquivos, o tamanho de sua cadeia na FAT (nenhum, se embutidos no diretório).
+					child->clusters = 1;
+					if (!child->is_dir)
+					{
+						child->bytes = dir[i].size;
+						if (dir[i].reserved[0] & ENTRY_INLINE)
+							child->clusters = 0;
+						else for (unsigned block = dir[i].first_block; fat_get(block) != 0xffff && fat_get(block) != 0x00 && child->clusters < NUM_CLUSTER; block = fat_get(block))
+							child->clusters++;
+					}
+
+					(*nodes)[n].num_children++;
+					num_nodes++;
+				}
+			}
+		}
+
+		free(num_dirs);
+		free(blocks);
+		free(clusters);
+		level_start = level_end;
+		level_end = num_nodes;
+	}
+
+	free(leaves);
+	free(index_nodes);
+
+	// Em largura os filhos sempre vêm depois dos pais: percorrendo de trás para frente, cada subárvore já está somada ao chegar no pai.
+	for (unsigned n = num_nodes - 1; n > 0; n--)
+	{
+		(*nodes)[(*nodes)[n].parent].bytes += (*nodes)[n].bytes;
+		(*nodes)[(*nodes)[n].parent].clusters += (*nodes)[n].clusters;
+	}
+
+	return num_nodes;
+}
+
+// Lê um conjunto de clusters com uma única abertura do arquivo, em ordem de disco e agrupando os trechos contíguos.
+void read_cluster_batch(unsigned* blocks, unsigned num_blocks, data_cluster* clusters)
+{
+	if (num_blocks == 0)
+		return;
+
+	// Os clusters que estão no cache saem dele; a camada de dispositivo ordena os demais e junta os trechos contíguos em uma única operação.
+	cluster_io_t* reads = (cluster_io_t*) malloc(num_blocks * sizeof(cluster_io_t));
+	unsigned num_reads = 0;
+	for (unsigned i = 0; i < num_blocks; i++)
+	{
+		if (cache_lookup(blocks[i], &clusters[i]))
+			continue;
+
+		reads[num_reads].block = blocks[i];
+		reads[num_reads].buffer = &clusters[i];
+		num_reads++;
+	}
+
+	device_read_clusters(reads, num_reads);
+	free(reads);
+}
+
+// Mostra o caminho de um nó: o caminho passado pelo usuário seguido dos nomes a partir da raiz da subárvore.
+void print_usage_path(usage_node_t* nodes, int node, path_t* path)
+{
+	if (nodes[node].parent == -1)
+	{
+		for (unsigned i = 0; i < path->size; i++)
+			fprintf(stdout, "/%s", path->components[i].name);
+		return;
+	}
+
+	print_usage_path(nodes, nodes[node].parent, path);
+	fprintf(stdout, "/%s", nodes[node].name);
+}
+
+// Mostra a subárvore em profundidade, indentada, com o tamanho de cada entrada.
+void print_usage_tree(usage_node_t* nodes, unsigned node, unsigned depth)
+{
+	for (unsigned i = 0; i < depth; i++)
+		fprintf(stdout, "    ");
+
+	if (depth == 0)
+		fprintf(stdout, ".");
+	else
+		fprintf(stdout, "%s%s", nodes[node].name, nodes[node].is_dir ? "/" : "");
+
+	fprintf(stdout, " (%llu bytes, %u clusters)\n", nodes[node].bytes, nodes[node].clusters);
+
+	if (nodes[node].is_dir)
+		for (unsigned child = 0; child < nodes[node].num_children; child++)
+			print_usage_tree(nodes, nodes[node].first_child + child, depth + 1);
+}
+
+void init(void)
+{
+	FILE* ptr_file;
+	int i;
+
+	// Nenhuma gravação da imagem anterior pode chegar depois de ela ser recriada.
+	if (is_fs_loaded)
+		close_volume();
+
+	ptr_file = fopen(fat_name,"wb");
+	if (ptr_file == NULL)
+	{
+		fprintf(stderr, "Não foi possível abrir o arquivo %s.\n", fat_name);
+		exit(EXIT_FAILURE);
+	}
+	memset(boot_block, 0x00, sizeof(boot_block));
+	for (i = 0; i < 2; ++i)
+		boot_block[i] = 0xbb;
+
+	fat[0] = 0xfffd;
+	for (i = 1; i < 9; ++i)
+		fat[i] = 0xfffe;
+
+	fat[9] = 0xffff;
+	for (i = 10; i < NUM_CLUSTER; ++i)
+		fat[i] = 0x0000;
+
+	// A FAT inteira está em memória, e o volume já nasce aberto (resumo com clean = 0).
+	for (i = 0; i < FAT_SECTORS; ++i)
+		fat_sector_loaded[i] = true;
+	memset(cluster_pins, 0x00, sizeof(cluster_pins));
+	memset(root_dir, 0x00, sizeof(root_dir));
+	volume_generation++;
+	count_usage();
+
+	fwrite(&boot_block, sizeof(boot_block), 1,ptr_file);
+	fwrite(&fat, sizeof(fat), 1, ptr_file);
+	fwrite(&root_dir, sizeof(root_dir), 1,ptr_file);
+
+	// Somente os metadados são escritos; os clusters de dados viram um buraco no arquivo esparso, lido como zeros.
+	fflush(ptr_file);
+	if (ftruncate(fileno(ptr_file), (off_t) NUM_CLUSTER * CLUSTER_SIZE) != 0)
+	{
+		fprintf(stderr, "Não foi possível redimensionar o arquivo %s.\n", fat_name);
+		exit(EXIT_FAILURE);
+	}
+
+	fclose(ptr_file);
+	open_device();
+	memcpy(metadata_on_disk, fat, sizeof(fat));
+	write_volume_summary(false);
+
+	// Nenhum cluster é compartilhado em um sistema de arquivos novo, e os snapshots do anterior são descartados.
+	memset(cluster_refs, 0x00, sizeof(cluster_refs));
+	cluster_refs_changed = false;
+	remove(fat_name ref_suffix);
+	remove(fat_name snap_suffix);
+	remove(fat_name dedup_suffix);
+	load_dedup_index();
+}
+
+void load()
+{
+	FILE* ptr_file;
+	int i;
+
+	// As alterações pendentes vão para o disco antes de a imagem ser lida de novo.
+	if (is_fs_loaded)
+		close_volume();
+
+	ptr_file = fopen(fat_name, "rb");
+	if (ptr_file == NULL)
+	{
+		fprintf(stderr, "Não foi possível abrir o arquivo %s.\n", fat_name);
+		exit(EXIT_FAILURE);
+	}
+	fread(boot_block, sizeof(boot_block), 1, ptr_file); // Lê o boot block, com o resumo do volume.
+	fseek(ptr_file, sizeof(fat), SEEK_CUR); // Pula a FAT, lida por setor quando for usada.
+	fread(root_dir, sizeof(root_dir), 1, ptr_file); // Lê o root_dir.
+	fclose(ptr_file);
+	open_device();
+
+	memset(fat, 0x00, sizeof(fat));
+	memset(fat_sector_loaded, 0x00, sizeof(fat_sector_loaded));
+	memcpy(metadata_on_disk + sizeof(fat), root_dir, sizeof(root_dir));
+	volume_generation++;
+
+	// A tabela de referências só existe depois que algum clone foi criado.
+	memset(cluster_refs, 0x00, sizeof(cluster_refs));
+	cluster_refs_changed = false;
+	ptr_file = fopen(fat_name ref_suffix, "rb");
+	if (ptr_file != NULL)
+	{
+		fread(cluster_refs, sizeof(cluster_refs), 1, ptr_file);
+		fclose(ptr_file);
+	}
+
+	load_snapshot_pins();
+	load_dedup_index();
+
+	// Com o resumo de um volume fechado corretamente, nada mais é lido agora: o mapa de clusters livres é refeito em segundo plano.
+	// Sem ele (queda, imagem antiga), os contadores e o mapa são recalculados percorrendo a FAT e a árvore.
+	volume_summary_t summary;
+	memcpy(&summary, boot_block + SUMMARY_OFFSET, sizeof(summary));
+	if (summary.magic == SUMMARY_MAGIC && summary.clean == 1)
+	{
+		free_clusters = summary.free_clusters;
+		used_bytes = summary.used_bytes;
+		next_free_hint = summary.next_free;
+		free_map_ready = false;
+		memset(free_map, 0x00, sizeof(free_map));
+
+		pthread_t thread;
+		pthread_create(&thread, NULL, free_map_thread, (void*) (uintptr_t) volume_generation);
+		pthread_detach(thread);
+	}
+	else
+		count_usage();
+
+	// Até ser fechado, o volume fica marcado no disco como aberto.
+	if (!write_volume_summary(false) || fdatasync(metadata_fd) != 0)
+		fprintf(stderr, "Não foi possível gravar o resumo do volume.\n");
+}
+
+// Os metadados (FAT, root_dir e tabelas auxiliares) são gravados pelo flusher; aqui apenas se registra que mudaram.
+void save()
+{
+	metadata_dirty = true;
+}
+
+void get_data_cluster(unsigned index, data_cluster* cluster)
+{
+	cache_read(index, cluster); // Lê o cluster (do cache, se estiver nele) e coloca no union.
+}
+
+void save_data_cluster(unsigned index, data_cluster* cluster)
+{
+	cache_write(index, cluster); // Escreve o union no cluster.
+}
+
+// Copia o conteúdo de um cluster para outro (cópias de clusters compartilhados).
+void copy_data_cluster(unsigned source, unsigned destination)
+{
+	data_cluster cluster;
+	cache_read(source, &cluster);
+	cache_write(destination, &cluster);
+}
+
+unsigned short fat_get(unsigned index)
+{
+	unsigned sector = index / FAT_ENTRIES_BY_SECTOR;
+	if (!__atomic_load_n(&fat_sector_loaded[sector], __ATOMIC_ACQUIRE))
+		load_fat_sector(sector);
+
+	return fat[index];
+}
+
+// Altera uma entrada da FAT, mantendo o mapa de clusters livres.
+void fat_set(unsigned index, unsigned short value)
+{
+	unsigned sector = index / FAT_ENTRIES_BY_SECTOR;
+	if (!__atomic_load_n(&fat_sector_loaded[sector], __ATOMIC_ACQUIRE))
+		load_fat_sector(sector);
+
+	fat[index] = value;
+	set_free_map(index, index >= 10 && value == 0x00 && cluster_pins[index] == 0);
+}
+
+// Lê um setor da FAT do disco, guardando também a cópia usada para comparar na gravação. Precisa de volume_lock (compartilhado basta).
+void load_fat_sector(unsigned sector)
+{
+	pthread_mutex_lock(&fat_sector_lock);
+	if (!fat_sector_loaded[sector])
+	{
+		uint8_t* position = (uint8_t*) fat + sector * SECTOR_SIZE;
+		if (pread(metadata_fd, position, SECTOR_SIZE, sizeof(boot_block) + sector * SECTOR_SIZE) != SECTOR_SIZE)
+		{
+			fprintf(stderr, "Não foi possível ler a FAT do arquivo %s.\n", fat_name);
+			exit(EXIT_FAILURE);
+		}
+
+		memcpy(&metadata_on_disk[sector * SECTOR_SIZE], position, SECTOR_SIZE);
+		__atomic_store_n(&fat_sector_loaded[sector], true, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&fat_sector_lock);
+}
+
+// Para quem copia a FAT inteira de uma vez (snapshots).
+void load_full_fat()
+{
+	for (unsigned sector = 0; sector < FAT_SECTORS; sector++)
+		if (!__atomic_load_n(&fat_sector_loaded[sector], __ATOMIC_ACQUIRE))
+			load_fat_sector(sector);
+}
+
+// Refaz o mapa de clusters livres depois de um load, um setor da FAT de cada vez, para que um comando nunca espere mais que a
+// leitura de um setor. Termina sem terminar o mapa caso outro volume seja carregado.
+void* free_map_thread(void* arg)
+{
+	unsigned generation = (unsigned) (uintptr_t) arg;
+	for (unsigned sector = 0; sector < FAT_SECTORS; sector++)
+	{
+		pthread_rwlock_wrlock(&volume_lock);
+		if (volume_generation != generation)
+		{
+			pthread_rwlock_unlock(&volume_lock);
+			return NULL;
+		}
+
+		rebuild_free_map_sector(sector);
+		if (sector == FAT_SECTORS - 1)
+			free_map_ready = true;
+		pthread_rwlock_unlock(&volume_lock);
+	}
+
+	return NULL;
+}
+
+// Grava o resumo do volume no boot block (apenas o primeiro setor, onde ele fica).
+bool write_volume_summary(bool clean)
+{
+	volume_summary_t summary;
+	memset(&summary, 0x00, sizeof(summary));
+	summary.magic = SUMMARY_MAGIC;
+	summary.free_clusters = free_clusters;
+	summary.used_bytes = used_bytes;
+	summary.next_free = next_free_hint < NUM_CLUSTER ? next_free_hint : 10;
+	summary.clean = clean ? 1 : 0;
+	memcpy(boot_block + SUMMARY_OFFSET, &summary, sizeof(summary));
+
+	return metadata_fd < 0 || pwrite(metadata_fd, boot_block, SECTOR_SIZE, 0) == SECTOR_SIZE;
+}
+
+// Grava todas as alterações e só então marca o volume como fechado, para o próximo load confiar no resumo.
+bool close_volume()
+{
+	if (!sync_volume(true))
+		return false;
+
+	return write_volume_summary(true) && fdatasync(metadata_fd) == 0;
+}
+
+// Abre a imagem na camada de dispositivo, usada por todas as leituras e escritas de clusters de dados, e esvazia o cache.
+void open_device()
+{
+	if (!device_open(fat_name))
+	{
+		fprintf(stderr, "Não foi possível abrir o arquivo %s.\n", fat_name);
+		exit(EXIT_FAILURE);
+	}
+
+	if (metadata_fd >= 0)
+		close(metadata_fd);
+	metadata_fd = open(fat_name, O_RDWR);
+	if (metadata_fd < 0)
+	{
+		fprintf(stderr, "Não foi possível abrir o arquivo %s.\n", fat_name);
+		exit(EXIT_FAILURE);
+	}
+
+	cache_reset(chain_successor, request_writeback);
+	memcpy(metadata_on_disk + sizeof(fat), root_dir, sizeof(root_dir));
+
+	if (!writeback_started)
+	{
+		pthread_t thread;
+		pthread_create(&thread, NULL, writeback_thread, NULL);
+		pthread_detach(thread);
+		writeback_started = true;
+	}
+}
+
+// Próximo cluster da cadeia para a leitura antecipada do cache (0xffff no fim ou em valores que não são clusters de dados).
+unsigned chain_successor(unsigned block)
+{
+	unsigned next_block = fat_get(block);
+	return next_block < 10 || next_block >= NUM_CLUSTER ? 0xffff : next_block;
+}
+
+// Pede ao cache, sem esperar, os clusters dos subdiretórios de um diretório que está sendo percorrido.
+void prefetch_subdirectories(dir_entry_t* dir, unsigned num_entries)
+{
+	// cache_prefetch lê no máximo metade do cache de uma vez.
+	unsigned blocks[CACHE_CLUSTERS / 2];
+	unsigned num_blocks = 0;
+	for (unsigned i = 0; i < num_entries && num_blocks < CACHE_CLUSTERS / 2; i++)
+		if (dir[i].first_block != 0x00 && dir[i].attributes == 0x1)
+			blocks[num_blocks++] = dir[i].first_block;
+
+	cache_prefetch(blocks, num_blocks);
+}
+
+// Grava agora todas as alterações pendentes (com durable, garantindo que cheguem ao meio físico), esperando a gravação do
+// flusher em andamento. Serve também de ponto de ordenação: nada alterado depois da chamada chega ao disco antes do que veio antes.
+// Quem chama precisa estar com volume_lock (exclusivo, ou compartilhado com allocation_lock no modo servidor).
+bool sync_volume(bool durable)
+{
+	pthread_mutex_lock(&writeback_lock);
+	writeback_collect();
+	bool success = writeback_write();
+	if (durable)
+		success = device_sync() && success;
+	pthread_mutex_unlock(&writeback_lock);
+
+	return success;
+}
+
+// Pedido do cache: acorda o flusher (muitos clusters alterados) ou, quando não há mais o que substituir, grava na hora. A gravação
+// imediata só é pedida por cache_write, sem cache_lock, por quem altera o volume e portanto já o tem como sync_volume exige.
+void request_writeback(bool wait)
+{
+	if (wait)
+		sync_volume(false);
+	else
+	{
+		pthread_mutex_lock(&writeback_wakeup_lock);
+		pthread_cond_signal(&writeback_wakeup);
+		pthread_mutex_unlock(&writeback_wakeup_lock);
+	}
+}
+
+// Flusher: a cada WRITEBACK_INTERVAL_MS, ou quando o cache pede, coleta as alterações entre dois comandos e as grava sem
+// segurar o volume, de forma que o próximo comando não espera pelo disco.
+void* writeback_thread(void* arg)
+{
+	while (true)
+	{
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += WRITEBACK_INTERVAL_MS * 1000000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+
+		pthread_mutex_lock(&writeback_wakeup_lock);
+		pthread_cond_timedwait(&writeback_wakeup, &writeback_wakeup_lock, &deadline);
+		pthread_mutex_unlock(&writeback_wakeup_lock);
+
+		pthread_rwlock_wrlock(&volume_lock);
+		if (!is_fs_loaded || (!metadata_dirty && cache_dirty_count() == 0))
+		{
+			pthread_rwlock_unlock(&volume_lock);
+			continue;
+		}
+
+		pthread_mutex_lock(&writeback_lock);
+		writeback_collect();
+		pthread_rwlock_unlock(&volume_lock);
+
+		if (!writeback_write())
+			fprintf(stderr, "Não foi possível gravar as alterações no disco.\n");
+
+		pthread_mutex_unlock(&writeback_lock);
+	}
+
+	return NULL;
+}
+
+// Copia as alterações pendentes para writeback. Precisa de volume_lock e de writeback_lock.
+void writeback_collect()
+{
+	writeback.num_clusters = cache_collect_dirty(writeback.ios, writeback.clusters, &writeback.generation);
+
+	if (metadata_dirty)
+	{
+		memcpy(writeback.metadata, fat, sizeof(fat));
+		memcpy(writeback.metadata + sizeof(fat), root_dir, sizeof(root_dir));
+		memcpy(writeback.fat_sectors, fat_sector_loaded, sizeof(fat_sector_loaded));
+		writeback.metadata_changed = true;
+		metadata_dirty = false;
+	}
+
+	if (cluster_refs_changed)
+	{
+		memcpy(writeback.cluster_refs, cluster_refs, sizeof(cluster_refs));
+		writeback.refs_changed = true;
+		cluster_refs_changed = false;
+	}
+
+	if (dedup_enabled && cluster_digests_changed)
+	{
+		memcpy(writeback.cluster_digests, cluster_digests, sizeof(cluster_digests));
+		writeback.digests_changed = true;
+		cluster_digests_changed = false;
+	}
+}
+
+// Grava o que foi coletado: primeiro os clusters de dados (ordenados e agrupados pela camada de dispositivo), depois os setores
+// alterados da FAT e do root_dir, que podem apontar para eles, e por último as tabelas auxiliares. Precisa apenas de writeback_lock.
+bool writeback_write()
+{
+	bool success = true;
+	if (writeback.num_clusters > 0)
+	{
+		success = device_write_clusters(writeback.ios, writeback.num_clusters);
+		writeback.num_clusters = 0;
+	}
+	cache_writeback_done(writeback.generation);
+
+	if (writeback.metadata_changed)
+	{
+		success = write_metadata_sectors() && success;
+		writeback.metadata_changed = false;
+	}
+
+	FILE* ptr_file;
+	if (writeback.refs_changed)
+	{
+		ptr_file = fopen(fat_name ref_suffix, "wb");
+		if (ptr_file == NULL)
+		{
+			fprintf(stderr, "Não foi possível abrir o arquivo %s.\n", fat_name ref_suffix);
+			exit(EXIT_FAILURE);
+		}
+		fwrite(writeback.cluster_refs, sizeof(unsigned short), NUM_CLUSTER, ptr_file); // Escreve a tabela de referências.
+		fclose(ptr_file);
+		writeback.refs_changed = false;
+	}
+
+	if (writeback.digests_changed)
+	{
+		ptr_file = fopen(fat_name dedup_suffix, "wb");
+		if (ptr_file == NULL)
+		{
+			fprintf(stderr, "Não foi possível abrir o arquivo %s.\n", fat_name dedup_suffix);
+			exit(EXIT_FAILURE);
+		}
+		fwrite(writeback.cluster_digests, sizeof(uint32_t), NUM_CLUSTER, ptr_file); // Escreve o índice de deduplicação.
+		fclose(ptr_file);
+		writeback.digests_changed = false;
+	}
+
+	return success;
+}
+
+// Grava somente os setores da FAT e do root_dir que mudaram desde a última gravação, juntando setores vizinhos em uma única escrita.
+bool write_metadata_sectors()
+{
+	int fd = open(fat_name, O_RDWR);
+	if (fd < 0)
+		return false;
+
+	bool success = true;
+	unsigned num_sectors = sizeof(writeback.metadata) / SECTOR_SIZE;
+	unsigned sector = 0;
+	while (sector < num_sectors)
+	{
+		if (!metadata_sector_changed(sector))
+		{
+			sector++;
+			continue;
+		}
+
+		unsigned first = sector;
+		while (sector < num_sectors && metadata_sector_changed(sector))
+			sector++;
+
+		size_t length = (sector - first) * SECTOR_SIZE;
+		if (pwrite(fd, &writeback.metadata[first * SECTOR_SIZE], length, sizeof(boot_block) + first * SECTOR_SIZE) == (ssize_t) length)
+			memcpy(&metadata_on_disk[first * SECTOR_SIZE], &writeback.metadata[first * SECTOR_SIZE], length);
+		else
+			success = false;
+	}
+
+	close(fd);
+	return success;
+}
+
+// Setor coletado diferente do que está na imagem. Os setores da FAT que ainda não tinham sido lidos do disco não mudaram.
+bool metadata_sector_changed(unsigned sector)
+{
+	if (sector < FAT_SECTORS && !writeback.fat_sectors[sector])
+		return false;
+
+	return memcmp(&writeback.metadata[sector * SECTOR_SIZE], &metadata_on_disk[sector * SECTOR_SIZE], SECTOR_SIZE) != 0;
+}
+
+void discard_data_cluster(unsigned index)
+{
+	int fd = open(fat_name, O_RDWR);
+	if (fd < 0)
+	{
+		fprintf(stderr, "Não foi possível abrir o arquivo %s.\n", fat_name);
+		exit(EXIT_FAILURE);
+	}
+
+	cache_invalidate(index);
+
+	// Devolve o cluster ao sistema de arquivos do host (volta a ser lido como zeros). Sem suporte a buracos, zera-o explicitamente.
+	off_t offset = (10 + index) * sizeof(data_cluster);
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, sizeof(data_cluster)) != 0)
+	{
+		data_cluster cluster;
+		memset(cluster.data, 0x00, CLUSTER_SIZE);
+		pwrite(fd, &cluster, sizeof(data_cluster), offset);
+	}
+
+	close(fd);
+}
+
+bool defrag(unsigned* moved, bool* interrupted, unsigned* return_info)
+{
+	defrag_context_t* context = (defrag_context_t*) calloc(1, sizeof(defrag_context_t));
+	for (int i = 0; i < NUM_CLUSTER; i++)
+		context->rank[i] = -1;
+
+	// Ordem ótima: cada diretório seguido de suas entradas, e cada cadeia contígua, a partir do primeiro cluster de dados.
+	defrag_collect(context, 0x00);
+
+	// Clusters compartilhados por clones têm mais de um dono e não são movidos; as posições ocupadas por eles são puladas.
+	unsigned cursor = 10;
+	for (unsigned t = 0; t < context->order_size; t++)
+	{
+		while (cursor < NUM_CLUSTER && is_shared_cluster(cursor))
+			cursor++;
+		context->position[t] = cursor++;
+	}
+
+	// Ctrl-C apenas sinaliza; a movimentação em andamento é concluída antes de parar.
+	struct sigaction action, old_action;
+	memset(&action, 0x00, sizeof(action));
+	action.sa_handler = defrag_signal_handler;
+	sigemptyset(&action.sa_mask);
+	defrag_interrupted = 0;
+	sigaction(SIGINT, &action, &old_action);
+
+	bool success = true;
+	for (unsigned t = 0; t < context->order_size && success; t++)
+	{
+		if (defrag_interrupted)
+		{
+			*interrupted = true;
+			break;
+		}
+
+		unsigned target = context->position[t];
+		unsigned block = context->order[t];
+
+		// Cluster já está na posição certa (inclusive os colocados por uma execução anterior interrompida).
+		if (block == target)
+			continue;
+
+		// A posição está ocupada por um cluster que vem depois na ordem (ou que não pertence à árvore): tira-o do caminho,
+		// levando-o diretamente para sua própria posição final quando ela estiver livre.
+		if (fat_get(target) != 0x00)
+		{
+			unsigned spare = 0x00;
+			if (context->rank[target] >= 0 && fat_get(context->position[context->rank[target]]) == 0x00)
+				spare = context->position[context->rank[target]];
+			else
+				spare = get_available_cluster();
+
+			if (spare == 0x00)
+			{
+				*return_info = BLOATED_SYSTEM;
+				success = false;
+				break;
+			}
+
+			defrag_move(context, target, spare);
+			(*moved)++;
+		}
+
+		defrag_move(context, block, target);
+		(*moved)++;
+	}
+
+	sigaction(SIGINT, &old_action, NULL);
+	free(context);
+	return success;
+}
+
+// Percorre a árvore em pré-ordem registrando a ordem desejada, o dono de cada cluster e as ligações descontínuas.
+void defrag_collect(defrag_context_t* context, unsigned dir_block)
+{
+	data_cluster cluster;
+	dir_entry_t* dir = root_dir;
+	if (dir_block != 0x00)
+	{
+		get_data_cluster(dir_block, &cluster);
+		dir = cluster.dir;
+	}
+
+	for (int i = 0; i < 32; i++)
+	{
+		unsigned block = dir[i].first_block;
+		if (block == 0x00 || block >= NUM_CLUSTER || context->rank[block] >= 0)
+			continue;
+
+		// Cadeias compartilhadas ficam onde estão; somente a parte exclusiva de cada arquivo entra na ordem.
+		context->owner[block].type = dir_block == 0x00 ? OWNER_ROOT : OWNER_DIR;
+		context->owner[block].block = dir_block;
+		context->owner[block].slot = i;
+
+		bool fragmented = false;
+		while (!is_shared_cluster(block))
+		{
+			context->rank[block] = context->order_size;
+			context->order[context->order_size++] = block;
+
+			unsigned next_block = fat_get(block);
+			if (next_block == 0xffff || next_block == 0x00 || next_block >= NUM_CLUSTER || context->rank[next_block] >= 0)
+				break;
+
+			context->owner[next_block].type = OWNER_FAT;
+			context->owner[next_block].block = block;
+			context->links++;
+			if (next_block != block + 1)
+			{
+				context->broken_links++;
+				fragmented = true;
+			}
+
+			block = next_block;
+		}
+
+		// Um diretório compartilhado com snapshots não pode ser alterado, então suas entradas (também compartilhadas) ficam onde estão.
+		if (dir[i].attributes == 0x1 && (dir[i].reserved[0] & ENTRY_SORTED))
+		{
+			context->is_index[dir[i].first_block] = true;
+			if (!is_shared_cluster(dir[i].first_block))
+				defrag_collect_index(context, dir[i].first_block);
+		}
+		else if (dir[i].attributes == 0x1)
+		{
+			context->is_dir[dir[i].first_block] = true;
+			if (!is_shared_cluster(dir[i].first_block))
+				defrag_collect(context, dir[i].first_block);
+		}
+		else
+		{
+			context->files++;
+			if (fragmented)
+				context->fragmented_files++;
+		}
+	}
+}
+
+// Parte da pré-ordem de um diretório ordenado: cada filho de um nó do índice (outro nó ou uma folha) vem seguido da sua subárvore.
+void defrag_collect_index(defrag_context_t* context, unsigned node_block)
+{
+	data_cluster node;
+	get_data_cluster(node_block, &node);
+	for (unsigned k = 0; k < node.node.count && k < SORTED_FANOUT; k++)
+	{
+		unsigned block = node.node.keys[k].block;
+		if (block < 10 || block >= NUM_CLUSTER || context->rank[block] >= 0)
+			continue;
+
+		context->owner[block].type = OWNER_INDEX;
+		context->owner[block].block = node_block;
+		context->owner[block].slot = k;
+
+		// Como nos diretórios comuns, o que ainda pertence a snapshots fica onde está.
+		if (is_shared_cluster(block))
+			continue;
+
+		context->rank[block] = context->order_size;
+		context->order[context->order_size++] = block;
+		if (node.node.level > 1)
+		{
+			context->is_index[block] = true;
+			defrag_collect_index(context, block);
+		}
+		else
+		{
+			context->is_dir[block] = true;
+			defrag_collect(context, block);
+		}
+	}
+}
+
+// Move um cluster e atualiza quem aponta para ele. Cada etapa é gravada de forma que uma interrupção no meio no máximo vaze um cluster.
+void defrag_move(defrag_context_t* context, unsigned source, unsigned destination)
+{
+	data_cluster cluster;
+	get_data_cluster(source, &cluster);
+	save_data_cluster(destination, &cluster);
+
+	// Reserva o destino antes de qualquer ponteiro ser apontado para ele. O resumo do conteúdo acompanha o cluster.
+	fat_set(destination, fat_get(source));
+	dedup_forget(destination);
+	if (cluster_digests[source] != 0)
+		dedup_remember(destination, cluster_digests[source]);
+	dedup_forget(source);
+	save();
+	sync_volume(false);
+
+	cluster_owner_t owner = context->owner[source];
+	if (owner.type == OWNER_FAT)
+		fat_set(owner.block, destination);
+	else if (owner.type == OWNER_ROOT)
+		root_dir[owner.slot].first_block = destination;
+	else if (owner.type == OWNER_DIR)
+	{
+		data_cluster dir;
+		get_data_cluster(owner.block, &dir);
+		dir.dir[owner.slot].first_block = destination;
+		save_data_cluster(owner.block, &dir);
+	}
+	else if (owner.type == OWNER_INDEX)
+	{
+		data_cluster node;
+		get_data_cluster(owner.block, &node);
+		node.node.keys[owner.slot].block = destination;
+		save_data_cluster(owner.block, &node);
+	}
+
+	fat_set(source, 0x00);
+	save();
+	sync_volume(false);
+	discard_data_cluster(source);
+
+	// Atualiza os mapas: o cluster seguinte da cadeia e, no caso de diretórios, as entradas contidas nele mudam de dono.
+	context->owner[destination] = owner;
+	context->owner[source].type = OWNER_NONE;
+
+	unsigned next_block = fat_get(destination);
+	if (next_block != 0xffff && next_block != 0x00 && next_block < NUM_CLUSTER)
+		context->owner[next_block].block = destination;
+
+	if (context->is_dir[source])
+	{
+		context->is_dir[source] = false;
+		context->is_dir[destination] = true;
+		for (int i = 0; i < 32; i++)
+		{
+			unsigned child = cluster.dir[i].first_block;
+			if (child != 0x00 && child < NUM_CLUSTER && context->owner[child].type == OWNER_DIR)
+				context->owner[child].block = destination;
+		}
+	}
+
+	if (context->is_index[source])
+	{
+		context->is_index[source] = false;
+		context->is_index[destination] = true;
+		for (unsigned k = 0; k < cluster.node.count && k < SORTED_FANOUT; k++)
+		{
+			unsigned child = cluster.node.keys[k].block;
+			if (child < NUM_CLUSTER && context->owner[child].type == OWNER_INDEX)
+				context->owner[child].block = destination;
+		}
+	}
+
+	context->rank[destination] = context->rank[source];
+	context->rank[source] = -1;
+	if (context->rank[destination] >= 0)
+		context->order[context->rank[destination]] = destination;
+}
+
+void defrag_signal_handler(int signal)
+{
+	defrag_interrupted = 1;
+}
+
+// Pontuação de fragmentação: ligações da FAT que não apontam para o cluster seguinte no disco.
+void fragmentation_score(unsigned* links, unsigned* broken_links, unsigned* files, unsigned* fragmented_files)
+{
+	defrag_context_t* context = (defrag_context_t*) calloc(1, sizeof(defrag_context_t));
+	for (int i = 0; i < NUM_CLUSTER; i++)
+		context->rank[i] = -1;
+
+	defrag_collect(context, 0x00);
+
+	*links = context->links;
+	*broken_links = context->broken_links;
+	*files = context->files;
+	*fragmented_files = context->fragmented_files;
+	free(context);
+}
+
+bool check_file_existence()
+{
+	if (access(fat_name, F_OK) != -1)
+		return true;
+	else
+		return false;
+}
+
+// Modo servidor: mantém o volume carregado (com o cache aquecido) e atende pedidos de vários clientes pelo socket Unix, no
+// protocolo de protocol.h. Cada conexão tem uma thread que lê os pedidos e os coloca na fila dela; MAX_WORKERS workers os
+// executam, um pedido de cada conexão por vez.
+bool serve(char* socket_path)
+{
+	if (!check_file_existence())
+	{
+		fprintf(stderr, "Arquivo %s não encontrado.\n", fat_name);
+		return false;
+	}
+
+	struct sockaddr_un address;
+	memset(&address, 0x00, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(address.sun_path))
+	{
+		fprintf(stderr, "Caminho do socket muito longo.\n");
+		return false;
+	}
+	strcpy(address.sun_path, socket_path);
+
+	// SIGINT e SIGTERM só são recebidos pela thread principal enquanto ela espera conexões; as demais nascem com eles bloqueados.
+	sigset_t blocked, original;
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGINT);
+	sigaddset(&blocked, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &blocked, &original);
+
+	struct sigaction action;
+	memset(&action, 0x00, sizeof(action));
+	action.sa_handler = server_signal_handler;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(socket_path);
+	if (listener < 0 || bind(listener, (struct sockaddr*) &address, sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0)
+	{
+		fprintf(stderr, "Não foi possível abrir o socket %s.\n", socket_path);
+		return false;
+	}
+
+	pthread_rwlock_wrlock(&volume_lock);
+	load();
+	is_fs_loaded = true;
+	pthread_rwlock_unlock(&volume_lock);
+
+	for (unsigned i = 0; i < DIRECTORY_LOCKS; i++)
+		pthread_rwlock_init(&directory_locks[i], NULL);
+
+	for (unsigned i = 0; i < MAX_WORKERS; i++)
+	{
+		pthread_t thread;
+		pthread_create(&thread, NULL, server_worker_thread, NULL);
+		pthread_detach(thread);
+	}
+
+	fprintf(stdout, "Servindo %s em %s.\n", fat_name, socket_path);
+	fflush(stdout);
+
+	struct pollfd listener_poll = { listener, POLLIN, 0 };
+	while (!server_stopping)
+	{
+		if (ppoll(&listener_poll, 1, NULL, &original) <= 0)
+			continue;
+
+		int fd = accept(listener, NULL, NULL);
+		if (fd < 0)
+			continue;
+
+		connection_t* connection = (connection_t*) calloc(1, sizeof(connection_t));
+		connection->fd = fd;
+		connection->references = 1;
+		pthread_cond_init(&connection->room, NULL);
+
+		pthread_t thread;
+		pthread_create(&thread, NULL, server_connection_thread, connection);
+		pthread_detach(thread);
+	}
+
+	close(listener);
+	unlink(socket_path);
+
+	// Os pedidos em andamento terminam e tudo vai para o disco antes de sair.
+	pthread_rwlock_wrlock(&volume_lock);
+	return close_volume();
+}
+
+void server_signal_handler(int signal)
+{
+	server_stopping = 1;
+}
+
+// Lê os pedidos da conexão e os coloca na fila, sem esperar as respostas. Um pedido malformado encerra a conexão.
+void* server_connection_thread(void* arg)
+{
+	connection_t* connection = (connection_t*) arg;
+	while (true)
+	{
+		request_header_t header;
+		if (!read_full(connection->fd, &header, sizeof(header)) || header.path_length > MAX_REQUEST_PATH || header.data_length > MAX_REQUEST_DATA)
+			break;
+
+		request_t* request = (request_t*) calloc(1, sizeof(request_t));
+		request->connection = connection;
+		request->header = header;
+		request->path = (char*) malloc(header.path_length + 1);
+		request->data = (char*) malloc(header.data_length + 1);
+		if (!read_full(connection->fd, request->path, header.path_length) || !read_full(connection->fd, request->data, header.data_length))
+		{
+			free(request->path);
+			free(request->data);
+			free(request);
+			break;
+		}
+		request->path[header.path_length] = '\0';
+		request->data[header.data_length] = '\0';
+
+		__atomic_add_fetch(&connection->references, 1, __ATOMIC_ACQ_REL);
+		pthread_mutex_lock(&request_queue_lock);
+		// Com MAX_PENDING_REQUESTS pedidos pendentes, o próximo só é lido quando um deles terminar (o cliente espera no socket).
+		while (connection->pending >= MAX_PENDING_REQUESTS)
+			pthread_cond_wait(&connection->room, &request_queue_lock);
+
+		if (connection->tail == NULL)
+			connection->head = request;
+		else
+			connection->tail->next = request;
+		connection->tail = request;
+		connection->pending++;
+
+		// Se a conexão não tem pedido em execução nem está na fila, ela entra na fila de prontas.
+		if (!connection->scheduled)
+			schedule_connection(connection);
+		pthread_mutex_unlock(&request_queue_lock);
+	}
+
+	release_connection(connection);
+	return NULL;
+}
+
+// Cada worker executa o próximo pedido da primeira conexão pronta. A conexão volta ao fim da fila depois do pedido, se tiver
+// outros: os pedidos de uma conexão seguem a ordem de chegada, e os workers se dividem entre conexões diferentes.
+void* server_worker_thread(void* arg)
+{
+	while (true)
+	{
+		pthread_mutex_lock(&request_queue_lock);
+		while (ready_head == NULL)
+			pthread_cond_wait(&request_available, &request_queue_lock);
+
+		connection_t* connection = ready_head;
+		ready_head = connection->next_ready;
+		if (ready_head == NULL)
+			ready_tail = NULL;
+
+		request_t* request = connection->head;
+		connection->head = request->next;
+		if (connection->head == NULL)
+			connection->tail = NULL;
+		pthread_mutex_unlock(&request_queue_lock);
+
+		execute_request(request);
+
+		pthread_mutex_lock(&request_queue_lock);
+		connection->pending--;
+		pthread_cond_signal(&connection->room);
+		if (connection->head != NULL)
+			schedule_connection(connection);
+		else
+			connection->scheduled = false;
+		pthread_mutex_unlock(&request_queue_lock);
+
+		release_connection(connection);
+		free(request->path);
+		free(request->data);
+		free(request);
+	}
+
+	return NULL;
+}
+
+// Coloca a conexão no fim da fila de prontas e acorda um worker. Chamada com request_queue_lock.
+void schedule_connection(connection_t* connection)
+{
+	connection->scheduled = true;
+	connection->next_ready = NULL;
+	if (ready_tail == NULL)
+		ready_head = connection;
+	else
+		ready_tail->next_ready = connection;
+	ready_tail = connection;
+	pthread_cond_signal(&request_available);
+}
+
+void release_connection(connection_t* connection)
+{
+	if (__atomic_sub_fetch(&connection->references, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	close(connection->fd);
+	pthread_cond_destroy(&connection->room);
+	free(connection);
+}
+
+// Executa um pedido e envia a resposta: em caso de falha, status traz o código do erro e não há dados.
+void execute_request(request_t* request)
+{
+	path_t path;
+	unsigned return_info = 0, response_length = 0;
+	bool success = false;
+	char* response = NULL;
+
+	if (!parse_path(request->path, &path))
+		return_info = INVALID_DIR;
+	else
+	{
+		switch (request->header.op)
+		{
+			case OP_LOOKUP:
+				response = (char*) malloc(sizeof(dir_entry_t));
+				success = server_lookup(&path, (dir_entry_t*) response, &return_info);
+				response_length = sizeof(dir_entry_t);
+				break;
+			case OP_READ:
+				success = server_read(&path, &response, &return_info);
+				response_length = success ? strlen(response) : 0;
+				break;
+			case OP_LS:
+			{
+				unsigned num_entries = 0;
+				success = server_ls(&path, (dir_entry_t**) &response, &num_entries, &return_info);
+				response_length = num_entries * sizeof(dir_entry_t);
+				break;
+			}
+			case OP_WRITE:
+				// O write_file mede o conteúdo até o primeiro 0x00: um conteúdo com 0x00 seria gravado pela metade.
+				if (memchr(request->data, 0x00, request->header.data_length) != NULL)
+				{
+					return_info = INVALID_CONTENT;
+					break;
+				}
+				success = server_change(&path, request->header.op, request->data, &return_info);
+				break;
+			case OP_MKDIR:
+				success = server_change(&path, request->header.op, request->data, &return_info);
+				break;
+			default:
+				return_info = INVALID_REQUEST;
+		}
+	}
+
+	// Só um pedido da conexão é executado por vez: as respostas saem na ordem dos pedidos.
+	response_header_t header = { request->header.id, success ? STATUS_OK : return_info, success ? response_length : 0 };
+	if (write_full(request->connection->fd, &header, sizeof(header)))
+		write_full(request->connection->fd, response, header.data_length);
+
+	free(response);
+}
+
+bool read_full(int fd, void* buffer, size_t size)
+{
+	size_t done = 0;
+	while (done < size)
+	{
+		ssize_t result = read(fd, (uint8_t*) buffer + done, size - done);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0)
+			return false;
+		done += result;
+	}
+
+	return true;
+}
+
+bool write_full(int fd, const void* buffer, size_t size)
+{
+	size_t done = 0;
+	while (done < size)
+	{
+		ssize_t result = send(fd, (const uint8_t*) buffer + done, size - done, MSG_NOSIGNAL);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0)
+			return false;
+		done += result;
+	}
+
+	return true;
+}
+
+// Trava de um diretório no modo servidor, compartilhada para ler as entradas e exclusiva para alterá-las. A do root_dir
+// (cluster 0x00) é também compartilhada durante toda navegação, que sempre passa por ele.
+pthread_rwlock_t* directory_lock(unsigned index)
+{
+	return &directory_locks[index % DIRECTORY_LOCKS];
+}
+
+// Caminha, sem alterar nada, até o diretório na profundidade depth do caminho. Os diretórios abaixo do root_dir são lidos como
+// cópias inteiras do cluster, então a navegação não vê uma alteração pela metade.
+bool locate_directory(path_t* path, unsigned depth, unsigned* index, unsigned* type, unsigned* return_info)
+{
+	pthread_rwlock_rdlock(directory_lock(0x00));
+	bool found = directory_navigator(path, depth, index, return_info, type, NAV_READ);
+	pthread_rwlock_unlock(directory_lock(0x00));
+
+	if (found && *type != SUB_DIR && *type != SORTED_DIR)
+	{
+		*return_info = NOT_A_DIR;
+		return false;
+	}
+
+	return found;
+}
+
+// Procura a entrada pelo nome no diretório (root_dir ou cluster index), copiando-a para entry.
+bool find_entry(unsigned index, path_component_t* component, dir_entry_t* entry)
+{
+	data_cluster cluster;
+	dir_entry_t* dir = root_dir;
+	if (index != 0x00)
+	{
+		get_data_cluster(index, &cluster);
+		dir = cluster.dir;
+	}
+
+	uint32_t candidates = name_candidates(dir, component);
+	for (int i = 0; i < 32; i++)
+	{
+		if (dir[i].first_block != 0x00 && (candidates >> i & 1) && entry_matches(&dir[i], component))
+		{
+			*entry = dir[i];
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// O pedido precisa do volume só para si: algum diretório do caminho ainda é compartilhado com snapshots (unshare_directories
+// precisaria copiá-lo) ou é ordenado (uma entrada nova pode dividir uma folha e reescrever o índice, que as navegações leem sem trava).
+bool needs_whole_volume(path_t* path, unsigned depth)
+{
+	unsigned parent = 0x00;
+	for (unsigned i = 0; i < depth; i++)
+	{
+		dir_entry_t entry;
+		if (!find_entry(parent, &path->components[i], &entry) || entry.attributes != 0x1)
+			return false;
+
+		if (is_shared_cluster(entry.first_block) || (entry.reserved[0] & ENTRY_SORTED))
+			return true;
+
+		parent = entry.first_block;
+	}
+
+	return false;
+}
+
+bool server_lookup(path_t* path, dir_entry_t* entry, unsigned* return_info)
+{
+	// O próprio root_dir não tem entrada: devolve uma de diretório, sem nome.
+	memset(entry, 0x00, sizeof(dir_entry_t));
+	if (path->size == 0)
+	{
+		entry->attributes = 0x1;
+		return true;
+	}
+
+	unsigned index = 0, type = 0;
+	pthread_rwlock_rdlock(&volume_lock);
+	bool found = locate_directory(path, path->size - 1, &index, &type, return_info);
+	if (found)
+	{
+		pthread_rwlock_rdlock(directory_lock(index));
+		found = find_entry(index, &path->components[path->size - 1], entry);
+		pthread_rwlock_unlock(directory_lock(index));
+
+		if (!found)
+			*return_info = NOT_FOUND_FILE;
+	}
+	pthread_rwlock_unlock(&volume_lock);
+
+	return found;
+}
+
+bool server_read(path_t* path, char** data, unsigned* return_info)
+{
+	if (path->size == 0)
+	{
+		*return_info = NOT_A_FILE;
+		return false;
+	}
+
+	unsigned index = 0, type = 0;
+	pthread_rwlock_rdlock(&volume_lock);
+	bool success = locate_directory(path, path->size - 1, &index, &type, return_info);
+	if (success)
+	{
+		pthread_rwlock_rdlock(directory_lock(index));
+		success = read_file(path, index, data, return_info);
+		pthread_rwlock_unlock(directory_lock(index));
+	}
+	pthread_rwlock_unlock(&volume_lock);
+
+	return success;
+}
+
+// Copia as entradas ocupadas do diretório (sem as de continuação dos arquivos inline) para um vetor alocado em entries. Como no
+// ls do shell, um último nome terminado em '*' pede só as entradas que começam com o restante dele, e um diretório ordenado sai
+// em ordem de nome.
+bool server_ls(path_t* path, dir_entry_t** entries, unsigned* num_entries, unsigned* return_info)
+{
+	char* prefix = empty_input;
+	if (path->size > 0 && path->components[path->size - 1].name[path->components[path->size - 1].length - 1] == '*')
+	{
+		path->size--;
+		prefix = path->components[path->size].name;
+		prefix[path->components[path->size].length - 1] = '\0';
+	}
+
+	unsigned index = 0, type = 0;
+	pthread_rwlock_rdlock(&volume_lock);
+	bool success = locate_directory(path, path->size, &index, &type, return_info);
+	if (success)
+	{
+		pthread_rwlock_rdlock(directory_lock(index));
+		*num_entries = list_entries(index, type == SORTED_DIR, prefix, entries);
+		prefetch_subdirectories(*entries, *num_entries);
+		pthread_rwlock_unlock(directory_lock(index));
+	}
+	pthread_rwlock_unlock(&volume_lock);
+
+	return success;
+}
+
+// Pedidos que alteram o volume (write e mkdir). Eles são executados um de cada vez, com o diretório alterado travado para os
+// leitores; pedidos em outros diretórios continuam sendo lidos ao mesmo tempo. Quando um diretório do caminho ainda pertence a
+// um snapshot, copiá-lo altera também os diretórios acima dele, e o pedido passa a ter o volume só para si; o mesmo vale para
+// caminhos que passam por um diretório ordenado.
+bool server_change(path_t* path, unsigned op, char* data, unsigned* return_info)
+{
+	if (path->size == 0)
+	{
+		*return_info = INVALID_DIR;
+		return false;
+	}
+
+	pthread_rwlock_rdlock(&volume_lock);
+	pthread_rwlock_rdlock(directory_lock(0x00));
+	bool exclusive = needs_whole_volume(path, path->size);
+	pthread_rwlock_unlock(directory_lock(0x00));
+	if (exclusive)
+	{
+		pthread_rwlock_unlock(&volume_lock);
+		pthread_rwlock_wrlock(&volume_lock);
+	}
+
+	bool success = false;
+	unsigned index = 0, type = 0;
+	if (exclusive && !unshare_directories(path, path->size))
+	{
+		*return_info = BLOATED_SYSTEM;
+		save();
+	}
+	else if (locate_directory(path, path->size - 1, &index, &type, return_info))
+	{
+		if (!exclusive)
+		{
+			pthread_mutex_lock(&allocation_lock);
+			pthread_rwlock_wrlock(directory_lock(index));
+		}
+
+		success = apply_change(path, op, index, data, return_info);
+		save();
+
+		if (!exclusive)
+		{
+			pthread_rwlock_unlock(directory_lock(index));
+			pthread_mutex_unlock(&allocation_lock);
+		}
+	}
+
+	pthread_rwlock_unlock(&volume_lock);
+	return success;
+}
+
+// Cria o diretório ou grava o arquivo (criando-o, se preciso) no diretório index, que já existe.
+bool apply_change(path_t* path, unsigned op, unsigned index, char* data, unsigned* return_info)
+{
+	dir_entry_t entry;
+	bool exists = find_entry(index, &path->components[path->size - 1], &entry);
+
+	if (op == OP_MKDIR)
+	{
+		if (exists)
+		{
+			*return_info = ALREADY_EXISTS;
+			return false;
+		}
+
+		unsigned created = 0, type = 0;
+		return directory_navigator(path, path->size, &created, return_info, &type, NAV_CREATE);
+	}
+
+	if (exists && entry.attributes == 0x1)
+	{
+		*return_info = NOT_A_FILE;
+		return false;
+	}
+
+	// Em um diretório ordenado, a folha que recebe o arquivo novo pode precisar ser dividida antes.
+	if (!exists && (!make_room(path, path->size - 1, &path->components[path->size - 1], &index, return_info) || !create_file(path, return_info, index)))
+		return false;
 
-	free(*pieces);
+	return write_file(path, index, data, return_info);
 }
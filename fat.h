@@ -0,0 +1,97 @@
+#ifndef FAT_H
+#define FAT_H
+
+/*INCLUDE*/
+#include <stdint.h>
+
+/*DEFINE*/
+// Layout do arquivo fat.part, compartilhado entre o shell (fat) e o gerador de imagens (mkfat16).
+#define SECTOR_SIZE		512
+#define CLUSTER_SIZE		(2 * SECTOR_SIZE)
+#define ENTRY_BY_CLUSTER 	(CLUSTER_SIZE / sizeof(dir_entry_t))
+#define NUM_CLUSTER		4096
+#define fat_name		"fat.part"
+#define ref_suffix		".ref" // Tabela de referências dos clusters compartilhados, ao lado da imagem (fat.part.ref).
+#define snap_suffix		".snap" // Snapshots do volume, ao lado da imagem (fat.part.snap).
+#define dedup_suffix		".dedup" // Índice de deduplicação (resumo do conteúdo de cada cluster), ao lado da imagem (fat.part.dedup).
+#define ENTRY_COMPRESSED	0x01 // Bit de reserved[0] (flags da entrada): conteúdo do arquivo gravado comprimido (lz.h).
+#define ENTRY_INLINE		0x02 // Bit de reserved[0]: conteúdo guardado no próprio diretório, em entradas de continuação (first_block = 0xffff).
+#define INLINE_SLOT		0x2 // Atributo de uma entrada de continuação; reserved[1] e reserved[2] do arquivo guardam o índice (+ 1) de cada uma.
+#define INLINE_SLOT_BYTES	25 // Bytes de conteúdo por entrada de continuação (filename e reserved).
+#define INLINE_MAX_SLOTS	2
+#define INLINE_MAX_SIZE		(INLINE_SLOT_BYTES * INLINE_MAX_SLOTS)
+#define ENTRY_SORTED		0x04 // Bit de reserved[0] de um diretório: diretório ordenado, first_block é a raiz do seu índice (sorted_node_t).
+#define NAME_HASH_OFFSET	3 // reserved[3] a reserved[6]: entry_name_hash do filename, 0 se desconhecido (entradas gravadas por versões antigas).
+#define SUMMARY_OFFSET		8 // Posição do volume_summary_t no boot block, depois dos bytes 0xbb.
+#define SUMMARY_MAGIC		0x53544146 // "FATS"
+#define SORTED_FANOUT		50 // Filhos por nó do índice de um diretório ordenado.
+
+struct _dir_entry_t
+{
+	unsigned char filename[18];
+	unsigned char attributes;
+	unsigned char reserved[7];
+	unsigned short first_block;
+	unsigned int size;
+};
+
+typedef struct _dir_entry_t  dir_entry_t;
+
+// FNV-1a de 32 bits sobre o nome, guardado em cada entrada para a busca comparar os nomes só quando o hash coincide (name_scan.h).
+static inline uint32_t entry_name_hash(const char* name, unsigned length)
+{
+	uint32_t hash = 2166136261u;
+	for (unsigned i = 0; i < length; i++)
+	{
+		hash ^= (unsigned char) name[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+// Resumo do volume guardado no boot block, para carregar a imagem sem percorrer a FAT nem a árvore. Só vale com clean = 1: enquanto
+// o volume está carregado ele fica 0 no disco, e um volume que não foi fechado é recontado por inteiro no próximo load.
+struct _volume_summary_t
+{
+	uint32_t magic;
+	uint32_t free_clusters;
+	uint64_t used_bytes;
+	uint16_t next_free; // Cluster por onde a próxima alocação começa a procurar.
+	uint8_t clean;
+};
+
+typedef struct _volume_summary_t volume_summary_t;
+
+// Nó do índice de um diretório ordenado, uma árvore B+ guardada em clusters. As folhas são clusters de diretório comuns, com as
+// entradas sem ordem entre si. O filho keys[i].block cobre os nomes a partir de keys[i].name (o de keys[0] fica vazio) até o
+// keys[i + 1].name seguinte, sem incluí-lo. level é 1 quando os filhos são folhas. Uma folha que fica vazia sai do índice e é
+// liberada (sorted_drop_leaf); folhas com entradas não são unidas.
+struct _sorted_key_t
+{
+	unsigned char name[18];
+	unsigned short block;
+};
+
+typedef struct _sorted_key_t sorted_key_t;
+
+struct _sorted_node_t
+{
+	uint16_t level;
+	uint16_t count;
+	uint32_t reserved;
+	sorted_key_t keys[SORTED_FANOUT];
+};
+
+typedef struct _sorted_node_t sorted_node_t;
+
+union _data_cluster
+{
+	dir_entry_t dir[CLUSTER_SIZE / sizeof(dir_entry_t)];
+	sorted_node_t node;
+	uint8_t data[CLUSTER_SIZE];
+};
+
+typedef union _data_cluster data_cluster;
+
+#endif
@@ -0,0 +1,236 @@
+/*INCLUDE*/
+#include <stdlib.h>
+#include <string.h>
+#include "lz.h"
+
+/*DEFINE*/
+#define LZ_HASH_BITS		12
+#define LZ_MAX_OFFSET		65535
+
+/*FUNCTION DECLARATION*/
+static unsigned lz_hash(const uint8_t*);
+static bool lz_put_length(uint8_t*, unsigned*, unsigned, unsigned);
+
+// Formato de um bloco: token (4 bits de tamanho dos literais, 4 bits de tamanho da cópia - LZ_MIN_MATCH), bytes extras de
+// tamanho (255 até o último), literais, deslocamento da cópia em 2 bytes e bytes extras do tamanho da cópia.
+// A última sequência tem apenas literais. Retorna o tamanho comprimido, ou 0 caso ele não caiba em capacity.
+unsigned lz_compress(const uint8_t* source, unsigned size, uint8_t* destination, unsigned capacity)
+{
+	unsigned short table[1 << LZ_HASH_BITS]; // Última posição (+ 1) de cada sequência de 4 bytes.
+	memset(table, 0x00, sizeof(table));
+
+	unsigned position = 0, anchor = 0, output = 0;
+	while (position + LZ_MIN_MATCH <= size)
+	{
+		unsigned hash = lz_hash(source + position);
+		unsigned reference = table[hash];
+		table[hash] = position + 1;
+
+		if (reference == 0 || position - (reference - 1) > LZ_MAX_OFFSET || memcmp(source + reference - 1, source + position, LZ_MIN_MATCH) != 0)
+		{
+			position++;
+			continue;
+		}
+
+		reference--;
+		unsigned match_length = LZ_MIN_MATCH;
+		while (position + match_length < size && source[reference + match_length] == source[position + match_length])
+			match_length++;
+
+		// Sequência: token, literais pendentes, deslocamento e tamanho da cópia.
+		unsigned literal_length = position - anchor;
+		unsigned token_position = output++;
+		if (token_position >= capacity)
+			return 0;
+
+		destination[token_position] = ((literal_length >= 15 ? 15 : literal_length) << 4) | (match_length - LZ_MIN_MATCH >= 15 ? 15 : match_length - LZ_MIN_MATCH);
+		if (literal_length >= 15 && !lz_put_length(destination, &output, capacity, literal_length - 15))
+			return 0;
+
+		if (output + literal_length + 2 > capacity)
+			return 0;
+
+		memcpy(destination + output, source + anchor, literal_length);
+		output += literal_length;
+
+		unsigned offset = position - reference;
+		destination[output++] = offset & 0xff;
+		destination[output++] = offset >> 8;
+
+		if (match_length - LZ_MIN_MATCH >= 15 && !lz_put_length(destination, &output, capacity, match_length - LZ_MIN_MATCH - 15))
+			return 0;
+
+		position += match_length;
+		anchor = position;
+	}
+
+	// Literais finais.
+	unsigned literal_length = size - anchor;
+	if (output >= capacity)
+		return 0;
+
+	destination[output++] = (literal_length >= 15 ? 15 : literal_length) << 4;
+	if (literal_length >= 15 && !lz_put_length(destination, &output, capacity, literal_length - 15))
+		return 0;
+
+	if (output + literal_length > capacity)
+		return 0;
+
+	memcpy(destination + output, source + anchor, literal_length);
+	return output + literal_length;
+}
+
+// Descomprime um bloco que deve resultar em exatamente size bytes. Entradas corrompidas retornam false.
+bool lz_decompress(const uint8_t* source, unsigned source_size, uint8_t* destination, unsigned size)
+{
+	unsigned input = 0, output = 0;
+	while (input < source_size)
+	{
+		unsigned token = source[input++];
+
+		unsigned literal_length = token >> 4;
+		if (literal_length == 15)
+		{
+			unsigned extra;
+			do
+			{
+				if (input >= source_size)
+					return false;
+				extra = source[input++];
+				literal_length += extra;
+			} while (extra == 255);
+		}
+
+		if (input + literal_length > source_size || output + literal_length > size)
+			return false;
+
+		memcpy(destination + output, source + input, literal_length);
+		input += literal_length;
+		output += literal_length;
+
+		// A última sequência não tem cópia.
+		if (input == source_size)
+			break;
+
+		if (input + 2 > source_size)
+			return false;
+
+		unsigned offset = source[input] | (source[input + 1] << 8);
+		input += 2;
+
+		unsigned match_length = (token & 0x0f) + LZ_MIN_MATCH;
+		if ((token & 0x0f) == 15)
+		{
+			unsigned extra;
+			do
+			{
+				if (input >= source_size)
+					return false;
+				extra = source[input++];
+				match_length += extra;
+			} while (extra == 255);
+		}
+
+		if (offset == 0 || offset > output || output + match_length > size)
+			return false;
+
+		// A cópia pode sobrepor o próprio trecho sendo escrito (repetições), então é feita byte a byte.
+		for (unsigned i = 0; i < match_length; i++, output++)
+			destination[output] = destination[output - offset];
+	}
+
+	return output == size;
+}
+
+// Monta o conteúdo gravado de um arquivo comprimido: quantidade de pedaços (2 bytes), tamanho gravado de cada pedaço
+// (2 bytes, com LZ_RAW_CHUNK para pedaços que não diminuíram) e os pedaços em sequência. Retorna o tamanho do resultado.
+unsigned lz_pack(const uint8_t* data, unsigned size, uint8_t** packed)
+{
+	unsigned num_chunks = (size + LZ_CHUNK_SIZE - 1) / LZ_CHUNK_SIZE;
+	unsigned header_size = 2 + (2 * num_chunks);
+
+	*packed = (uint8_t*) malloc(header_size + size + 1);
+	(*packed)[0] = num_chunks & 0xff;
+	(*packed)[1] = num_chunks >> 8;
+
+	unsigned output = header_size;
+	for (unsigned c = 0; c < num_chunks; c++)
+	{
+		unsigned chunk_size = size - (c * LZ_CHUNK_SIZE) >= LZ_CHUNK_SIZE ? LZ_CHUNK_SIZE : size - (c * LZ_CHUNK_SIZE);
+		const uint8_t* chunk = data + (c * LZ_CHUNK_SIZE);
+
+		unsigned stored = lz_compress(chunk, chunk_size, *packed + output, chunk_size - 1);
+		unsigned entry = stored;
+		if (stored == 0)
+		{
+			memcpy(*packed + output, chunk, chunk_size);
+			stored = chunk_size;
+			entry = chunk_size | LZ_RAW_CHUNK;
+		}
+
+		(*packed)[2 + (2 * c)] = entry & 0xff;
+		(*packed)[3 + (2 * c)] = entry >> 8;
+		output += stored;
+	}
+
+	return output;
+}
+
+// Reconstrói os size bytes do arquivo a partir do conteúdo gravado por lz_pack.
+bool lz_unpack(const uint8_t* packed, unsigned packed_size, uint8_t* data, unsigned size)
+{
+	if (packed_size < 2)
+		return false;
+
+	unsigned num_chunks = packed[0] | (packed[1] << 8);
+	if (num_chunks != (size + LZ_CHUNK_SIZE - 1) / LZ_CHUNK_SIZE || 2 + (2 * num_chunks) > packed_size)
+		return false;
+
+	unsigned input = 2 + (2 * num_chunks);
+	for (unsigned c = 0; c < num_chunks; c++)
+	{
+		unsigned chunk_size = size - (c * LZ_CHUNK_SIZE) >= LZ_CHUNK_SIZE ? LZ_CHUNK_SIZE : size - (c * LZ_CHUNK_SIZE);
+		unsigned entry = packed[2 + (2 * c)] | (packed[3 + (2 * c)] << 8);
+		unsigned stored = entry & ~LZ_RAW_CHUNK;
+
+		if (input + stored > packed_size)
+			return false;
+
+		if (entry & LZ_RAW_CHUNK)
+		{
+			if (stored != chunk_size)
+				return false;
+			memcpy(data + (c * LZ_CHUNK_SIZE), packed + input, chunk_size);
+		}
+		else if (!lz_decompress(packed + input, stored, data + (c * LZ_CHUNK_SIZE), chunk_size))
+			return false;
+
+		input += stored;
+	}
+
+	return true;
+}
+
+static unsigned lz_hash(const uint8_t* bytes)
+{
+	uint32_t sequence;
+	memcpy(&sequence, bytes, sizeof(sequence));
+	return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Bytes extras de um tamanho: 255 enquanto sobrar, e o resto no último.
+static bool lz_put_length(uint8_t* destination, unsigned* output, unsigned capacity, unsigned length)
+{
+	while (length >= 255)
+	{
+		if (*output >= capacity)
+			return false;
+		destination[(*output)++] = 255;
+		length -= 255;
+	}
+
+	if (*output >= capacity)
+		return false;
+	destination[(*output)++] = length;
+	return true;
+}
@@ -0,0 +1,21 @@
+#ifndef LZ_H
+#define LZ_H
+
+/*INCLUDE*/
+#include <stdint.h>
+#include <stdbool.h>
+
+/*DEFINE*/
+// Compressor LZ77 no estilo do LZ4 (sequências de literais seguidas de uma cópia com deslocamento de 16 bits), sem dependências.
+// Os arquivos são divididos em pedaços de tamanho fixo, comprimidos separadamente, para que um trecho possa ser lido sem
+// descomprimir o arquivo inteiro.
+#define LZ_CHUNK_SIZE		4096
+#define LZ_MIN_MATCH		4
+#define LZ_RAW_CHUNK		0x8000 // Marca, na tabela de pedaços, um pedaço guardado sem compressão.
+
+unsigned lz_compress(const uint8_t*, unsigned, uint8_t*, unsigned);
+bool lz_decompress(const uint8_t*, unsigned, uint8_t*, unsigned);
+unsigned lz_pack(const uint8_t*, unsigned, uint8_t**);
+bool lz_unpack(const uint8_t*, unsigned, uint8_t*, unsigned);
+
+#endif
@@ -0,0 +1,400 @@
+/*INCLUDE*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "fat.h"
+
+/*DEFINE*/
+#define MAX_LINE_SIZE		4096
+#define FIRST_DATA_BLOCK	10
+
+// Entrada (arquivo ou diretório) da imagem a ser gerada.
+struct _image_node_t
+{
+	char name[18];
+	bool is_dir;
+	int parent; // Índice do nó pai, -1 para o root_dir.
+	char* host_path; // Arquivo do host com o conteúdo (NULL para diretórios).
+	unsigned size;
+	unsigned first_block;
+	unsigned num_clusters;
+	unsigned num_children;
+};
+
+typedef struct _image_node_t image_node_t;
+
+/*DATA DECLARATION*/
+image_node_t* nodes;
+unsigned num_nodes;
+
+/*FUNCTION DECLARATION*/
+bool add_host_tree(char*, int);
+bool add_manifest(char*);
+int add_node(int, char*, bool, char*);
+int find_node(int, char*);
+bool write_image(char*);
+void usage(char*);
+
+int main(int argc, char** argv)
+{
+	char* output = fat_name;
+	char* host_dir = NULL;
+	char* manifest = NULL;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+			output = argv[++i];
+		else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+			host_dir = argv[++i];
+		else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+			manifest = argv[++i];
+		else
+		{
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	// Exatamente uma fonte deve ser informada.
+	if ((host_dir == NULL) == (manifest == NULL))
+	{
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (host_dir != NULL && !add_host_tree(host_dir, -1))
+		return EXIT_FAILURE;
+
+	if (manifest != NULL && !add_manifest(manifest))
+		return EXIT_FAILURE;
+
+	if (!write_image(output))
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
+
+void usage(char* program)
+{
+	fprintf(stderr, "Uso: %s [-o IMAGEM] (-d DIRETORIO_DO_HOST | -m MANIFESTO)\n", program);
+	fprintf(stderr, "Linhas do manifesto: 'dir /CAMINHO' ou 'file /CAMINHO ARQUIVO_DO_HOST' ('#' inicia um comentário).\n");
+}
+
+// Acrescenta recursivamente a árvore do host, em ordem alfabética, para que a imagem seja determinística.
+bool add_host_tree(char* host_path, int parent)
+{
+	struct dirent** host_entries = NULL;
+	int num_host_entries = scandir(host_path, &host_entries, NULL, alphasort);
+	if (num_host_entries < 0)
+	{
+		fprintf(stderr, "Não foi possível ler o diretório %s.\n", host_path);
+		return false;
+	}
+
+	bool success = true;
+	for (int i = 0; i < num_host_entries; i++)
+	{
+		char* name = host_entries[i]->d_name;
+		if (success && strcmp(name, ".") != 0 && strcmp(name, "..") != 0)
+		{
+			char* child_path = (char*) malloc((strlen(host_path) + strlen(name) + 2) * sizeof(char));
+			sprintf(child_path, "%s/%s", host_path, name);
+
+			// lstat não segue links simbólicos: um link para um diretório acima dele faria a descida não terminar.
+			struct stat host_stat;
+			if (lstat(child_path, &host_stat) != 0)
+			{
+				fprintf(stderr, "Não foi possível acessar %s.\n", child_path);
+				success = false;
+			}
+			// Somente arquivos regulares e diretórios entram na imagem (links simbólicos são ignorados).
+			else if (S_ISDIR(host_stat.st_mode))
+			{
+				int node = add_node(parent, name, true, NULL);
+				success = node >= 0 && add_host_tree(child_path, node);
+			}
+			else if (S_ISREG(host_stat.st_mode))
+				success = add_node(parent, name, false, child_path) >= 0;
+
+			free(child_path);
+		}
+
+		free(host_entries[i]);
+	}
+
+	free(host_entries);
+	return success;
+}
+
+// Lê o manifesto, na ordem em que as linhas aparecem. Diretórios intermediários são criados implicitamente.
+bool add_manifest(char* manifest_path)
+{
+	FILE* manifest = fopen(manifest_path, "r");
+	if (manifest == NULL)
+	{
+		fprintf(stderr, "Não foi possível abrir o manifesto %s.\n", manifest_path);
+		return false;
+	}
+
+	char line[MAX_LINE_SIZE];
+	unsigned line_number = 0;
+	bool success = true;
+	while (success && fgets(line, MAX_LINE_SIZE, manifest) != NULL)
+	{
+		line_number++;
+
+		char* type = strtok(line, " \t\r\n");
+		if (type == NULL || type[0] == '#')
+			continue;
+
+		char* path = strtok(NULL, " \t\r\n");
+		char* host_file = strtok(NULL, " \t\r\n");
+		bool is_dir = strcmp(type, "dir") == 0;
+
+		if (path == NULL || (!is_dir && strcmp(type, "file") != 0) || (is_dir == (host_file != NULL)))
+		{
+			fprintf(stderr, "Linha %u do manifesto inválida.\n", line_number);
+			success = false;
+			break;
+		}
+
+		// Caminha pelas partes do caminho, criando os diretórios que ainda não existem.
+		int parent = -1;
+		char* piece = strtok(path, "/");
+		while (piece != NULL && success)
+		{
+			char* next_piece = strtok(NULL, "/");
+			bool is_leaf = next_piece == NULL;
+
+			// Os nomes viram entradas de diretório literais: um ".." não volta ao diretório pai, e o fat e o export-tree o recusam.
+			if (strcmp(piece, "..") == 0)
+			{
+				fprintf(stderr, "Linha %u do manifesto: '..' não é permitido no caminho.\n", line_number);
+				success = false;
+			}
+			else if (strlen(piece) > 17)
+			{
+				fprintf(stderr, "Linha %u do manifesto: nome %s muito longo (máximo de 17 caracteres).\n", line_number, piece);
+				success = false;
+			}
+			else if (strcmp(piece, ".") != 0)
+			{
+				int node = find_node(parent, piece);
+				if (node >= 0 && (!nodes[node].is_dir || (is_leaf && !is_dir)))
+				{
+					fprintf(stderr, "Linha %u do manifesto: %s já existe.\n", line_number, piece);
+					success = false;
+				}
+				else if (node < 0)
+				{
+					node = add_node(parent, piece, !is_leaf || is_dir, is_leaf ? host_file : NULL);
+					success = node >= 0;
+				}
+
+				parent = node;
+			}
+
+			piece = next_piece;
+		}
+	}
+
+	fclose(manifest);
+	return success;
+}
+
+// Acrescenta um nó e reserva seus clusters logo após os do nó anterior, mantendo todo o conteúdo contíguo.
+int add_node(int parent, char* name, bool is_dir, char* host_path)
+{
+	if (strlen(name) > 17)
+	{
+		fprintf(stderr, "Nome %s muito longo (máximo de 17 caracteres).\n", name);
+		return -1;
+	}
+
+	if ((parent == -1 ? find_node(-1, NULL) : (int) nodes[parent].num_children) >= 32)
+	{
+		fprintf(stderr, "Diretório lotado ao inserir %s.\n", name);
+		return -1;
+	}
+
+	unsigned size = 0;
+	if (!is_dir)
+	{
+		struct stat host_stat;
+		if (stat(host_path, &host_stat) != 0 || !S_ISREG(host_stat.st_mode))
+		{
+			fprintf(stderr, "Não foi possível acessar o arquivo %s.\n", host_path);
+			return -1;
+		}
+
+		if (host_stat.st_size > (off_t) NUM_CLUSTER * CLUSTER_SIZE)
+		{
+			fprintf(stderr, "Não há espaço disponível para %s.\n", host_path);
+			return -1;
+		}
+
+		size = host_stat.st_size;
+	}
+
+	unsigned first_block = FIRST_DATA_BLOCK;
+	if (num_nodes > 0)
+		first_block = nodes[num_nodes - 1].first_block + nodes[num_nodes - 1].num_clusters;
+
+	unsigned num_clusters = size == 0 ? 1 : (size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+	if (first_block + num_clusters > NUM_CLUSTER)
+	{
+		fprintf(stderr, "Não há espaço disponível para %s.\n", name);
+		return -1;
+	}
+
+	nodes = (image_node_t*) realloc(nodes, (num_nodes + 1) * sizeof(image_node_t));
+	image_node_t* node = &nodes[num_nodes];
+	memset(node, 0x00, sizeof(image_node_t));
+	strcpy(node->name, name);
+	node->is_dir = is_dir;
+	node->parent = parent;
+	node->host_path = is_dir ? NULL : strdup(host_path);
+	node->size = size;
+	node->first_block = first_block;
+	node->num_clusters = num_clusters;
+
+	if (parent != -1)
+		nodes[parent].num_children++;
+
+	return num_nodes++;
+}
+
+// Procura um filho de parent com o nome passado. Com name NULL, retorna a quantidade de filhos de parent.
+int find_node(int parent, char* name)
+{
+	int children = 0;
+	for (unsigned i = 0; i < num_nodes; i++)
+	{
+		if (nodes[i].parent != parent)
+			continue;
+
+		if (name != NULL && strcmp(nodes[i].name, name) == 0)
+			return i;
+
+		children++;
+	}
+
+	return name == NULL ? children : -1;
+}
+
+// Monta a imagem inteira em memória (boot block, FAT, root_dir e dados) e a grava com uma única escrita sequencial.
+bool write_image(char* output)
+{
+	unsigned end_block = FIRST_DATA_BLOCK;
+	if (num_nodes > 0)
+		end_block = nodes[num_nodes - 1].first_block + nodes[num_nodes - 1].num_clusters;
+
+	// Mesmo tamanho do init; a imagem só cresce se os dados ultrapassarem esse limite.
+	size_t image_size = (size_t) NUM_CLUSTER * CLUSTER_SIZE;
+	if ((size_t) (FIRST_DATA_BLOCK + end_block) * CLUSTER_SIZE > image_size)
+		image_size = (size_t) (FIRST_DATA_BLOCK + end_block) * CLUSTER_SIZE;
+
+	uint8_t* image = (uint8_t*) calloc(image_size, 1);
+	unsigned short* fat = (unsigned short*) (image + CLUSTER_SIZE);
+	dir_entry_t* root_dir = (dir_entry_t*) (image + CLUSTER_SIZE + (NUM_CLUSTER * sizeof(unsigned short)));
+
+	// Boot block e clusters reservados, iguais aos do init.
+	image[0] = 0xbb;
+	image[1] = 0xbb;
+	fat[0] = 0xfffd;
+	for (int i = 1; i < 9; i++)
+		fat[i] = 0xfffe;
+	fat[9] = 0xffff;
+
+	bool success = true;
+	unsigned* used_entries = (unsigned*) calloc(num_nodes + 1, sizeof(unsigned));
+	unsigned root_entries = 0;
+	for (unsigned n = 0; n < num_nodes && success; n++)
+	{
+		image_node_t* node = &nodes[n];
+		uint8_t* node_data = image + ((FIRST_DATA_BLOCK + node->first_block) * CLUSTER_SIZE);
+
+		// Cadeia contígua na FAT.
+		for (unsigned k = 0; k + 1 < node->num_clusters; k++)
+			fat[node->first_block + k] = node->first_block + k + 1;
+		fat[node->first_block + node->num_clusters - 1] = 0xffff;
+
+		// Entrada de diretório no pai.
+		dir_entry_t* entry;
+		if (node->parent == -1)
+			entry = &root_dir[root_entries++];
+		else
+			entry = &((data_cluster*) (image + ((FIRST_DATA_BLOCK + nodes[node->parent].first_block) * CLUSTER_SIZE)))->dir[used_entries[node->parent]++];
+
+		strcpy(entry->filename, node->name);
+		uint32_t hash = entry_name_hash(node->name, strlen(node->name));
+		memcpy(&entry->reserved[NAME_HASH_OFFSET], &hash, sizeof(hash));
+		entry->attributes = node->is_dir ? 0x1 : 0x0;
+		entry->first_block = node->first_block;
+		entry->size = node->size;
+
+		// Conteúdo do arquivo, lido diretamente para a posição final na imagem.
+		if (!node->is_dir)
+		{
+			FILE* host_file = fopen(node->host_path, "rb");
+			if (host_file == NULL || fread(node_data, 1, node->size, host_file) != node->size)
+			{
+				fprintf(stderr, "Não foi possível ler o arquivo %s.\n", node->host_path);
+				success = false;
+			}
+
+			if (host_file != NULL)
+				fclose(host_file);
+		}
+	}
+
+	free(used_entries);
+
+	// Resumo do volume, como o shell grava ao fechar a imagem: o primeiro load não precisa percorrer a FAT.
+	volume_summary_t* summary = (volume_summary_t*) (image + SUMMARY_OFFSET);
+	summary->magic = SUMMARY_MAGIC;
+	summary->free_clusters = 0;
+	for (unsigned i = FIRST_DATA_BLOCK; i < NUM_CLUSTER; i++)
+		if (fat[i] == 0x00)
+			summary->free_clusters++;
+	summary->used_bytes = 0;
+	for (unsigned n = 0; n < num_nodes; n++)
+		if (!nodes[n].is_dir)
+			summary->used_bytes += nodes[n].size;
+	summary->next_free = end_block < NUM_CLUSTER ? end_block : FIRST_DATA_BLOCK;
+	summary->clean = 1;
+
+	if (success)
+	{
+		FILE* ptr_file = fopen(output, "wb");
+		if (ptr_file == NULL || fwrite(image, 1, image_size, ptr_file) != image_size)
+		{
+			fprintf(stderr, "Não foi possível escrever o arquivo %s.\n", output);
+			success = false;
+		}
+
+		if (ptr_file != NULL && fclose(ptr_file) != 0)
+			success = false;
+	}
+
+	// A tabela de referências, os snapshots e o índice de deduplicação de uma imagem anterior não valem para a nova.
+	if (success)
+	{
+		char* sidecar_path = (char*) malloc((strlen(output) + strlen(ref_suffix) + strlen(snap_suffix) + strlen(dedup_suffix) + 1) * sizeof(char));
+		sprintf(sidecar_path, "%s%s", output, ref_suffix);
+		remove(sidecar_path);
+		sprintf(sidecar_path, "%s%s", output, snap_suffix);
+		remove(sidecar_path);
+		sprintf(sidecar_path, "%s%s", output, dedup_suffix);
+		remove(sidecar_path);
+		free(sidecar_path);
+	}
+
+	free(image);
+	return success;
+}
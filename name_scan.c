@@ -0,0 +1,130 @@
+/*INCLUDE*/
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "name_scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define NAME_SCAN_X86
+#include <immintrin.h>
+#endif
+
+/*DEFINE*/
+#define HASH_POSITION	(offsetof(dir_entry_t, reserved) + NAME_HASH_OFFSET) // Posição do hash dentro da entrada.
+
+// As versões SIMD leem o hash e, logo depois dele, o first_block, com passo de 32 bytes entre as entradas.
+_Static_assert(sizeof(dir_entry_t) == 32, "dir_entry_t precisa ter 32 bytes");
+_Static_assert(offsetof(dir_entry_t, first_block) == HASH_POSITION + 4, "first_block precisa vir logo depois do hash");
+
+/*FUNCTION DECLARATION*/
+static uint32_t name_scan_scalar(dir_entry_t*, uint32_t);
+#ifdef NAME_SCAN_X86
+static uint32_t name_scan_sse2(dir_entry_t*, uint32_t);
+static uint32_t name_scan_avx2(dir_entry_t*, uint32_t);
+#endif
+
+/*GLOBAL VARIABLES*/
+static uint32_t (*scan)(dir_entry_t*, uint32_t) = name_scan_scalar;
+static const char* scan_name = "scalar";
+
+// Escolhe a implementação; chamada uma vez, antes de qualquer thread.
+void name_scan_select()
+{
+	const char* allowed = getenv("FAT_NAME_SCAN");
+	scan = name_scan_scalar;
+	scan_name = "scalar";
+
+#ifdef NAME_SCAN_X86
+	__builtin_cpu_init();
+	if (allowed != NULL && strcmp(allowed, "scalar") == 0)
+		return;
+
+	if (__builtin_cpu_supports("avx2") && (allowed == NULL || strcmp(allowed, "avx2") == 0))
+	{
+		scan = name_scan_avx2;
+		scan_name = "avx2";
+	}
+	else if (__builtin_cpu_supports("sse2"))
+	{
+		scan = name_scan_sse2;
+		scan_name = "sse2";
+	}
+#endif
+}
+
+const char* name_scan_name()
+{
+	return scan_name;
+}
+
+uint32_t name_scan(dir_entry_t* dir, uint32_t hash)
+{
+	return scan(dir, hash);
+}
+
+static uint32_t name_scan_scalar(dir_entry_t* dir, uint32_t hash)
+{
+	uint32_t candidates = 0;
+	for (unsigned i = 0; i < ENTRY_BY_CLUSTER; i++)
+	{
+		uint32_t stored;
+		memcpy(&stored, (uint8_t*) &dir[i] + HASH_POSITION, sizeof(stored));
+		if (stored == hash || (stored == 0 && dir[i].first_block != 0x00))
+			candidates |= 1u << i;
+	}
+
+	return candidates;
+}
+
+#ifdef NAME_SCAN_X86
+// Quatro entradas por vez. O hash e o first_block são vizinhos (bytes 22 a 27 da entrada): uma leitura de 8 bytes por entrada
+// traz os dois, e os hashes e os first_block das quatro são separados em dois registradores.
+__attribute__((target("sse2")))
+static uint32_t name_scan_sse2(dir_entry_t* dir, uint32_t hash)
+{
+	const __m128i target = _mm_set1_epi32((int) hash);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i block_mask = _mm_set1_epi32(0xffff);
+
+	uint32_t candidates = 0;
+	for (unsigned i = 0; i < ENTRY_BY_CLUSTER; i += 4)
+	{
+		const uint8_t* base = (const uint8_t*) &dir[i] + HASH_POSITION;
+		__m128i low = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*) base), _mm_loadl_epi64((const __m128i*) (base + 32)));
+		__m128i high = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*) (base + 64)), _mm_loadl_epi64((const __m128i*) (base + 96)));
+
+		__m128i hashes = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(low), _mm_castsi128_ps(high), _MM_SHUFFLE(2, 0, 2, 0)));
+		__m128i blocks = _mm_and_si128(_mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(low), _mm_castsi128_ps(high), _MM_SHUFFLE(3, 1, 3, 1))), block_mask);
+
+		__m128i unknown = _mm_andnot_si128(_mm_cmpeq_epi32(blocks, zero), _mm_cmpeq_epi32(hashes, zero));
+		__m128i hit = _mm_or_si128(_mm_cmpeq_epi32(hashes, target), unknown);
+		candidates |= (uint32_t) _mm_movemask_ps(_mm_castsi128_ps(hit)) << i;
+	}
+
+	return candidates;
+}
+
+// Oito entradas por vez: o hash e o first_block de cada uma são lidos com gather (passo de 32 bytes).
+__attribute__((target("avx2")))
+static uint32_t name_scan_avx2(dir_entry_t* dir, uint32_t hash)
+{
+	const __m256i offsets = _mm256_setr_epi32(0, 32, 64, 96, 128, 160, 192, 224);
+	const __m256i target = _mm256_set1_epi32((int) hash);
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i block_mask = _mm256_set1_epi32(0xffff);
+
+	uint32_t candidates = 0;
+	for (unsigned i = 0; i < ENTRY_BY_CLUSTER; i += 8)
+	{
+		const uint8_t* base = (const uint8_t*) &dir[i] + HASH_POSITION;
+		__m256i hashes = _mm256_i32gather_epi32((const int*) base, offsets, 1);
+		__m256i blocks = _mm256_and_si256(_mm256_i32gather_epi32((const int*) (base + 4), offsets, 1), block_mask);
+
+		__m256i unknown = _mm256_andnot_si256(_mm256_cmpeq_epi32(blocks, zero), _mm256_cmpeq_epi32(hashes, zero));
+		__m256i hit = _mm256_or_si256(_mm256_cmpeq_epi32(hashes, target), unknown);
+		candidates |= (uint32_t) _mm256_movemask_ps(_mm256_castsi256_ps(hit)) << i;
+	}
+
+	return candidates;
+}
+#endif
@@ -0,0 +1,17 @@
+#ifndef NAME_SCAN_H
+#define NAME_SCAN_H
+
+/*INCLUDE*/
+#include <stdint.h>
+#include "fat.h"
+
+/*DEFINE*/
+// Busca de nomes em um diretório (root_dir ou cluster, sempre ENTRY_BY_CLUSTER entradas) pelo hash guardado em cada entrada
+// (NAME_HASH_OFFSET). O resultado tem um bit por entrada candidata: hash igual ao procurado, ou entrada em uso (first_block
+// diferente de 0) ainda sem hash. Quem chama confirma cada candidata comparando o nome. A implementação é escolhida ao iniciar,
+// pela CPU (AVX2, SSE2 ou escalar); a variável de ambiente FAT_NAME_SCAN (avx2, sse2 ou scalar) restringe a escolha.
+void name_scan_select();
+const char* name_scan_name();
+uint32_t name_scan(dir_entry_t*, uint32_t);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+/*INCLUDE*/
+#include <stdint.h>
+#include "fat.h"
+
+/*DEFINE*/
+// Protocolo binário do modo servidor (./fat serve SOCKET), sobre um socket Unix do tipo stream. Cada pedido é um
+// request_header_t seguido do caminho (path_length bytes, sem '\0') e, no write, do conteúdo (data_length bytes). O cliente
+// pode enviar vários pedidos sem esperar as respostas: os pedidos de uma conexão são executados na ordem em que chegaram, e as
+// respostas saem nessa mesma ordem, com o id do pedido. Com MAX_PENDING_REQUESTS (fat.c) pedidos sem resposta, o servidor só lê o
+// próximo depois de responder um deles. Cada resposta é um response_header_t seguido de data_length bytes. Os inteiros estão na
+// ordem de bytes da máquina.
+#define OP_LOOKUP		1 // Resposta: a entrada de diretório (dir_entry_t) do caminho.
+#define OP_READ			2 // Resposta: o conteúdo do arquivo.
+#define OP_WRITE		3 // Cria o arquivo, caso não exista, e substitui o conteúdo, que não pode ter bytes 0x00. O diretório precisa existir.
+#define OP_MKDIR		4 // Cria o diretório. O diretório pai precisa existir.
+#define OP_LS			5 // Resposta: as entradas (dir_entry_t) do diretório; em ordem de nome, se o diretório for ordenado. Com um
+				  // '*' no fim do caminho, só as entradas cujo nome começa pelo prefixo antes dele.
+
+#define STATUS_OK		0 // Os demais valores são os códigos de erro do sistema de arquivos (INVALID_DIR, NOT_FOUND_FILE, ...).
+#define MAX_REQUEST_PATH	4096
+#define MAX_REQUEST_DATA	(NUM_CLUSTER * CLUSTER_SIZE)
+
+struct _request_header_t
+{
+	uint32_t id;
+	uint32_t op;
+	uint32_t path_length;
+	uint32_t data_length;
+};
+
+typedef struct _request_header_t request_header_t;
+
+struct _response_header_t
+{
+	uint32_t id;
+	uint32_t status;
+	uint32_t data_length;
+};
+
+typedef struct _response_header_t response_header_t;
+
+#endif